@@ -0,0 +1,47 @@
+#pragma once
+#include<cstdio>
+#include"sizes.h"
+#include"membership_filter.h"
+
+//-----------------------------------------------------------------------------
+// Benchmark results, one CSV line per configuration, written by "host bench"
+// in cpu_src (CPU engine) and in the multiddr step (CPU and FPGA). Times are in
+// seconds. total is the time to score the documents once the profile is set
+// up, and words/s and GB/s are taken over it; setup is reported apart.
+// Phases that do not apply to an engine are 0. The membership filter and
+// bloom_size columns are the build settings (see sizes.h).
+
+struct bench_row {
+   const char* engine;          // cpu, sw_emu, hw_emu or hw
+   unsigned int docs;
+   unsigned int profile_words;
+   unsigned int chunk_words;    // 0: chunks picked by the engine
+   unsigned int units;          // CPU threads or FPGA compute units
+   unsigned long words;
+   double setup;                // profile (and device buffers) ready
+   double transfer;             // documents sent to the device
+   double compute;              // scoring
+   double readback;             // scores back to the host
+   double total;
+   double false_positive_rate;  // membership filter hits not in the profile, per word
+};
+
+// Opens csv for appending, with the header line if the file is new
+inline FILE* openBenchCsv(const char* path)
+{
+   FILE* csv = fopen(path,"a");
+   if (csv && ftell(csv) == 0)
+      fprintf(csv,"engine,docs,filter,bloom_size,profile_words,chunk_words,units,words,setup_s,transfer_s,compute_s,readback_s,total_s,words_per_s,gb_per_s,false_positive_rate\n");
+   return csv;
+}
+
+inline void writeBenchRow(FILE* csv,const bench_row& row)
+{
+   double words_per_s = row.total > 0 ? row.words/row.total : 0;
+   fprintf(csv,"%s,%u,%s,%u,%u,%u,%u,%lu,%.6f,%.6f,%.6f,%.6f,%.6f,%.0f,%.3f,%.6f\n",
+           row.engine,row.docs,membership_filter_name,(unsigned int)bloom_size,row.profile_words,row.chunk_words,row.units,row.words,
+           row.setup,row.transfer,row.compute,row.readback,row.total,
+           words_per_s,words_per_s*sizeof(unsigned int)*1e-9,row.false_positive_rate);
+   printf("%s docs %u %s filter bloom_size %u profile %u chunk %u units %u: %.1f Mwords/s, false positive rate %f%%\n",
+          row.engine,row.docs,membership_filter_name,(unsigned int)bloom_size,row.profile_words,row.chunk_words,row.units,words_per_s*1e-6,row.false_positive_rate*100);
+}
@@ -1,7 +1,31 @@
+#include<vector>
+#include"profile_table.h"
+#include"membership_filter.h"
+#include"topk.h"
+
 typedef unsigned int uint;
 typedef unsigned long ulong;
 
+// Membership filter counters of a runOnCPU_parallel call: words that passed
+// the filter without being in the profile, out of all the scored words
+struct score_counts {
+   unsigned long false_access;
+   unsigned long total;
+};
+
 extern "C" {
-void runOnCPU(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,unsigned long* profile_weights,unsigned long* cpu_profileScore,unsigned int total_num_docs) ;
+void runOnCPU(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned long* cpu_profileScore,unsigned int total_num_docs) ;
+void runOnCPU_parallel(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned long* cpu_profileScore,unsigned int total_num_docs,unsigned int num_threads,bool report=true,score_counts* counts=NULL) ;
+void runOnCPU_parallel_topk(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned int k,doc_score* topk,unsigned int total_num_docs,unsigned int num_threads,bool report=true) ;
+void runOnCPU_parallel_multi(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filters,profile_t* profile_weights,unsigned int num_profiles,unsigned long* cpu_profileScores,unsigned int total_num_docs,unsigned int num_threads,bool report=true,score_counts* counts=NULL) ;
 }
-void run (uint* h_startingDocID_dimm1,uint* h_docSizes_dimm1,uint* h_docWordFrequencies_dimm1,uint* h_isWordInProfileHash,ulong* h_profileWeights,ulong* h_profileScore,unsigned int total_num_docs, unsigned int total_doc_size_1);
+bool buildProfileTable(unsigned int* profile_table,const unsigned int* word_ids,const unsigned int* weights,unsigned int num_words);
+int profileTableInsert(unsigned int* profile_table,unsigned int word_id,unsigned int weight);
+int profileTableRemove(unsigned int* profile_table,unsigned int word_id);
+// Membership filter updates (see membership_filter.h). changed_words, if not NULL,
+// receives the filter words written. filterInsert returns false if the cuckoo
+// filter has no room left, filterRemove if the word is not in the cuckoo filter
+// or the filter is a bloom filter, whose bits cannot be taken out.
+bool filterInsert(unsigned int* filter,unsigned int word_id,std::vector<unsigned long>* changed_words=NULL);
+bool filterRemove(unsigned int* filter,unsigned int word_id,std::vector<unsigned long>* changed_words=NULL);
+void run (uint* h_startingDocID_dimm1,uint* h_docSizes_dimm1,uint* h_docWordFrequencies_dimm1,uint* h_isWordInProfileHash,profile_t* h_profileWeights,ulong* h_profileScore,unsigned int total_num_docs, unsigned int total_doc_size_1);
@@ -4,7 +4,9 @@
 #include<cstdio>
 #include<cstdlib>
 #include"sizes.h"
+#include"MurmurHash2.h"
 #include"kernels.h"
+#include"common.h"
 using namespace std;
 // using namespace std::chrono;
 
@@ -13,11 +15,10 @@ typedef unsigned int uint;
 typedef unsigned long ulong;
 
 
-extern unsigned int MurmurHash2(const void* key ,int len,unsigned int seed);
 
 extern "C" 
 {
-void runOnCPU (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,unsigned long* profile_weights,unsigned long* cpu_profileScore,unsigned int total_num_docs) {
+void runOnCPU (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned long* cpu_profileScore,unsigned int total_num_docs) {
 
 
   // go through each document in turn, and compute the score
@@ -31,25 +32,24 @@ void runOnCPU (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned in
          
          cpu_profileScore[doc] = 0.0;
          unsigned int size = doc_sizes[doc];
-      for (unsigned i = 0; i < size ; i++)
+      for (unsigned i = 0; i < doc_scored_words(size) ; i++)
       { 
          unsigned curr_entry = input_doc_words[size_offset+i];
          unsigned frequency = curr_entry & 0x00ff;
          unsigned word_id = curr_entry >> 8;
-         unsigned hash_pu =  MurmurHash2( &word_id , 3,1);
-         unsigned hash_lu =  MurmurHash2( &word_id , 3,5);
+         murmur2_hashes hashes = murmur2_24(word_id);
+         unsigned hash_pu = hashes.hash_pu;
+         unsigned hash_lu = hashes.hash_lu;
          bool doc_end = (word_id==docTag);
-          unsigned hash1 = hash_pu&hash_bloom;
-         bool inh1 = (!doc_end) && (bloom_filter[ hash1 >> 5 ] & ( 1 << (hash1 & 0x1f)));
-         unsigned hash2 = (hash_pu+hash_lu)&hash_bloom;
-         bool inh2 = (!doc_end) && (bloom_filter[ hash2 >> 5 ] & ( 1 << (hash2 & 0x1f)));
+         bool in_filter = (!doc_end) && filter_contains(bloom_filter,hash_pu,hash_lu);
 
-         if (inh1 && inh2)
+         if (in_filter)
          {  
-            if(profile_weights[word_id]==0) 
+            unsigned long weight = profile_weight(profile_weights,word_id,hash_pu,hash_lu);
+            if(weight==0) 
              false_access++;
           
-            cpu_profileScore[doc] += profile_weights[word_id] * (unsigned long)frequency;
+            cpu_profileScore[doc] += weight * (unsigned long)frequency;
          }
         total++; 
       }
@@ -0,0 +1,591 @@
+#include<iostream>
+#include<thread>
+#include<atomic>
+#include<chrono>
+#include<algorithm>
+#include<vector>
+#include<cstdio>
+#include<cstdlib>
+#include"sizes.h"
+#include"MurmurHash2.h"
+#include"common.h"
+#include"topk.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define BLOOM_X86_SIMD
+#endif
+
+using namespace std;
+
+// Counters collected by each worker, summed at the end for the false positive report
+struct score_stats {
+   unsigned long false_access;
+   unsigned long total;
+   unsigned int ranges;
+   double busy;
+};
+
+// Work is handed out in ranges of about total_words/(threads*ranges_per_thread) words
+const unsigned int ranges_per_thread = 16;
+const unsigned long range_words_min = 16*1024;
+
+enum simd_level { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+static simd_level detect_simd()
+{
+#ifdef BLOOM_X86_SIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+   if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+#endif
+   return SIMD_SCALAR;
+}
+
+// Same computation as runOnCPU for a single word; used for the scalar fallback,
+// for the tail of a document and for the lanes that pass the membership filter.
+static inline unsigned long score_word(unsigned curr_entry,unsigned int* bloom_filter,profile_t* profile_weights,score_stats& stats)
+{
+   unsigned frequency = curr_entry & 0x00ff;
+   unsigned word_id = curr_entry >> 8;
+   murmur2_hashes hashes = murmur2_24(word_id);
+   unsigned hash_pu = hashes.hash_pu;
+   unsigned hash_lu = hashes.hash_lu;
+   bool doc_end = (word_id==docTag);
+   bool in_filter = (!doc_end) && filter_contains(bloom_filter,hash_pu,hash_lu);
+
+   if (in_filter)
+   {
+      unsigned long weight = profile_weight(profile_weights,word_id,hash_pu,hash_lu);
+      if(weight==0)
+         stats.false_access++;
+      return weight * (unsigned long)frequency;
+   }
+   return 0;
+}
+
+// Weight lookup for a word that already passed the membership filter, hashes known
+static inline unsigned long weigh_hit(unsigned curr_entry,unsigned hash_pu,unsigned hash_lu,profile_t* profile_weights,score_stats& stats)
+{
+   unsigned frequency = curr_entry & 0x00ff;
+   unsigned word_id = curr_entry >> 8;
+   unsigned long weight = profile_weight(profile_weights,word_id,hash_pu,hash_lu);
+   if(weight==0)
+      stats.false_access++;
+   return weight * (unsigned long)frequency;
+}
+
+// Weight lookup for a word whose vector lane already passed the membership filter
+static inline unsigned long score_hit(unsigned curr_entry,profile_t* profile_weights,score_stats& stats)
+{
+   murmur2_hashes hashes = murmur2_24(curr_entry >> 8);
+   return weigh_hit(curr_entry,hashes.hash_pu,hashes.hash_lu,profile_weights,stats);
+}
+
+static unsigned long score_doc_scalar(unsigned int* words,unsigned int size,unsigned int* bloom_filter,profile_t* profile_weights,score_stats& stats)
+{
+   unsigned long ans = 0;
+   for (unsigned i = 0; i < size; i++)
+      ans += score_word(words[i],bloom_filter,profile_weights,stats);
+   return ans;
+}
+
+//-----------------------------------------------------------------------------
+// Multi-profile scoring: each word is hashed once and probed against the bloom
+// filters of num_profiles profiles. The filters are first transposed into
+// profile slices: byte h of slice g holds bit h of the filters of profiles
+// 8g to 8g+7, so the two probes of a word read two bytes per 8 profiles instead
+// of two words per profile, and ANDing them gives the profiles the word may be in.
+// ans receives one score per profile.
+
+const unsigned int slice_profiles = 8;
+const unsigned long slice_bits = 32L << bloom_size;
+// A slice is read 32 bits at a time by the vector gathers, hence the 3 spare bytes
+const unsigned long slice_bytes = slice_bits + 3;
+
+static vector<unsigned char> slice_filters(unsigned int* bloom_filters,unsigned int num_profiles)
+{
+   unsigned int num_slices = (num_profiles + slice_profiles - 1) / slice_profiles;
+   vector<unsigned char> slices(num_slices * slice_bytes,0);
+   for (unsigned int p = 0; p < num_profiles; p++) {
+      unsigned int* bloom_filter = bloom_filters + p*(1L << bloom_size);
+      unsigned char* slice = slices.data() + (p / slice_profiles) * slice_bytes;
+      unsigned char bit = 1 << (p % slice_profiles);
+      // Filters are sparse: only visit the bits that are set
+      for (unsigned long w = 0; w < (1L << bloom_size); w++)
+         for (unsigned int bits = bloom_filter[w]; bits; bits &= bits - 1)
+            slice[(w << 5) + __builtin_ctz(bits)] |= bit;
+   }
+   return slices;
+}
+
+// Weight lookups of a word for the profiles of slice first_profile/8 flagged in hits
+static inline void score_slice_hits(unsigned curr_entry,unsigned hash_pu,unsigned hash_lu,unsigned hits,profile_t* profile_weights,unsigned int first_profile,unsigned long* ans,score_stats& stats)
+{
+   while (hits)
+   {
+      unsigned p = first_profile + __builtin_ctz(hits);
+      ans[p] += weigh_hit(curr_entry,hash_pu,hash_lu,profile_weights + p*(unsigned long)profile_entries,stats);
+      hits &= hits - 1;
+   }
+}
+
+static inline void score_word_multi(unsigned curr_entry,const unsigned char* slices,profile_t* profile_weights,unsigned int num_profiles,unsigned long* ans,score_stats& stats)
+{
+   unsigned word_id = curr_entry >> 8;
+   if (word_id == docTag)
+      return;
+   murmur2_hashes hashes = murmur2_24(word_id);
+   unsigned hash1 = hashes.hash_pu&hash_bloom;
+   unsigned hash2 = bloom_hash2(hashes.hash_pu,hashes.hash_lu);
+   for (unsigned int first = 0; first < num_profiles; first += slice_profiles, slices += slice_bytes)
+      score_slice_hits(curr_entry,hashes.hash_pu,hashes.hash_lu,slices[hash1] & slices[hash2],profile_weights,first,ans,stats);
+}
+
+static void score_doc_multi_scalar(unsigned int* words,unsigned int size,const unsigned char* slices,profile_t* profile_weights,unsigned int num_profiles,unsigned long* ans,score_stats& stats)
+{
+   for (unsigned i = 0; i < size; i++)
+      score_word_multi(words[i],slices,profile_weights,num_profiles,ans,stats);
+}
+
+#ifdef BLOOM_X86_SIMD
+
+// Vector versions of murmur2_24 (see MurmurHash2.h), one word ID per lane.
+// docTag can never match a 24-bit word_id, so the doc_end test of the scalar path is dropped.
+
+__attribute__((target("avx2")))
+static inline __m256i murmur24_avx2(__m256i word_id,unsigned int seed)
+{
+   const __m256i m = _mm256_set1_epi32(0x5bd1e995);
+   __m256i h = _mm256_xor_si256(_mm256_set1_epi32(seed ^ 3),word_id);
+   h = _mm256_mullo_epi32(h,m);
+   h = _mm256_xor_si256(h,_mm256_srli_epi32(h,13));
+   h = _mm256_mullo_epi32(h,m);
+   h = _mm256_xor_si256(h,_mm256_srli_epi32(h,15));
+   return h;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i probe_avx2(unsigned int* bloom_filter,__m256i hash)
+{
+   __m256i word = _mm256_i32gather_epi32((const int*)bloom_filter,_mm256_srli_epi32(hash,5),4);
+   __m256i bit = _mm256_srlv_epi32(word,_mm256_and_si256(hash,_mm256_set1_epi32(0x1f)));
+   return _mm256_and_si256(bit,_mm256_set1_epi32(1));
+}
+
+#if membership_filter
+// Lanes whose fingerprint fills one of the 4 slots of their bucket, as all ones
+__attribute__((target("avx2")))
+static inline __m256i cuckoo_bucket_avx2(unsigned int* filter,__m256i bucket,__m256i fingerprints)
+{
+   const __m256i mask_low = _mm256_set1_epi32(0xffff);
+   const __m256i zero = _mm256_setzero_si256();
+   __m256i word = _mm256_slli_epi32(bucket,1);
+   __m256i slots01 = _mm256_xor_si256(_mm256_i32gather_epi32((const int*)filter,word,4),fingerprints);
+   __m256i slots23 = _mm256_xor_si256(_mm256_i32gather_epi32((const int*)filter,_mm256_add_epi32(word,_mm256_set1_epi32(1)),4),fingerprints);
+   __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_and_si256(slots01,mask_low),zero),_mm256_cmpeq_epi32(_mm256_srli_epi32(slots01,16),zero));
+   hit = _mm256_or_si256(hit,_mm256_cmpeq_epi32(_mm256_and_si256(slots23,mask_low),zero));
+   return _mm256_or_si256(hit,_mm256_cmpeq_epi32(_mm256_srli_epi32(slots23,16),zero));
+}
+#endif
+
+// filter_contains for 8 words, as a lane mask
+__attribute__((target("avx2")))
+static inline unsigned filter_lanes_avx2(unsigned int* bloom_filter,__m256i hash_pu,__m256i hash_lu)
+{
+#if membership_filter
+   const __m256i mask_buckets = _mm256_set1_epi32(cuckoo_buckets - 1);
+   __m256i fingerprint = _mm256_srli_epi32(hash_lu,16);
+   fingerprint = _mm256_sub_epi32(fingerprint,_mm256_cmpeq_epi32(fingerprint,_mm256_setzero_si256()));
+   __m256i bucket1 = _mm256_and_si256(hash_pu,mask_buckets);
+   __m256i bucket2 = _mm256_and_si256(_mm256_xor_si256(bucket1,_mm256_srli_epi32(_mm256_mullo_epi32(fingerprint,_mm256_set1_epi32(0x5bd1e995)),8)),mask_buckets);
+   // Both 16-bit halves of a word are compared against the fingerprint
+   __m256i fingerprints = _mm256_or_si256(fingerprint,_mm256_slli_epi32(fingerprint,16));
+   __m256i hit = _mm256_or_si256(cuckoo_bucket_avx2(bloom_filter,bucket1,fingerprints),cuckoo_bucket_avx2(bloom_filter,bucket2,fingerprints));
+   return _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+#else
+   const __m256i mask_bloom = _mm256_set1_epi32(hash_bloom);
+   __m256i hash1 = _mm256_and_si256(hash_pu,mask_bloom);
+#if bloom_blocked
+   __m256i hash2 = _mm256_or_si256(_mm256_andnot_si256(_mm256_set1_epi32(bloom_block_mask),hash1),
+                                   _mm256_and_si256(_mm256_add_epi32(hash_pu,hash_lu),_mm256_set1_epi32(bloom_block_mask)));
+#else
+   __m256i hash2 = _mm256_and_si256(_mm256_add_epi32(hash_pu,hash_lu),mask_bloom);
+#endif
+   __m256i hit = _mm256_and_si256(probe_avx2(bloom_filter,hash1),probe_avx2(bloom_filter,hash2));
+   return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(hit,31)));
+#endif
+}
+
+__attribute__((target("avx2")))
+static unsigned long score_doc_avx2(unsigned int* words,unsigned int size,unsigned int* bloom_filter,profile_t* profile_weights,score_stats& stats)
+{
+   unsigned long ans = 0;
+   unsigned i = 0;
+   for (; i + 8 <= size; i += 8)
+   {
+      __m256i entry = _mm256_loadu_si256((const __m256i*)(words + i));
+      __m256i word_id = _mm256_srli_epi32(entry,8);
+      __m256i hash_pu = murmur24_avx2(word_id,1);
+      __m256i hash_lu = murmur24_avx2(word_id,5);
+      unsigned lanes = filter_lanes_avx2(bloom_filter,hash_pu,hash_lu);
+      while (lanes)
+      {
+         unsigned lane = __builtin_ctz(lanes);
+         ans += score_hit(words[i + lane],profile_weights,stats);
+         lanes &= lanes - 1;
+      }
+   }
+   for (; i < size; i++)
+      ans += score_word(words[i],bloom_filter,profile_weights,stats);
+   return ans;
+}
+
+// The lanes of a vector are only spilled to memory when one of them may be in some profile
+__attribute__((target("avx2")))
+static void score_doc_multi_avx2(unsigned int* words,unsigned int size,const unsigned char* slices,profile_t* profile_weights,unsigned int num_profiles,unsigned long* ans,score_stats& stats)
+{
+   const __m256i mask_bloom = _mm256_set1_epi32(hash_bloom);
+   const __m256i mask_slice = _mm256_set1_epi32(0xff);
+   unsigned i = 0;
+   for (; i + 8 <= size; i += 8)
+   {
+      __m256i entry = _mm256_loadu_si256((const __m256i*)(words + i));
+      __m256i word_id = _mm256_srli_epi32(entry,8);
+      __m256i hash_pu = murmur24_avx2(word_id,1);
+      __m256i hash_lu = murmur24_avx2(word_id,5);
+      __m256i hash1 = _mm256_and_si256(hash_pu,mask_bloom);
+#if bloom_blocked
+      __m256i hash2 = _mm256_or_si256(_mm256_andnot_si256(_mm256_set1_epi32(bloom_block_mask),hash1),
+                                      _mm256_and_si256(_mm256_add_epi32(hash_pu,hash_lu),_mm256_set1_epi32(bloom_block_mask)));
+#else
+      __m256i hash2 = _mm256_and_si256(_mm256_add_epi32(hash_pu,hash_lu),mask_bloom);
+#endif
+      unsigned lane_pu[8], lane_lu[8], lane_hits[8];
+      bool spilled = false;
+      const unsigned char* slice = slices;
+      for (unsigned int first = 0; first < num_profiles; first += slice_profiles, slice += slice_bytes)
+      {
+         __m256i hits = _mm256_and_si256(_mm256_i32gather_epi32((const int*)slice,hash1,1),_mm256_i32gather_epi32((const int*)slice,hash2,1));
+         hits = _mm256_and_si256(hits,mask_slice);
+         if (_mm256_testz_si256(hits,hits))
+            continue;
+         if (!spilled) {
+            _mm256_storeu_si256((__m256i*)lane_pu,hash_pu);
+            _mm256_storeu_si256((__m256i*)lane_lu,hash_lu);
+            spilled = true;
+         }
+         _mm256_storeu_si256((__m256i*)lane_hits,hits);
+         for (unsigned lane = 0; lane < 8; lane++)
+            score_slice_hits(words[i + lane],lane_pu[lane],lane_lu[lane],lane_hits[lane],profile_weights,first,ans,stats);
+      }
+   }
+   for (; i < size; i++)
+      score_word_multi(words[i],slices,profile_weights,num_profiles,ans,stats);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i murmur24_avx512(__m512i word_id,unsigned int seed)
+{
+   const __m512i m = _mm512_set1_epi32(0x5bd1e995);
+   __m512i h = _mm512_xor_si512(_mm512_set1_epi32(seed ^ 3),word_id);
+   h = _mm512_mullo_epi32(h,m);
+   h = _mm512_xor_si512(h,_mm512_srli_epi32(h,13));
+   h = _mm512_mullo_epi32(h,m);
+   h = _mm512_xor_si512(h,_mm512_srli_epi32(h,15));
+   return h;
+}
+
+__attribute__((target("avx512f")))
+static inline __mmask16 probe_avx512(unsigned int* bloom_filter,__m512i hash)
+{
+   __m512i word = _mm512_i32gather_epi32(_mm512_srli_epi32(hash,5),(const int*)bloom_filter,4);
+   __m512i bit = _mm512_sllv_epi32(_mm512_set1_epi32(1),_mm512_and_si512(hash,_mm512_set1_epi32(0x1f)));
+   return _mm512_test_epi32_mask(word,bit);
+}
+
+#if membership_filter
+__attribute__((target("avx512f")))
+static inline __mmask16 cuckoo_bucket_avx512(unsigned int* filter,__m512i bucket,__m512i fingerprints)
+{
+   const __m512i mask_low = _mm512_set1_epi32(0xffff);
+   const __m512i mask_high = _mm512_set1_epi32(0xffff0000);
+   __m512i word = _mm512_slli_epi32(bucket,1);
+   __m512i slots01 = _mm512_xor_si512(_mm512_i32gather_epi32(word,(const int*)filter,4),fingerprints);
+   __m512i slots23 = _mm512_xor_si512(_mm512_i32gather_epi32(_mm512_add_epi32(word,_mm512_set1_epi32(1)),(const int*)filter,4),fingerprints);
+   return _mm512_testn_epi32_mask(slots01,mask_low) | _mm512_testn_epi32_mask(slots01,mask_high) |
+          _mm512_testn_epi32_mask(slots23,mask_low) | _mm512_testn_epi32_mask(slots23,mask_high);
+}
+#endif
+
+// filter_contains for 16 words
+__attribute__((target("avx512f")))
+static inline __mmask16 filter_lanes_avx512(unsigned int* bloom_filter,__m512i hash_pu,__m512i hash_lu)
+{
+#if membership_filter
+   const __m512i mask_buckets = _mm512_set1_epi32(cuckoo_buckets - 1);
+   __m512i fingerprint = _mm512_srli_epi32(hash_lu,16);
+   fingerprint = _mm512_mask_set1_epi32(fingerprint,_mm512_testn_epi32_mask(fingerprint,fingerprint),1);
+   __m512i bucket1 = _mm512_and_si512(hash_pu,mask_buckets);
+   __m512i bucket2 = _mm512_and_si512(_mm512_xor_si512(bucket1,_mm512_srli_epi32(_mm512_mullo_epi32(fingerprint,_mm512_set1_epi32(0x5bd1e995)),8)),mask_buckets);
+   __m512i fingerprints = _mm512_or_si512(fingerprint,_mm512_slli_epi32(fingerprint,16));
+   return cuckoo_bucket_avx512(bloom_filter,bucket1,fingerprints) | cuckoo_bucket_avx512(bloom_filter,bucket2,fingerprints);
+#else
+   const __m512i mask_bloom = _mm512_set1_epi32(hash_bloom);
+   __m512i hash1 = _mm512_and_si512(hash_pu,mask_bloom);
+#if bloom_blocked
+   __m512i hash2 = _mm512_or_si512(_mm512_andnot_si512(_mm512_set1_epi32(bloom_block_mask),hash1),
+                                   _mm512_and_si512(_mm512_add_epi32(hash_pu,hash_lu),_mm512_set1_epi32(bloom_block_mask)));
+#else
+   __m512i hash2 = _mm512_and_si512(_mm512_add_epi32(hash_pu,hash_lu),mask_bloom);
+#endif
+   return probe_avx512(bloom_filter,hash1) & probe_avx512(bloom_filter,hash2);
+#endif
+}
+
+__attribute__((target("avx512f")))
+static unsigned long score_doc_avx512(unsigned int* words,unsigned int size,unsigned int* bloom_filter,profile_t* profile_weights,score_stats& stats)
+{
+   unsigned long ans = 0;
+   unsigned i = 0;
+   for (; i + 16 <= size; i += 16)
+   {
+      __m512i entry = _mm512_loadu_si512((const void*)(words + i));
+      __m512i word_id = _mm512_srli_epi32(entry,8);
+      __m512i hash_pu = murmur24_avx512(word_id,1);
+      __m512i hash_lu = murmur24_avx512(word_id,5);
+      unsigned lanes = filter_lanes_avx512(bloom_filter,hash_pu,hash_lu);
+      while (lanes)
+      {
+         unsigned lane = __builtin_ctz(lanes);
+         ans += score_hit(words[i + lane],profile_weights,stats);
+         lanes &= lanes - 1;
+      }
+   }
+   for (; i < size; i++)
+      ans += score_word(words[i],bloom_filter,profile_weights,stats);
+   return ans;
+}
+
+__attribute__((target("avx512f")))
+static void score_doc_multi_avx512(unsigned int* words,unsigned int size,const unsigned char* slices,profile_t* profile_weights,unsigned int num_profiles,unsigned long* ans,score_stats& stats)
+{
+   const __m512i mask_bloom = _mm512_set1_epi32(hash_bloom);
+   const __m512i mask_slice = _mm512_set1_epi32(0xff);
+   unsigned i = 0;
+   for (; i + 16 <= size; i += 16)
+   {
+      __m512i entry = _mm512_loadu_si512((const void*)(words + i));
+      __m512i word_id = _mm512_srli_epi32(entry,8);
+      __m512i hash_pu = murmur24_avx512(word_id,1);
+      __m512i hash_lu = murmur24_avx512(word_id,5);
+      __m512i hash1 = _mm512_and_si512(hash_pu,mask_bloom);
+#if bloom_blocked
+      __m512i hash2 = _mm512_or_si512(_mm512_andnot_si512(_mm512_set1_epi32(bloom_block_mask),hash1),
+                                      _mm512_and_si512(_mm512_add_epi32(hash_pu,hash_lu),_mm512_set1_epi32(bloom_block_mask)));
+#else
+      __m512i hash2 = _mm512_and_si512(_mm512_add_epi32(hash_pu,hash_lu),mask_bloom);
+#endif
+      unsigned lane_pu[16], lane_lu[16], lane_hits[16];
+      bool spilled = false;
+      const unsigned char* slice = slices;
+      for (unsigned int first = 0; first < num_profiles; first += slice_profiles, slice += slice_bytes)
+      {
+         __m512i hits = _mm512_and_si512(_mm512_i32gather_epi32(hash1,(const int*)slice,1),_mm512_i32gather_epi32(hash2,(const int*)slice,1));
+         unsigned lanes = _mm512_test_epi32_mask(hits,mask_slice);
+         if (!lanes)
+            continue;
+         if (!spilled) {
+            _mm512_storeu_si512((void*)lane_pu,hash_pu);
+            _mm512_storeu_si512((void*)lane_lu,hash_lu);
+            spilled = true;
+         }
+         _mm512_storeu_si512((void*)lane_hits,_mm512_and_si512(hits,mask_slice));
+         while (lanes)
+         {
+            unsigned lane = __builtin_ctz(lanes);
+            score_slice_hits(words[i + lane],lane_pu[lane],lane_lu[lane],lane_hits[lane],profile_weights,first,ans,stats);
+            lanes &= lanes - 1;
+         }
+      }
+   }
+   for (; i < size; i++)
+      score_word_multi(words[i],slices,profile_weights,num_profiles,ans,stats);
+}
+
+#endif
+
+// A run of consecutive documents handed to a worker in one go
+struct doc_range {
+   unsigned int doc_begin;
+   unsigned int doc_end;
+   unsigned long word_offset;
+};
+
+static unsigned long score_doc(simd_level simd,unsigned int* words,unsigned int size,unsigned int* bloom_filter,profile_t* profile_weights,score_stats& stats)
+{
+   switch (simd) {
+#ifdef BLOOM_X86_SIMD
+   case SIMD_AVX512: return score_doc_avx512(words,size,bloom_filter,profile_weights,stats);
+   case SIMD_AVX2:   return score_doc_avx2(words,size,bloom_filter,profile_weights,stats);
+#endif
+   default:          return score_doc_scalar(words,size,bloom_filter,profile_weights,stats);
+   }
+}
+
+// Scores go to cpu_profileScore, to the topk heap, or both, whichever is not NULL.
+// With num_profiles > 1 the bloom filters are read from slices, cpu_profileScore
+// gets num_profiles scores per document and topk is not used. Cuckoo filters
+// cannot be sliced, so each profile then scores the document in turn, the
+// document staying in cache.
+static void score_docs(simd_level simd,const doc_range& range,unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,const unsigned char* slices,profile_t* profile_weights,unsigned int num_profiles,unsigned long* cpu_profileScore,topk_heap* topk,score_stats& stats)
+{
+   unsigned long word_offset = range.word_offset;
+   for (unsigned int doc = range.doc_begin; doc < range.doc_end; doc++) {
+      unsigned int size = doc_sizes[doc];
+      unsigned int* words = input_doc_words + word_offset;
+      if (num_profiles > 1) {
+         unsigned long* ans = cpu_profileScore + (unsigned long)doc*num_profiles;
+         fill(ans,ans + num_profiles,0UL);
+         if (membership_filter) {
+            for (unsigned int p = 0; p < num_profiles; p++)
+               ans[p] = score_doc(simd,words,doc_scored_words(size),bloom_filter + p*(1L << bloom_size),profile_weights + p*(unsigned long)profile_entries,stats);
+         } else switch (simd) {
+#ifdef BLOOM_X86_SIMD
+         case SIMD_AVX512: score_doc_multi_avx512(words,doc_scored_words(size),slices,profile_weights,num_profiles,ans,stats); break;
+         case SIMD_AVX2:   score_doc_multi_avx2(words,doc_scored_words(size),slices,profile_weights,num_profiles,ans,stats); break;
+#endif
+         default:          score_doc_multi_scalar(words,doc_scored_words(size),slices,profile_weights,num_profiles,ans,stats); break;
+         }
+         stats.total += (unsigned long)doc_scored_words(size)*num_profiles;
+         word_offset += size;
+         continue;
+      }
+      unsigned long ans = score_doc(simd,words,doc_scored_words(size),bloom_filter,profile_weights,stats);
+      if (cpu_profileScore)
+         cpu_profileScore[doc] = ans;
+      if (topk)
+         topk->push(doc,ans);
+      stats.total += doc_scored_words(size);
+      word_offset += size;
+   }
+}
+
+// Takes ranges from the shared cursor until none are left
+static void score_worker(simd_level simd,const vector<doc_range>* ranges,atomic<unsigned int>* next_range,unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,const unsigned char* slices,profile_t* profile_weights,unsigned int num_profiles,unsigned long* cpu_profileScore,topk_heap* topk,score_stats* stats)
+{
+   score_stats local = {0,0,0,0};
+   chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+   unsigned int i;
+   while ((i = next_range->fetch_add(1)) < ranges->size()) {
+      score_docs(simd,(*ranges)[i],doc_sizes,input_doc_words,bloom_filter,slices,profile_weights,num_profiles,cpu_profileScore,topk,local);
+      local.ranges++;
+   }
+   local.busy = chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
+   *stats = local;
+}
+
+static void score_parallel(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned int num_profiles,unsigned long* cpu_profileScore,unsigned int k,doc_score* topk,unsigned int total_num_docs,unsigned int num_threads,bool report,score_counts* counts)
+{
+   if (num_threads == 0) num_threads = 1;
+   if (num_threads > total_num_docs) num_threads = total_num_docs > 0 ? total_num_docs : 1;
+
+   simd_level simd = detect_simd();
+   if (getenv("BLOOM_NO_SIMD")) simd = SIMD_SCALAR;
+
+   unsigned long total_words = 0;
+   for (unsigned int doc = 0; doc < total_num_docs; doc++)
+      total_words += doc_sizes[doc];
+
+   unsigned long range_words = total_words / (num_threads * ranges_per_thread);
+   if (range_words < range_words_min) range_words = range_words_min;
+   vector<doc_range> ranges;
+   unsigned long word_offset = 0;
+   for (unsigned int doc = 0; doc < total_num_docs; ) {
+      doc_range range = {doc,doc,word_offset};
+      unsigned long words = 0;
+      while (doc < total_num_docs && (words == 0 || words + doc_sizes[doc] <= range_words)) {
+         words += doc_sizes[doc];
+         doc++;
+      }
+      range.doc_end = doc;
+      word_offset += words;
+      ranges.push_back(range);
+   }
+
+   chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+   vector<unsigned char> slices;
+   if (num_profiles > 1 && !membership_filter)
+      slices = slice_filters(bloom_filter,num_profiles);
+   atomic<unsigned int> next_range(0);
+   vector<thread> workers;
+   vector<score_stats> stats(num_threads);
+   // One bounded heap per worker, merged once they are all done
+   vector<topk_heap> heaps(topk ? num_threads : 0,topk_heap(k));
+   for (unsigned int t = 0; t < num_threads; t++)
+      workers.push_back(thread(score_worker,simd,&ranges,&next_range,doc_sizes,input_doc_words,bloom_filter,slices.data(),profile_weights,num_profiles,cpu_profileScore,topk ? &heaps[t] : NULL,&stats[t]));
+   for (unsigned int t = 0; t < workers.size(); t++)
+      workers[t].join();
+   double elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
+
+   if (topk) {
+      topk_heap best(k);
+      for (unsigned int t = 0; t < heaps.size(); t++)
+         best.merge(heaps[t]);
+      best.sorted(topk);
+   }
+
+   unsigned long false_access = 0;
+   unsigned long total = 0;
+   for (unsigned int t = 0; t < num_threads; t++) {
+      false_access += stats[t].false_access;
+      total += stats[t].total;
+   }
+   if (counts) {
+      counts->false_access = false_access;
+      counts->total = total;
+   }
+   if (!report)
+      return;
+
+   double busy_min = 1, busy_max = 0;
+   for (unsigned int t = 0; t < num_threads; t++) {
+      double busy = elapsed > 0 ? stats[t].busy / elapsed : 1;
+      busy_min = min(busy_min,busy);
+      busy_max = max(busy_max,busy);
+   }
+   const char* simd_name[] = {"scalar","AVX2","AVX-512"};
+   printf ("Scored on %u threads (%s)\n",num_threads,simd_name[simd]);
+   printf ("Thread utilization %.1f%% to %.1f%% over %u document ranges\n",busy_min*100,busy_max*100,(unsigned int)ranges.size());
+   printf ("False positive rate is %f%s\n",((float)false_access/total)*100,"%");
+}
+
+extern "C"
+{
+// Multithreaded version of runOnCPU. Documents are cut into ranges of roughly
+// equal word count, several per thread, and each thread takes the next range from
+// a shared cursor as soon as it is done with the previous one, so threads that
+// draw short documents take more ranges. Each thread hashes 16 (AVX-512) or
+// 8 (AVX2) words at a time. Scores are bit-identical to runOnCPU. report=false
+// skips the summary, for callers that score many small batches; counts, if not
+// NULL, receives the false positive counters instead.
+void runOnCPU_parallel (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned long* cpu_profileScore,unsigned int total_num_docs,unsigned int num_threads,bool report,score_counts* counts) {
+   score_parallel(doc_sizes,input_doc_words,bloom_filter,profile_weights,1,cpu_profileScore,0,NULL,total_num_docs,num_threads,report,counts);
+}
+
+// Same as runOnCPU_parallel, but only the k best documents are kept (see topk.h):
+// each worker keeps its own bounded heap and the heaps are merged at the end.
+// topk receives k entries, best first.
+void runOnCPU_parallel_topk (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned int k,doc_score* topk,unsigned int total_num_docs,unsigned int num_threads,bool report) {
+   score_parallel(doc_sizes,input_doc_words,bloom_filter,profile_weights,1,NULL,k,topk,total_num_docs,num_threads,report,NULL);
+}
+
+// Same as runOnCPU_parallel for num_profiles profiles at once, in a single pass
+// over the documents: each word is hashed once and probed against every
+// profile. bloom_filters holds the num_profiles filters back to back, as does
+// profile_weights for the weight tables, and cpu_profileScores receives
+// num_profiles scores per document, profile score p of doc d at
+// d*num_profiles+p. The false positive counters are per word and profile.
+void runOnCPU_parallel_multi (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filters,profile_t* profile_weights,unsigned int num_profiles,unsigned long* cpu_profileScores,unsigned int total_num_docs,unsigned int num_threads,bool report,score_counts* counts) {
+   score_parallel(doc_sizes,input_doc_words,bloom_filters,profile_weights,num_profiles,cpu_profileScores,0,NULL,total_num_docs,num_threads,report,counts);
+}
+}
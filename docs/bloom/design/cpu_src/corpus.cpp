@@ -0,0 +1,146 @@
+#include<cstdio>
+#include<cstring>
+#include<vector>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include"sizes.h"
+#include"corpus.h"
+
+using namespace std;
+
+static uint64_t corpus_round_up(uint64_t offset)
+{
+   return (offset + corpus_align - 1) & ~(uint64_t)(corpus_align - 1);
+}
+
+// True if count uint32 values at offset lie inside a file of length bytes,
+// checked without overflowing for any offset and count
+static bool section_fits(uint64_t offset,uint64_t count,uint64_t length)
+{
+   return offset <= length && count <= (length - offset) / sizeof(uint32_t);
+}
+
+static bool write_section(FILE* file,uint64_t offset,const void* data,uint64_t bytes)
+{
+   return fseek(file,offset,SEEK_SET) == 0 && fwrite(data,1,bytes,file) == bytes;
+}
+
+bool writeCorpus(const char* path,const unsigned int* doc_sizes,const unsigned int* input_doc_words,unsigned int num_docs)
+{
+   vector<uint32_t> starting_doc_id(num_docs);
+   uint64_t num_words = 0;
+   for (unsigned int doc = 0; doc < num_docs; doc++) {
+      starting_doc_id[doc] = num_words;
+      num_words += doc_sizes[doc];
+   }
+   if (num_words > 0xffffffffULL) {
+      printf("Corpus %s has %lu words, starting_doc_id is limited to 32 bits\n",path,(unsigned long)num_words);
+      return false;
+   }
+
+   corpus_header header;
+   memset(&header,0,sizeof(header));
+   header.magic = corpus_magic;
+   header.version = corpus_version;
+   header.num_docs = num_docs;
+   header.num_words = num_words;
+   header.flags = doc_unpadded ? corpus_unpadded : 0;
+   header.index_offset = corpus_round_up(sizeof(header));
+   header.sizes_offset = corpus_round_up(header.index_offset + num_docs*sizeof(uint32_t));
+   header.words_offset = corpus_round_up(header.sizes_offset + num_docs*sizeof(uint32_t));
+
+   FILE* file = fopen(path,"wb");
+   if (!file) {
+      printf("Cannot create corpus %s\n",path);
+      return false;
+   }
+   bool ok = write_section(file,0,&header,sizeof(header))
+          && write_section(file,header.index_offset,starting_doc_id.data(),num_docs*sizeof(uint32_t))
+          && write_section(file,header.sizes_offset,doc_sizes,num_docs*sizeof(uint32_t))
+          && write_section(file,header.words_offset,input_doc_words,num_words*sizeof(uint32_t));
+   ok = (fclose(file) == 0) && ok;
+   if (!ok)
+      printf("Write to corpus %s failed\n",path);
+   return ok;
+}
+
+corpus_map::corpus_map() : num_docs(0), num_words(0), starting_doc_id(0), doc_sizes(0), input_doc_words(0), base(MAP_FAILED), length(0) {}
+
+corpus_map::~corpus_map()
+{
+   if (base != MAP_FAILED)
+      munmap(base,length);
+}
+
+bool corpus_map::open(const char* path)
+{
+   int fd = ::open(path,O_RDONLY);
+   if (fd < 0) {
+      printf("Cannot open corpus %s\n",path);
+      return false;
+   }
+   struct stat st;
+   if (fstat(fd,&st) != 0 || (unsigned long)st.st_size < sizeof(corpus_header)) {
+      printf("Corpus %s is truncated\n",path);
+      ::close(fd);
+      return false;
+   }
+   // Private writable mapping: the host never writes to it, but XRT pins
+   // CL_MEM_USE_HOST_PTR memory for device access and needs writable pages.
+   length = st.st_size;
+   base = mmap(0,length,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+   ::close(fd);
+   if (base == MAP_FAILED) {
+      printf("Cannot map corpus %s\n",path);
+      return false;
+   }
+
+   const corpus_header* header = (const corpus_header*)base;
+   if (header->magic != corpus_magic || header->version != corpus_version) {
+      printf("%s is not a version %d corpus\n",path,corpus_version);
+      return false;
+   }
+   // The layout decides how documents end, so it must match the build
+   bool unpadded = (header->flags & corpus_unpadded) != 0;
+   if (unpadded != (doc_unpadded != 0)) {
+      printf("Corpus %s has %s documents, this host is built for %s ones (UNPADDED=%d)\n",path,
+             unpadded ? "unpadded" : "padded",doc_unpadded ? "unpadded" : "padded",doc_unpadded);
+      return false;
+   }
+   if ((header->index_offset | header->sizes_offset | header->words_offset) & (corpus_align - 1)
+       || !section_fits(header->index_offset,header->num_docs,length)
+       || !section_fits(header->sizes_offset,header->num_docs,length)
+       || !section_fits(header->words_offset,header->num_words,length)) {
+      printf("Corpus %s is truncated or corrupt\n",path);
+      return false;
+   }
+
+   const unsigned int* index = (const unsigned int*)((char*)base + header->index_offset);
+   const unsigned int* sizes = (const unsigned int*)((char*)base + header->sizes_offset);
+   // Scoring walks the documents by the running sum of their sizes, so the
+   // index must be exactly that sum and the documents must fill the words
+   uint64_t doc_start = 0;
+   for (unsigned int doc = 0; doc < header->num_docs; doc++) {
+      if (index[doc] != doc_start) {
+         printf("Corpus %s is corrupt: document %u starts at word %u, not %lu\n",path,doc,index[doc],(unsigned long)doc_start);
+         return false;
+      }
+      doc_start += sizes[doc];
+   }
+   if (doc_start != header->num_words) {
+      printf("Corpus %s is corrupt: its documents hold %lu words, not %lu\n",path,(unsigned long)doc_start,(unsigned long)header->num_words);
+      return false;
+   }
+
+   num_docs = header->num_docs;
+   num_words = header->num_words;
+   starting_doc_id = (unsigned int*)index;
+   doc_sizes = (unsigned int*)sizes;
+   input_doc_words = (unsigned int*)((char*)base + header->words_offset);
+
+   // Documents are scored front to back
+   madvise((char*)base + header->words_offset,length - header->words_offset,MADV_SEQUENTIAL);
+   return true;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include<cstdint>
+
+//-----------------------------------------------------------------------------
+// On-disk corpus format, so a corpus can be written once and scored many times.
+//
+//   offset 0               corpus_header
+//   index_offset           uint32 starting_doc_id[num_docs]
+//   sizes_offset           uint32 doc_sizes[num_docs]
+//   words_offset           uint32 input_doc_words[num_words], (term<<8)|freq
+//
+// Every section starts on a corpus_align boundary, so once the file is mapped
+// each array is page aligned and can back a CL_MEM_USE_HOST_PTR buffer
+// directly. Documents padded to 1024 words (as setupData does) keep every
+// document start page aligned as well. Integers are little endian.
+
+#define corpus_magic   0x5052434d4f4f4c42ULL   // "BLOOMCRP"
+#define corpus_version 1
+#define corpus_align   4096
+
+// Documents end with a docTag marker instead of being padded (make UNPADDED=1)
+#define corpus_unpadded 0x1
+
+struct corpus_header {
+   uint64_t magic;
+   uint32_t version;
+   uint32_t num_docs;
+   uint64_t num_words;
+   uint64_t index_offset;
+   uint64_t sizes_offset;
+   uint64_t words_offset;
+   uint32_t flags;
+   uint32_t reserved;
+};
+
+// Writes a corpus laid out like the buffers built by setupData
+bool writeCorpus(const char* path,const unsigned int* doc_sizes,const unsigned int* input_doc_words,unsigned int num_docs);
+
+// Read-only view of a corpus file. The arrays point straight into the mapping
+// and stay valid until the corpus_map is destroyed.
+class corpus_map {
+public:
+   corpus_map();
+   ~corpus_map();
+   // Maps path and checks its header; prints the reason and returns false on error
+   bool open(const char* path);
+
+   unsigned int num_docs;
+   unsigned long num_words;
+   unsigned int* starting_doc_id;
+   unsigned int* doc_sizes;
+   unsigned int* input_doc_words;
+private:
+   corpus_map(const corpus_map&);
+   corpus_map& operator=(const corpus_map&);
+   void* base;
+   unsigned long length;
+};
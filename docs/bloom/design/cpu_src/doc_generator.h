@@ -0,0 +1,29 @@
+#pragma once
+
+//-----------------------------------------------------------------------------
+// Seeded synthetic documents, the same kind setupData always generated:
+// lengths drawn from a normal distribution (mean 3500, deviation 500, clamped
+// to 100..4000 words), padded to 1024 words or ended with a docTag marker
+// (make UNPADDED=1), and random (term << 8) | freq words.
+//
+// Every random number is a hash of (seed, document, counter), so each document
+// depends on nothing but its index: documents are generated on all threads
+// straight into the caller's buffers, and the same seed always gives the same
+// corpus, whatever the thread count. The seed comes from BLOOM_SEED if set.
+
+#define doc_seed_default 1
+
+// Seed from the BLOOM_SEED environment variable, or doc_seed_default
+unsigned long docSeed();
+
+// Size in words of document doc, padding or end marker included
+unsigned int generatedDocSize(unsigned long seed,unsigned long doc);
+
+// Fills the size words of document doc
+void generateDoc(unsigned long seed,unsigned long doc,unsigned int* words,unsigned int size);
+
+// Fills doc_sizes and starting_doc_id for num_docs documents and returns their total words
+unsigned long generateDocSizes(unsigned long seed,unsigned int num_docs,unsigned int* doc_sizes,unsigned int* starting_doc_id);
+
+// Fills input_doc_words with the documents sized by generateDocSizes, on num_threads threads
+void generateDocWords(unsigned long seed,unsigned int num_docs,const unsigned int* doc_sizes,const unsigned int* starting_doc_id,unsigned int* input_doc_words,unsigned int num_threads);
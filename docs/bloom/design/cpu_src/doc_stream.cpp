@@ -0,0 +1,129 @@
+#include<deque>
+#include<mutex>
+#include<thread>
+#include<condition_variable>
+#include"doc_stream.h"
+
+using namespace std;
+
+unsigned int file_doc_source::next_size()
+{
+   if (pending == 0) {
+      // The stream only ends cleanly where the next word count would start
+      size_t bytes = fread(&pending,1,sizeof(pending),file);
+      if (bytes != sizeof(pending)) {
+         partial = bytes > 0 || ferror(file);
+         pending = 0;
+      }
+   }
+   return pending;
+}
+
+bool file_doc_source::read(unsigned int* words)
+{
+   bool ok = fread(words,sizeof(unsigned int),pending,file) == pending;
+   pending = 0;
+   return ok;
+}
+
+bool writeStreamDoc(FILE* file,const unsigned int* words,unsigned int size)
+{
+   return fwrite(&size,sizeof(size),1,file) == 1 && fwrite(words,sizeof(unsigned int),size,file) == size;
+}
+
+// Chunks cycle between the loader thread (free -> full) and the scoring thread (full -> free)
+struct chunk_ring {
+   mutex lock;
+   condition_variable changed;
+   deque<doc_chunk*> free_chunks;
+   deque<doc_chunk*> full_chunks;
+   bool eof;
+   bool failed;
+};
+
+static void load_chunks(doc_source& source,unsigned int chunk_words,chunk_ring& ring)
+{
+   unsigned long next_doc = 0;
+   while (true) {
+      doc_chunk* chunk;
+      {
+         unique_lock<mutex> guard(ring.lock);
+         ring.changed.wait(guard,[&ring]{ return !ring.free_chunks.empty(); });
+         chunk = ring.free_chunks.front();
+         ring.free_chunks.pop_front();
+      }
+
+      bool failed = false;
+      chunk->first_doc = next_doc;
+      chunk->num_docs = 0;
+      chunk->num_words = 0;
+      chunk->doc_sizes.clear();
+      unsigned int size;
+      while ((size = source.next_size()) != 0 && chunk->num_words + size <= chunk_words) {
+         if (!source.read(chunk->input_doc_words.data() + chunk->num_words)) {
+            failed = true;
+            break;
+         }
+         chunk->doc_sizes.push_back(size);
+         chunk->num_words += size;
+         chunk->num_docs++;
+      }
+      // A document larger than a whole chunk can never be loaded, and a
+      // stream that ends inside a record is missing documents
+      if (size > chunk_words || (size == 0 && source.truncated()))
+         failed = true;
+      next_doc += chunk->num_docs;
+
+      unique_lock<mutex> guard(ring.lock);
+      if (chunk->num_docs > 0)
+         ring.full_chunks.push_back(chunk);
+      if (failed || size == 0) {
+         ring.failed = failed;
+         ring.eof = true;
+      }
+      ring.changed.notify_all();
+      if (ring.eof)
+         return;
+   }
+}
+
+long streamScore(doc_source& source,unsigned int ring_size,unsigned int chunk_words,chunk_scorer score,score_sink emit)
+{
+   if (ring_size < 2) ring_size = 2;
+
+   vector<doc_chunk> chunks(ring_size);
+   chunk_ring ring;
+   ring.eof = false;
+   ring.failed = false;
+   for (unsigned int i = 0; i < ring_size; i++) {
+      chunks[i].input_doc_words.resize(chunk_words);
+      ring.free_chunks.push_back(&chunks[i]);
+   }
+
+   thread loader(load_chunks,ref(source),chunk_words,ref(ring));
+
+   long scored = 0;
+   while (true) {
+      doc_chunk* chunk;
+      {
+         unique_lock<mutex> guard(ring.lock);
+         ring.changed.wait(guard,[&ring]{ return !ring.full_chunks.empty() || ring.eof; });
+         if (ring.full_chunks.empty())
+            break;
+         chunk = ring.full_chunks.front();
+         ring.full_chunks.pop_front();
+      }
+
+      chunk->profileScore.resize(chunk->num_docs);
+      score(*chunk);
+      emit(chunk->first_doc,chunk->num_docs,chunk->profileScore.data());
+      scored += chunk->num_docs;
+
+      unique_lock<mutex> guard(ring.lock);
+      ring.free_chunks.push_back(chunk);
+      ring.changed.notify_all();
+   }
+   loader.join();
+
+   return ring.failed ? -1 : scored;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include<cstdio>
+#include<vector>
+#include<functional>
+#include"xcl2.hpp"
+
+//-----------------------------------------------------------------------------
+// Streaming document ingestion.
+//
+// Instead of materializing the whole corpus like setupData, documents are
+// pulled from a doc_source into a ring of fixed-size chunks. A loader thread
+// fills chunk N+1 while chunk N is being scored, and the scores of each chunk
+// are handed to the caller as soon as it is done, so peak memory is bounded
+// by ring_size * chunk_words words whatever the corpus size.
+
+// A run of whole documents, laid out like the buffers built by setupData.
+// The buffers are page aligned so they can back CL_MEM_USE_HOST_PTR buffers.
+struct doc_chunk {
+   std::vector<unsigned int,aligned_allocator<unsigned int>> doc_sizes;
+   std::vector<unsigned int,aligned_allocator<unsigned int>> input_doc_words;
+   std::vector<unsigned long,aligned_allocator<unsigned long>> profileScore;
+   unsigned long first_doc;
+   unsigned int num_docs;
+   unsigned int num_words;
+};
+
+class doc_source {
+public:
+   virtual ~doc_source() {}
+   // Number of words of the next document, 0 once the stream is exhausted
+   virtual unsigned int next_size() = 0;
+   // Copies the words of the document whose size next_size() returned
+   virtual bool read(unsigned int* words) = 0;
+   // True if the stream ended inside a record instead of between two
+   virtual bool truncated() const { return false; }
+};
+
+// Reads a document stream file: for each document, a 32-bit word count
+// followed by that many packed (term<<8)|freq words.
+class file_doc_source : public doc_source {
+public:
+   explicit file_doc_source(FILE* file) : file(file), pending(0), partial(false) {}
+   unsigned int next_size();
+   bool read(unsigned int* words);
+   bool truncated() const { return partial; }
+private:
+   FILE* file;
+   unsigned int pending;
+   bool partial;
+};
+
+// Appends a document to a document stream file
+bool writeStreamDoc(FILE* file,const unsigned int* words,unsigned int size);
+
+typedef std::function<void(doc_chunk& chunk)> chunk_scorer;
+typedef std::function<void(unsigned long first_doc,unsigned int num_docs,const unsigned long* scores)> score_sink;
+
+// Scores every document of source, chunk_words words at a time with ring_size
+// chunks in flight. Returns the number of documents scored, or -1 if a document
+// does not fit in a chunk or the source is truncated.
+long streamScore(doc_source& source,unsigned int ring_size,unsigned int chunk_words,chunk_scorer score,score_sink emit);
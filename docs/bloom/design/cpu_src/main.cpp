@@ -3,14 +3,21 @@
 #include<ctime>
 #include<cstdio>
 #include<cstdlib>
+#include<cstring>
 #include<cmath>
 #include<iostream>
 #include<vector>
 #include<utility>
-#include<random>
+#include<string>
+#include<thread>
 #include"sizes.h"
+#include"MurmurHash2.h"
 #include"xcl2.hpp"
 #include"common.h"
+#include"doc_stream.h"
+#include"corpus.h"
+#include"bench.h"
+#include"doc_generator.h"
 using namespace std;
 using namespace std::chrono;
 
@@ -21,30 +28,18 @@ extern unsigned int MurmurHash2 ( const void * key, int len, unsigned int seed )
 // Host Buffers
 
 vector<unsigned int,aligned_allocator<unsigned int>> input_doc_words;
-vector<unsigned long,aligned_allocator<unsigned long>> profile_weights;
+vector<profile_t,aligned_allocator<profile_t>> profile_weights;
 vector<unsigned int,aligned_allocator<unsigned int>> bloom_filter;
 vector<unsigned int,aligned_allocator<unsigned int>> starting_doc_id;
 vector<unsigned long,aligned_allocator<unsigned long>> fpga_profileScore;
 vector<unsigned int,aligned_allocator<unsigned int>> doc_sizes;
 vector<unsigned long,aligned_allocator<unsigned long>> cpu_profileScore;
 
-default_random_engine generator;
-normal_distribution<double> distribution(3500,500);
-
 unsigned int total_num_docs;
 unsigned size=0;
 
 
-unsigned doc_len()
-{
-   unsigned int len = distribution(generator);
-   if (len < 100) { len = 100; }
-   if (len > 4000 ) { len = 3500 ; }
-   return len;
-}
-
-
- void setupData()
+ void setupDocs()
 
 {
    starting_doc_id.reserve( total_num_docs );
@@ -54,86 +49,523 @@ unsigned doc_len()
  //  h_docInfo.reserve( total_num_docs );
 
    doc_sizes.reserve( total_num_docs );
-   unsigned block_size = 1024;
-   for (unsigned i=0; i<total_num_docs; i++) {
-      unsigned unpadded_size = doc_len();
-      unsigned int padded_size = unpadded_size&(~(block_size-1));
-      if(unpadded_size & (block_size-1)) padded_size+=block_size;
-      starting_doc_id[i] = size;
-      size+=padded_size;
-      doc_sizes[i] = padded_size;
-   }
+   // Seeded documents (see doc_generator.h), sized first then generated in parallel
+   unsigned long seed = docSeed();
+   size = generateDocSizes(seed,total_num_docs,doc_sizes.data(),starting_doc_id.data());
     
-   bloom_filter.reserve( (1L << bloom_size) );
    input_doc_words.reserve( size );
 
-   std::cout << "Creating Documents total_terms = "<< size  << endl;
+   std::cout << "Creating Documents total_terms = "<< size  << " seed = " << seed << endl;
 
-   for (unsigned i=0; i<size; i++) {
-      input_doc_words[i] = docTag;
-   }
-   for (unsigned doci=0; doci < total_num_docs; doci++)
-   {
-      unsigned start_dimm1 = starting_doc_id[doci];
-      unsigned size_1 = doc_sizes[doci];
-      unsigned term;
-      unsigned freq;
+   generateDocWords(seed,total_num_docs,doc_sizes.data(),starting_doc_id.data(),input_doc_words.data(),thread::hardware_concurrency());
+}
 
-      for (unsigned i = 0; i < size_1; i++)
-      {
-         term = (rand()%((1L << 24)-1));
-         freq = (rand()%254)+1;
-         input_doc_words[start_dimm1 + i] = (term << 8) | freq;
-      }
-   }
 
-   profile_weights.reserve( (1L << 24) );
+// Fills one membership filter and weight table with a new random profile of num_words
+// words. Returns false if the profile does not fit in the filter or the compact table.
+ bool createProfile(unsigned int* bloom_filter,profile_t* profile_weights,unsigned int num_words)
+
+{
    for (unsigned i=0; i<(1L << bloom_size); i++) {
       bloom_filter[i] = 0x0;
    }
-   std::cout << "Creating Profile" << endl;
-   for (unsigned i=0; i<(1L << 24); i++) {
+   for (unsigned i=0; i<profile_entries; i++) {
       profile_weights[i] = 0;
    }
+   vector<unsigned int> profile_words;
+   vector<unsigned int> profile_word_weights;
 
-   for (unsigned i=0; i<16384; i++) {
+   for (unsigned i=0; i<num_words; i++) {
       unsigned entry = (rand()%(1<<24));	
 
+#if profile_compact
+      profile_words.push_back(entry);
+      profile_word_weights.push_back(10);
+#else
       profile_weights[entry] = 10;
-      unsigned hash_pu = MurmurHash2(&entry,3,1);
-      unsigned hash_lu = MurmurHash2(&entry,3,5);
+#endif
+      if (!filterInsert(bloom_filter,entry)) {
+         std::cout << "Profile does not fit in the " << membership_filter_name << " filter, increase bloom_size" << endl;
+         return false;
+      }
+   }
 
-      unsigned hash1 = hash_pu&hash_bloom;  //this gives me the top 16 bits of the 24bit word id
-      unsigned hash2 = (hash_pu+hash_lu)&hash_bloom;
-     
-      bloom_filter[ hash1 >> 5 ] |= 1 << (hash1 & 0x1f);
-      bloom_filter[ hash2 >> 5 ] |= 1 << (hash2 & 0x1f);
+#if profile_compact
+   if (!buildProfileTable(profile_weights,profile_words.data(),profile_word_weights.data(),profile_words.size())) {
+      std::cout << "Profile does not fit in the compact profile table, increase profile_bucket_bits" << endl;
+      return false;
    }
+#endif
+   return true;
+}
+
+
+ void setupProfile()
+
+{
+   bloom_filter.reserve( (1L << bloom_size) );
+   profile_weights.reserve( profile_entries );
+   std::cout << "Creating Profile" << endl;
+   if (!createProfile(bloom_filter.data(),profile_weights.data(),16384))
+      exit(EXIT_FAILURE);
+}
+
 
+// Document arguments are either a number of documents to generate or a file name
+bool is_doc_count(const string& arg)
+{
+   return !arg.empty() && arg.find_first_not_of("0123456789") == string::npos;
 }
 
+// Generates num_docs documents with setupDocs and saves them as a corpus file
+int writeCorpusFile(unsigned int num_docs,const char* path)
+{
+   total_num_docs = num_docs;
+   setupDocs();
+   if (!writeCorpus(path,doc_sizes.data(),input_doc_words.data(),total_num_docs))
+      return 1;
+   std::cout << "Wrote " << total_num_docs << " documents to " << path << endl;
+   return 0;
+}
+
+
+// Generates the same kind of documents as setupDocs, one at a time
+class generated_doc_source : public doc_source {
+public:
+   explicit generated_doc_source(unsigned long num_docs) : seed(docSeed()), doc(0), remaining(num_docs), pending(0) {}
+   unsigned int next_size() {
+      if (pending == 0 && remaining > 0) {
+         pending = generatedDocSize(seed,doc);
+         remaining--;
+      }
+      return pending;
+   }
+   bool read(unsigned int* words) {
+      generateDoc(seed,doc++,words,pending);
+      pending = 0;
+      return true;
+   }
+private:
+   unsigned long seed;
+   unsigned long doc;
+   unsigned long remaining;
+   unsigned int pending;
+};
+
+// Writes num_docs generated documents to a document stream file
+int writeStream(unsigned long num_docs,const char* path)
+{
+   FILE* file = fopen(path,"wb");
+   if (!file) {
+      std::cout << "Cannot open " << path << endl;
+      return 1;
+   }
+   generated_doc_source source(num_docs);
+   vector<unsigned int> words;
+   unsigned int doc_size;
+   while ((doc_size = source.next_size()) != 0) {
+      words.resize(doc_size);
+      source.read(words.data());
+      if (!writeStreamDoc(file,words.data(),doc_size)) {
+         std::cout << "Write to " << path << " failed" << endl;
+         fclose(file);
+         return 1;
+      }
+   }
+   fclose(file);
+   std::cout << "Wrote " << num_docs << " documents to " << path << endl;
+   return 0;
+}
+
+// Scores documents from a stream file, or num_docs generated documents, chunk by chunk.
+// Only ring_size chunks of chunk_words words are ever resident; scores are written
+// to out_path as "doc score" lines as soon as their chunk is done.
+int runStream(const string& input,unsigned int num_threads,const char* out_path)
+{
+   const unsigned int ring_size = 3;
+   const unsigned int chunk_words = 16*1024*1024;
+
+   setupProfile();
+
+   FILE* in = 0;
+   doc_source* source;
+   if (is_doc_count(input)) {
+      source = new generated_doc_source(strtoul(input.c_str(),0,10));
+   } else {
+      in = fopen(input.c_str(),"rb");
+      if (!in) {
+         std::cout << "Cannot open " << input << endl;
+         return 1;
+      }
+      source = new file_doc_source(in);
+   }
+   FILE* out = out_path ? fopen(out_path,"w") : 0;
+
+   unsigned long total_words = 0;
+   unsigned long total_score = 0;
+   unsigned long chunks = 0;
+   chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+   long scored = streamScore(*source,ring_size,chunk_words,
+      [&](doc_chunk& chunk) {
+         runOnCPU_parallel(chunk.doc_sizes.data(),chunk.input_doc_words.data(),bloom_filter.data(),profile_weights.data(),chunk.profileScore.data(),chunk.num_docs,num_threads,false);
+         total_words += chunk.num_words;
+         chunks++;
+      },
+      [&](unsigned long first_doc,unsigned int num_docs,const unsigned long* scores) {
+         for (unsigned int doci = 0; doci < num_docs; doci++) {
+            total_score += scores[doci];
+            if (out) fprintf(out,"%lu %lu\n",first_doc + doci,scores[doci]);
+         }
+      });
+   chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+   chrono::duration<double> time_span  = chrono::duration_cast<duration<double>>(t2-t1);
+
+   delete source;
+   if (in) fclose(in);
+   if (out) fclose(out);
+   if (scored < 0) {
+      std::cout << "FAILED: document stream is truncated or has a document larger than " << chunk_words << " words" << endl;
+      return 1;
+   }
+   std::cout << "Scored " << scored << " documents, total_terms = " << total_words << " in " << chunks << " chunks" << endl;
+   std::cout << "Peak document buffer memory = " << (ring_size*(unsigned long)chunk_words*sizeof(unsigned int) >> 20) << " MiB" << endl;
+   std::cout << "Sum of scores = " << total_score << endl;
+   std::cout << "Execution time of streaming CPU is " << time_span.count() << endl;
+   return 0;
+}
+
+
+// Scores the documents against num_profiles profiles in a single pass with
+// runOnCPU_parallel_multi, then once per profile with runOnCPU_parallel for
+// comparison, and checks every profile score against runOnCPU
+int runMultiProfile(unsigned int* h_doc_sizes,unsigned int* h_input_doc_words,unsigned int num_threads,unsigned int num_profiles)
+{
+   vector<unsigned int,aligned_allocator<unsigned int>> bloom_filters(num_profiles*(1L << bloom_size));
+   vector<profile_t,aligned_allocator<profile_t>> multi_weights(num_profiles*(unsigned long)profile_entries);
+   std::cout << "Creating " << num_profiles << " Profiles" << endl;
+   for (unsigned p = 0; p < num_profiles; p++)
+      if (!createProfile(&bloom_filters[p*(1L << bloom_size)],&multi_weights[p*(unsigned long)profile_entries],16384))
+         return 1;
+
+   vector<unsigned long,aligned_allocator<unsigned long>> multi_profileScore((unsigned long)total_num_docs*num_profiles);
+   chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+   runOnCPU_parallel_multi(h_doc_sizes,h_input_doc_words,bloom_filters.data(),multi_weights.data(),num_profiles,multi_profileScore.data(),total_num_docs,num_threads) ;
+   chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+   chrono::duration<double> time_span_multi  = chrono::duration_cast<duration<double>>(t2-t1);
+   cout << "Execution time of parallel CPU for " << num_profiles << " profiles in one pass is " << time_span_multi.count() << endl;
+
+   vector<unsigned long,aligned_allocator<unsigned long>> mt_profileScore(total_num_docs);
+   chrono::duration<double> time_span_mt(0);
+   for (unsigned p = 0; p < num_profiles; p++)
+   {
+      unsigned int* profile_bloom = &bloom_filters[p*(1L << bloom_size)];
+      profile_t* profile = &multi_weights[p*(unsigned long)profile_entries];
+      t1 = chrono::high_resolution_clock::now();
+      runOnCPU_parallel(h_doc_sizes,h_input_doc_words,profile_bloom,profile,mt_profileScore.data(),total_num_docs,num_threads,false) ;
+      t2 = chrono::high_resolution_clock::now();
+      time_span_mt += chrono::duration_cast<duration<double>>(t2-t1);
+
+      runOnCPU(h_doc_sizes,h_input_doc_words,profile_bloom,profile,cpu_profileScore.data(),total_num_docs) ;
+      for (unsigned doci = 0; doci < total_num_docs; doci++)
+      {
+         if (cpu_profileScore[doci] != multi_profileScore[(unsigned long)doci*num_profiles+p]) {
+            std::cout << "FAILED "<< endl  << " : profile " << p << " doc[" << doci << "]" << " score: CPU = " << cpu_profileScore[doci]<< ", multi-profile CPU = "<< multi_profileScore[(unsigned long)doci*num_profiles+p] <<  endl;
+            return 1;
+         }
+      }
+   }
+   cout << "Execution time of parallel CPU for " << num_profiles << " profiles one at a time is " << time_span_mt.count() << endl;
+   std::cout << "Verification: PASS" << endl;
+   return 0;
+}
+
+
+// Benchmark sweep of the CPU engine (make bench). For each number of documents
+// (the first total_num_docs/16, /4 and all of them), profile size, chunk size
+// and thread count the documents are scored with runOnCPU_parallel, one call
+// per chunk of about chunk_words words (0: a single call), and a line is
+// appended to csv_path (see bench.h). bloom_size is fixed at build time: the
+// bench target rebuilds the host for each size it sweeps.
+int runBench(unsigned int* h_doc_sizes,unsigned int* h_input_doc_words,const char* csv_path)
+{
+   const unsigned int bench_doc_fractions[] = {16,4,1};
+   const unsigned int bench_profile_words[] = {1024,4096,16384};
+   const unsigned int bench_chunk_words[] = {0,256*1024,4*1024*1024};
+   vector<unsigned int> bench_threads(1,1);
+   if (thread::hardware_concurrency() > 1)
+      bench_threads.push_back(thread::hardware_concurrency());
+
+   FILE* csv = openBenchCsv(csv_path);
+   if (!csv) {
+      std::cout << "Cannot open " << csv_path << endl;
+      return 1;
+   }
+   bloom_filter.resize(1L << bloom_size);
+   profile_weights.resize(profile_entries);
+   vector<unsigned long,aligned_allocator<unsigned long>> bench_profileScore(total_num_docs);
+
+   for (unsigned int f : bench_doc_fractions) {
+      unsigned int docs = max(1u,total_num_docs/f);
+      unsigned long words = 0;
+      for (unsigned int doci = 0; doci < docs; doci++)
+         words += h_doc_sizes[doci];
+      for (unsigned int profile_words : bench_profile_words) {
+         chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+         // Profiles too large for the filter are left out of the sweep
+         if (!createProfile(bloom_filter.data(),profile_weights.data(),profile_words))
+            continue;
+         chrono::duration<double> time_span_setup = chrono::high_resolution_clock::now()-t1;
+         for (unsigned int chunk_words : bench_chunk_words) {
+            for (unsigned int num_threads : bench_threads) {
+               score_counts counts = {0,0};
+               t1 = chrono::high_resolution_clock::now();
+               unsigned long offset = 0;
+               for (unsigned int first = 0; first < docs; ) {
+                  unsigned int last = first;
+                  unsigned long chunk = 0;
+                  while (last < docs && (chunk == 0 || chunk_words == 0 || chunk + h_doc_sizes[last] <= chunk_words))
+                     chunk += h_doc_sizes[last++];
+                  score_counts chunk_counts;
+                  runOnCPU_parallel(h_doc_sizes+first,h_input_doc_words+offset,bloom_filter.data(),profile_weights.data(),bench_profileScore.data()+first,last-first,num_threads,false,&chunk_counts);
+                  counts.false_access += chunk_counts.false_access;
+                  counts.total += chunk_counts.total;
+                  offset += chunk;
+                  first = last;
+               }
+               chrono::duration<double> time_span_cpu = chrono::high_resolution_clock::now()-t1;
+
+               bench_row row = {"cpu",docs,profile_words,chunk_words,num_threads,words,
+                                time_span_setup.count(),0,time_span_cpu.count(),0,time_span_cpu.count(),
+                                counts.total ? (double)counts.false_access/counts.total : 0};
+               writeBenchRow(csv,row);
+            }
+         }
+      }
+   }
+   fclose(csv);
+   std::cout << "Benchmark results appended to " << csv_path << endl;
+   return 0;
+}
+
+
+// Checks murmur2_24 against the generic MurmurHash2 over the whole 24-bit word ID domain
+int checkHash()
+{
+   for (unsigned word_id=0; word_id<(1L << 24); word_id++) {
+      murmur2_hashes hashes = murmur2_24(word_id);
+      unsigned hash_pu = MurmurHash2(&word_id,3,1);
+      unsigned hash_lu = MurmurHash2(&word_id,3,5);
+      if (hashes.hash_pu != hash_pu || hashes.hash_lu != hash_lu) {
+         std::cout << "FAILED "<< endl  << " : word_id " << word_id << " murmur2_24 = (" << hashes.hash_pu << "," << hashes.hash_lu << "), MurmurHash2 = (" << hash_pu << "," << hash_lu << ")" << endl;
+         return 1;
+      }
+   }
+   std::cout << "Hash verification: PASS" << endl;
+   return 0;
+}
+
+
+// Writes a copy of the corpus image file to path with its index and sizes
+// replaced, and returns 1 if corpus_map accepts it, 0 if not, -1 if the copy
+// cannot be written
+static int corpusAccepted(const char* path,const vector<char>& file,const vector<uint32_t>& index,const vector<uint32_t>& sizes)
+{
+   vector<char> bytes(file);
+   const corpus_header* header = (const corpus_header*)bytes.data();
+   memcpy(&bytes[header->index_offset],index.data(),index.size()*sizeof(uint32_t));
+   memcpy(&bytes[header->sizes_offset],sizes.data(),sizes.size()*sizeof(uint32_t));
+   FILE* out = fopen(path,"wb");
+   if (!out || fwrite(bytes.data(),1,bytes.size(),out) != bytes.size() || fclose(out) != 0) {
+      std::cout << "Cannot write " << path << endl;
+      return -1;
+   }
+   corpus_map corpus;
+   return corpus.open(path) ? 1 : 0;
+}
+
+// Checks that corpus_map accepts a corpus written by writeCorpus and rejects
+// copies whose index does not follow the document sizes, which would send
+// scoring past the end of the words
+int checkCorpus(const char* path)
+{
+   const uint32_t good_sizes[] = {1024,2048,1024,3072};
+   const unsigned int num_docs = sizeof(good_sizes)/sizeof(good_sizes[0]);
+   const uint32_t num_words = 1024+2048+1024+3072;
+   vector<unsigned int> words(num_words,0);
+   if (!writeCorpus(path,good_sizes,words.data(),num_docs))
+      return 1;
+
+   FILE* in = fopen(path,"rb");
+   vector<char> file;
+   if (in && fseek(in,0,SEEK_END) == 0) {
+      file.resize(ftell(in));
+      rewind(in);
+      if (fread(file.data(),1,file.size(),in) != file.size())
+         file.clear();
+   }
+   if (in)
+      fclose(in);
+   if (file.size() < sizeof(corpus_header)) {
+      std::cout << "Cannot read back " << path << endl;
+      return 1;
+   }
+
+   struct corpus_case {
+      const char* name;
+      vector<uint32_t> index;
+      vector<uint32_t> sizes;
+      int accepted;
+   };
+   const vector<uint32_t> good_index = {0,1024,3072,4096};
+   const vector<uint32_t> sizes(good_sizes,good_sizes+num_docs);
+   const corpus_case cases[] = {
+      {"written corpus",good_index,sizes,1},
+      {"every document over all words",{0,0,0,0},{num_words,num_words,num_words,num_words},0},
+      {"document starting one word late",{0,1024,3073,4096},sizes,0},
+      {"documents overlapping",{0,1024,2048,4096},sizes,0},
+      {"documents short of the words",good_index,{1024,2048,1024,2048},0},
+   };
+   int failed = 0;
+   for (const corpus_case& test : cases) {
+      int accepted = corpusAccepted(path,file,test.index,test.sizes);
+      if (accepted != test.accepted) {
+         std::cout << "FAILED : " << test.name << " was " << (accepted < 0 ? "not written" : accepted ? "accepted" : "rejected") << endl;
+         failed = 1;
+      }
+   }
+   remove(path);
+   if (!failed)
+      std::cout << "Corpus verification: PASS" << endl;
+   return failed;
+}
 
 
 int main(int argc, char** argv)
    
 {
+   if(argc==2 && string(argv[1])=="hashcheck")
+    return checkHash();
+
+   if(argc==3 && string(argv[1])=="corpuscheck")
+    return checkCorpus(argv[2]);
+
+   if(argc==4 && string(argv[1])=="write_stream")
+    return writeStream(strtoul(argv[2],0,10),argv[3]);
 
-   if(argc==3){
-    total_num_docs=atoi(argv[2]);
+   if(argc==4 && string(argv[1])=="write_corpus")
+    return writeCorpusFile(atoi(argv[2]),argv[3]);
+
+   if((argc>=3 && argc<=5) && string(argv[1])=="stream")
+    return runStream(argv[2],argc>=4 ? atoi(argv[3]) : thread::hardware_concurrency(),argc==5 ? argv[4] : 0);
+
+
+   unsigned int num_threads = thread::hardware_concurrency();
+   bool topk = (argc>=3 && string(argv[1])=="cpu_topk");
+   bool multi = (argc>=3 && string(argv[1])=="cpu_multi");
+   // bench <docs|corpus> <csv>: see runBench
+   bool bench = (argc==4 && string(argv[1])=="bench");
+   if(argc==3 || argc==4 || ((topk || multi) && argc==5)){
+    if(argc>=4 && !bench) num_threads=atoi(argv[3]);
    } else {
    cout << "Incorrect number of arguments"<<endl;
    return 0;
    } 
+   bool parallel = (string(argv[1])=="cpu_mt");
     
    std::cout << "Initializing data"<< endl;
-  
-   setupData();
+
+   // The documents are either generated or mapped from a corpus file written by write_corpus
+   corpus_map corpus;
+   unsigned int* h_doc_sizes;
+   unsigned int* h_input_doc_words;
+   if(is_doc_count(argv[2])) {
+      total_num_docs=atoi(argv[2]);
+      setupDocs();
+      h_doc_sizes = doc_sizes.data();
+      h_input_doc_words = input_doc_words.data();
+   } else {
+      if(!corpus.open(argv[2]))
+         return 1;
+      total_num_docs = corpus.num_docs;
+      std::cout << "Mapped corpus " << argv[2] << " with " << total_num_docs << " documents, total_terms = " << corpus.num_words << endl;
+      cpu_profileScore.resize(total_num_docs);
+      h_doc_sizes = corpus.doc_sizes;
+      h_input_doc_words = corpus.input_doc_words;
+   }
+
+   // The benchmark sweep creates its own profiles
+   if(bench)
+      return runBench(h_doc_sizes,h_input_doc_words,argv[3]);
+
+   setupProfile();
+
+   if(multi)
+      return runMultiProfile(h_doc_sizes,h_input_doc_words,num_threads,(argc==5) ? atoi(argv[4]) : 4);
+
+   if(topk) {
+      unsigned int k = (argc==5) ? atoi(argv[4]) : 10;
+      vector<doc_score> best(k);
+
+      chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+      runOnCPU_parallel_topk(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),k,best.data(),total_num_docs,num_threads) ;
+      chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+      chrono::duration<double> time_span_topk  = chrono::duration_cast<duration<double>>(t2-t1);
+      cout << "Execution time of parallel CPU top-" << k << " is " << time_span_topk.count() << endl;
+
+      // Reference: full scores from runOnCPU, ranked afterwards
+      runOnCPU(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),cpu_profileScore.data(),total_num_docs) ;
+      topk_heap reference(k);
+      for (unsigned doci = 0; doci < total_num_docs; doci++)
+         reference.push(doci,cpu_profileScore[doci]);
+      vector<doc_score> expected(k);
+      reference.sorted(expected.data());
+
+      for (unsigned i = 0; i < k && best[i].doc != topk_no_doc; i++)
+         if (i < 10) cout << "  #" << i+1 << " doc[" << best[i].doc << "] score " << best[i].score << endl;
+      for (unsigned i = 0; i < k; i++)
+      {
+         if (best[i].doc != expected[i].doc || best[i].score != expected[i].score) {
+            std::cout << "FAILED "<< endl  << " : rank " << i+1 << " CPU = doc[" << expected[i].doc << "] " << expected[i].score << ", top-k = doc["<< best[i].doc << "] " << best[i].score <<  endl;
+            return 0;
+         }
+      }
+      std::cout << "Verification: PASS" << endl;
+      return 0;
+   }
+
+   if(parallel) {
+      vector<unsigned long,aligned_allocator<unsigned long>> mt_profileScore(total_num_docs);
+
+      chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+      runOnCPU_parallel(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),mt_profileScore.data(),total_num_docs,num_threads) ;
+      chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+      chrono::duration<double> time_span_mt  = chrono::duration_cast<duration<double>>(t2-t1);
+      cout << "Execution time of parallel CPU is " << time_span_mt.count() << endl;
+
+      t1 = chrono::high_resolution_clock::now();
+      runOnCPU(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),cpu_profileScore.data(),total_num_docs) ;
+      t2 = chrono::high_resolution_clock::now();
+      chrono::duration<double> time_span_cpu  = chrono::duration_cast<duration<double>>(t2-t1);
+      cout << "Execution time of CPU is " << time_span_cpu.count() << endl;
+
+      for (unsigned doci = 0; doci < total_num_docs; doci++)
+      {
+         if (cpu_profileScore[doci] != mt_profileScore[doci]) {
+            std::cout << "FAILED "<< endl  << " : doc[" << doci << "]" << " score: CPU = " << cpu_profileScore[doci]<< ", parallel CPU = "<< mt_profileScore[doci] <<  endl;
+            return 0;
+         }
+      }
+      std::cout << "Verification: PASS" << endl;
+      return 0;
+   }
+
    chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
 
-   runOnCPU(doc_sizes.data(),input_doc_words.data(),bloom_filter.data(),profile_weights.data(),cpu_profileScore.data(),total_num_docs) ;
+   runOnCPU(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),cpu_profileScore.data(),total_num_docs) ;
 
    chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
    chrono::duration<double> time_span_cpu  = chrono::duration_cast<duration<double>>(t2-t1);
+   cout << "Execution time of CPU is " << time_span_cpu.count() << endl;
 
    return 0;
 }
@@ -0,0 +1,102 @@
+#include<cstring>
+#include"sizes.h"
+#include"MurmurHash2.h"
+#include"profile_table.h"
+
+// Builds the compact profile table (profile_table_slots slots) from a list of
+// (word_id, weight) pairs. A word listed twice keeps its last weight and words
+// with a zero weight are left out. Returns false if a weight does not fit in
+// 8 bits or if both candidate buckets of a word are full, in which case
+// profile_bucket_bits has to be increased.
+bool buildProfileTable(unsigned int* profile_table,const unsigned int* word_ids,const unsigned int* weights,unsigned int num_words)
+{
+   unsigned int load[1 << profile_bucket_bits];
+   memset(load,0,sizeof(load));
+   memset(profile_table,0,profile_table_slots*sizeof(unsigned int));
+
+   for (unsigned int i = 0; i < num_words; i++) {
+      unsigned int word_id = word_ids[i] & 0xffffff;
+      unsigned int weight = weights[i];
+      if (weight == 0) continue;
+      if (weight > profile_weight_max) return false;
+
+      murmur2_hashes hashes = murmur2_24(word_id);
+      unsigned int bucket[2] = { profile_bucket1(hashes.hash_pu,hashes.hash_lu), profile_bucket2(hashes.hash_pu,hashes.hash_lu) };
+      bool updated = false;
+      for (unsigned int b = 0; b < 2 && !updated; b++) {
+         unsigned int* slots = profile_table + bucket[b] * profile_bucket_slots;
+         for (unsigned int s = 0; s < load[bucket[b]]; s++) {
+            if (profile_slot_match(slots[s],word_id)) {
+               slots[s] = (word_id << 8) | weight;
+               updated = true;
+               break;
+            }
+         }
+      }
+      if (updated) continue;
+
+      unsigned int target = (load[bucket[1]] < load[bucket[0]]) ? bucket[1] : bucket[0];
+      if (load[target] == profile_bucket_slots) return false;
+      profile_table[target * profile_bucket_slots + load[target]] = (word_id << 8) | weight;
+      load[target]++;
+   }
+   return true;
+}
+
+static unsigned int bucket_load(const unsigned int* slots)
+{
+   unsigned int load = 0;
+   while (load < profile_bucket_slots && slots[load] != 0)
+      load++;
+   return load;
+}
+
+// Adds word_id to a table built by buildProfileTable, or changes its weight,
+// the same way buildProfileTable would. Returns the bucket that changed, or -1
+// if the weight does not fit in 8 bits or both candidate buckets are full.
+int profileTableInsert(unsigned int* profile_table,unsigned int word_id,unsigned int weight)
+{
+   word_id &= 0xffffff;
+   if (weight == 0 || weight > profile_weight_max) return -1;
+
+   murmur2_hashes hashes = murmur2_24(word_id);
+   unsigned int bucket[2] = { profile_bucket1(hashes.hash_pu,hashes.hash_lu), profile_bucket2(hashes.hash_pu,hashes.hash_lu) };
+   unsigned int load[2];
+   for (unsigned int b = 0; b < 2; b++) {
+      unsigned int* slots = profile_table + bucket[b] * profile_bucket_slots;
+      load[b] = bucket_load(slots);
+      for (unsigned int s = 0; s < load[b]; s++) {
+         if (profile_slot_match(slots[s],word_id)) {
+            slots[s] = (word_id << 8) | weight;
+            return bucket[b];
+         }
+      }
+   }
+
+   unsigned int target = (load[1] < load[0]) ? 1 : 0;
+   if (load[target] == profile_bucket_slots) return -1;
+   profile_table[bucket[target] * profile_bucket_slots + load[target]] = (word_id << 8) | weight;
+   return bucket[target];
+}
+
+// Removes word_id, moving the last slot of its bucket into the hole so the
+// occupied slots stay packed. Returns the bucket that changed, or -1 if
+// word_id is not in the table.
+int profileTableRemove(unsigned int* profile_table,unsigned int word_id)
+{
+   word_id &= 0xffffff;
+   murmur2_hashes hashes = murmur2_24(word_id);
+   unsigned int bucket[2] = { profile_bucket1(hashes.hash_pu,hashes.hash_lu), profile_bucket2(hashes.hash_pu,hashes.hash_lu) };
+   for (unsigned int b = 0; b < 2; b++) {
+      unsigned int* slots = profile_table + bucket[b] * profile_bucket_slots;
+      unsigned int load = bucket_load(slots);
+      for (unsigned int s = 0; s < load; s++) {
+         if (profile_slot_match(slots[s],word_id)) {
+            slots[s] = slots[load-1];
+            slots[load-1] = 0;
+            return bucket[b];
+         }
+      }
+   }
+   return -1;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include"sizes.h"
+
+//-----------------------------------------------------------------------------
+// Compact profile weight table.
+//
+// The profile only holds a few thousand word IDs, so instead of a dense
+// unsigned long per word ID the weights can be kept in a small hash table of
+// (1 << profile_bucket_bits) buckets of profile_bucket_slots 32-bit slots.
+// A slot holds (word_id << 8) | weight, 0 marks an empty slot, so weights are
+// narrowed to 8 bits. Each word can live in one of two buckets, picked from
+// the murmur2_24 hashes it already computed for the bloom filter; the host
+// inserts it in the less loaded one, so a lookup reads at most two buckets.
+
+#define profile_table_slots ((1 << profile_bucket_bits) * profile_bucket_slots)
+
+#if profile_compact
+typedef unsigned int profile_t;
+#define profile_entries profile_table_slots
+#else
+typedef unsigned long profile_t;
+#define profile_entries (1 << 24)
+#endif
+
+#define profile_weight_max 0xff
+
+inline unsigned int profile_bucket1(unsigned int hash_pu,unsigned int hash_lu)
+{
+	return (hash_lu >> 8) & ((1 << profile_bucket_bits) - 1);
+}
+
+inline unsigned int profile_bucket2(unsigned int hash_pu,unsigned int hash_lu)
+{
+	return (hash_pu >> (32 - profile_bucket_bits)) & ((1 << profile_bucket_bits) - 1);
+}
+
+inline bool profile_slot_match(unsigned int slot,unsigned int word_id)
+{
+	return slot != 0 && (slot >> 8) == word_id;
+}
+
+// Weight of word_id in the profile, 0 if the word is not in the profile
+inline unsigned long profile_weight(const profile_t* profile_weights,unsigned int word_id,unsigned int hash_pu,unsigned int hash_lu)
+{
+#if profile_compact
+	const profile_t* bucket1 = profile_weights + profile_bucket1(hash_pu,hash_lu) * profile_bucket_slots;
+	const profile_t* bucket2 = profile_weights + profile_bucket2(hash_pu,hash_lu) * profile_bucket_slots;
+	unsigned long weight = 0;
+	for (unsigned int i = 0; i < profile_bucket_slots; i++) {
+		// Host code includes this header too, and -Wall warns about HLS pragmas
+#ifdef __SYNTHESIS__
+#pragma HLS unroll
+#endif
+		if (profile_slot_match(bucket1[i],word_id)) weight = bucket1[i] & profile_weight_max;
+		if (profile_slot_match(bucket2[i],word_id)) weight = bucket2[i] & profile_weight_max;
+	}
+	return weight;
+#else
+	return profile_weights[word_id];
+#endif
+}
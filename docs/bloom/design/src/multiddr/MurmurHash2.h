@@ -0,0 +1,39 @@
+#pragma once
+
+//-----------------------------------------------------------------------------
+// MurmurHash2 specialized for the 24-bit word IDs of the bloom filter.
+//
+// Every call site hashes a word ID with len = 3 and seeds 1 and 5, so the
+// byte loads and the length switch of the generic MurmurHash2 fold into a
+// single xor with (seed ^ 3). The result is identical to
+// MurmurHash2(&word_id, 3, seed) for any word_id (only the 3 low bytes are
+// hashed), and the functions are constexpr so they can be used both in the
+// host code and in the HLS kernel.
+
+struct murmur2_hashes {
+	unsigned int hash_pu;   // seed 1
+	unsigned int hash_lu;   // seed 5
+};
+
+constexpr unsigned int murmur2_m = 0x5bd1e995;
+
+constexpr unsigned int murmur2_final(unsigned int h)
+{
+	return ((h ^ (h >> 13)) * murmur2_m) ^ (((h ^ (h >> 13)) * murmur2_m) >> 15);
+}
+
+template<unsigned int seed>
+constexpr unsigned int murmur2_24(unsigned int word_id)
+{
+	return murmur2_final(((seed ^ 3) ^ (word_id & 0xffffff)) * murmur2_m);
+}
+
+constexpr murmur2_hashes murmur2_24(unsigned int word_id)
+{
+	return murmur2_hashes{murmur2_24<1>(word_id), murmur2_24<5>(word_id)};
+}
+
+// Reference values taken from the generic MurmurHash2(&word_id, 3, seed)
+static_assert(murmur2_24<1>(0x000000) == 0xd29edd7a && murmur2_24<5>(0x000000) == 0xdab59de1, "murmur2_24 mismatch");
+static_assert(murmur2_24<1>(0x123456) == 0x2b19db0c && murmur2_24<5>(0x123456) == 0x87ef139e, "murmur2_24 mismatch");
+static_assert(murmur2_24<1>(0xffffff) == 0x3d4f2b91 && murmur2_24<5>(0xffffff) == 0x7c5caf55, "murmur2_24 mismatch");
@@ -6,16 +6,147 @@
 #include<cstring>
 #include<hls_stream.h>
 #include"sizes.h"
-#include"MurmurHash2.c"
+#include"MurmurHash2.h"
+#include"profile_table.h"
+#include"membership_filter.h"
+#if bloom_wide
+#include<ap_int.h>
+#endif
 
 
 
 const unsigned int bloom_filter_size = 1<<bloom_size;
 
+#if bloom_wide
+// One 512-bit memory beat carries bloom_lanes document words
+typedef ap_uint<32*bloom_lanes> doc_beat;
+typedef doc_beat doc_input_t;
+#else
+typedef unsigned int doc_input_t;
+#endif
+
+#if profile_compact
+// The compact weight tables are on chip, each profile in its own memories
+typedef profile_t profile_store[bloom_profiles][profile_entries];
+#define profile_of(store,p) ((store)[p])
+#else
+// The dense weight tables stay in DDR, profile_entries apart
+typedef profile_t* profile_store;
+#define profile_of(store,p) ((store) + (unsigned long)(p)*profile_entries)
+#endif
+
 
 extern "C" 
 {
 
+#if bloom_wide
+
+// Reads the documents a full 512-bit beat at a time. Document sizes are
+// multiples of bloom_lanes words, so every beat holds words of a single document.
+void read_dataflow(hls::stream<doc_beat>& read_stream,const doc_beat* input_doc_words,unsigned int total_size) {
+
+for(unsigned int beat=0;beat<total_size/bloom_lanes;beat++)
+#pragma HLS pipeline II=1
+ read_stream << input_doc_words[beat];
+
+
+}
+
+
+// A beat with words that passed the filter, or the last beat of a document
+struct beat_hits {
+   doc_beat words;
+   ap_uint<bloom_lanes> hits;
+   bool last;
+};
+
+// The bloom_lanes words of a beat are hashed and probed in parallel, each lane
+// against its own copy of the membership filter, and a new beat enters every
+// cycle. Only the beats with hits go on to the weight lookup, with the lanes
+// that hit, plus a record that closes each document.
+void probe_beats (unsigned int* doc_sizes,hls::stream<doc_beat>& read_stream,unsigned int bloom_filter_local[bloom_lanes][bloom_filter_size],hls::stream<beat_hits>& hit_stream,unsigned int total_num_docs) {
+
+   for(unsigned int doc=0;doc<total_num_docs;doc++) {
+
+   unsigned int beats = doc_sizes[doc]/bloom_lanes;
+   if (beats == 0)
+   {
+      beat_hits empty;
+      empty.words = 0;
+      empty.hits = 0;
+      empty.last = true;
+      hit_stream << empty;
+   }
+
+   for (unsigned int b=0; b < beats; b++)
+   {
+#pragma HLS pipeline II=1
+         beat_hits record;
+         read_stream >> record.words;
+         record.hits = 0;
+         record.last = (b == beats-1);
+
+         for (unsigned int lane=0; lane < bloom_lanes; lane++)
+         {
+#pragma HLS unroll
+            unsigned int curr_entry = record.words.range(32*lane+31,32*lane);
+            unsigned int word_id = curr_entry >> 8;
+            murmur2_hashes hashes = murmur2_24(word_id);
+            unsigned hash_pu = hashes.hash_pu;
+            unsigned hash_lu = hashes.hash_lu;
+            bool doc_end= (word_id==docTag); 
+            record.hits[lane] = (!doc_end) && filter_contains(bloom_filter_local[lane],hash_pu,hash_lu);
+         }
+
+         if (record.hits != 0 || record.last)
+            hit_stream << record;
+   }
+  }
+ }
+
+// Words that pass the filter are rare (profile words and false positives), so
+// their weights are looked up one hit per cycle, behind a FIFO that absorbs
+// the bursts while probe_beats keeps reading a beat every cycle.
+void accumulate_hits (hls::stream<beat_hits>& hit_stream,profile_t* profile_weights,hls::stream<unsigned long>& score_stream,unsigned int total_num_docs) {
+
+   for(unsigned int doc=0;doc<total_num_docs;doc++) {
+
+   unsigned long ans = 0;
+   bool last = false;
+   while (!last)
+   {
+         beat_hits record;
+         hit_stream >> record;
+         last = record.last;
+         ap_uint<bloom_lanes> pending = record.hits;
+
+         while (pending != 0)
+         {
+#pragma HLS pipeline II=1
+            // Lowest lane still pending
+            unsigned int lane = 0;
+            for (int l=bloom_lanes-1; l >= 0; l--)
+            {
+#pragma HLS unroll
+               if (pending[l])
+                  lane = l;
+            }
+            pending[lane] = 0;
+
+            unsigned int curr_entry = record.words.range(32*lane+31,32*lane);
+            unsigned int frequency = curr_entry & 0x00ff;
+            unsigned int word_id = curr_entry >> 8;
+            murmur2_hashes hashes = murmur2_24(word_id);
+            ans += profile_weight(profile_weights,word_id,hashes.hash_pu,hashes.hash_lu) * (unsigned long)frequency;
+         }
+   }
+        score_stream << ans;
+  }
+    
+ } 
+
+#else
+
 void read_dataflow(hls::stream<unsigned int>& read_stream,const unsigned int* input_doc_words,unsigned int total_size) {
 
 for(int index=0;index<total_size;index++)
@@ -25,12 +156,61 @@ for(int index=0;index<total_size;index++)
 }
 
 
-void compute_score (unsigned int* doc_sizes,hls::stream<unsigned int>& read_stream,unsigned int* bloom_filter_local,unsigned long* profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs) {
+#if doc_unpadded
+
+// Each document ends with a docTag marker, so the words of the whole chunk are
+// scored in one flat loop and doc_sizes is never read.
+void compute_score (hls::stream<unsigned int>& read_stream,unsigned int bloom_filter_local[bloom_profiles][bloom_filter_size],profile_store profile_weights,hls::stream<unsigned long>& score_stream,unsigned int total_size) {
+
+   unsigned long ans[bloom_profiles];
+#pragma HLS array_partition variable=ans complete
+   for (unsigned int p=0; p < bloom_profiles; p++)
+#pragma HLS unroll
+      ans[p] = 0;
+
+   for (unsigned int i=0; i < total_size; i++)
+   {
+         unsigned int curr_entry;
+        read_stream >> curr_entry;
+         if (curr_entry == docTag)
+         {
+            for (unsigned int p=0; p < bloom_profiles; p++)
+            {
+               score_stream << ans[p];
+               ans[p] = 0;
+            }
+            continue;
+         }
+         unsigned int frequency = curr_entry & 0x00ff;
+         unsigned int word_id = curr_entry >> 8;
+         murmur2_hashes hashes = murmur2_24(word_id);
+         unsigned hash_pu = hashes.hash_pu;
+         unsigned hash_lu = hashes.hash_lu;
+
+         // The word is hashed once for all the profiles
+         for (unsigned int p=0; p < bloom_profiles; p++)
+         {
+#pragma HLS unroll
+            if (filter_contains(bloom_filter_local[p],hash_pu,hash_lu))
+            {
+               ans[p] += profile_weight(profile_of(profile_weights,p),word_id,hash_pu,hash_lu) * (unsigned long)frequency;
+            }
+         }
+   }
+ } 
+
+#else
+
+void compute_score (unsigned int* doc_sizes,hls::stream<unsigned int>& read_stream,unsigned int bloom_filter_local[bloom_profiles][bloom_filter_size],profile_store profile_weights,hls::stream<unsigned long>& score_stream,unsigned int total_num_docs) {
 
 
    for(unsigned int doc=0;doc<total_num_docs;doc++) {
 
-   unsigned long ans = 0;
+   unsigned long ans[bloom_profiles];
+#pragma HLS array_partition variable=ans complete
+   for (unsigned int p=0; p < bloom_profiles; p++)
+#pragma HLS unroll
+      ans[p] = 0;
    unsigned int size = doc_sizes[doc];
 
    for (unsigned int i=0; i < size; i++)
@@ -40,34 +220,115 @@ void compute_score (unsigned int* doc_sizes,hls::stream<unsigned int>& read_stre
         read_stream >> curr_entry;
          unsigned int frequency = curr_entry & 0x00ff;
          unsigned int word_id = curr_entry >> 8;
-         unsigned hash_pu = MurmurHash2( &word_id,3,1);
-         unsigned hash_lu = MurmurHash2( &word_id,3,5);
+         murmur2_hashes hashes = murmur2_24(word_id);
+         unsigned hash_pu = hashes.hash_pu;
+         unsigned hash_lu = hashes.hash_lu;
          bool doc_end= (word_id==docTag); 
-         unsigned hash1 = hash_pu&hash_bloom; 
-         bool inh1 = (!doc_end) && (bloom_filter_local[ hash1 >> 5 ] & ( 1 << (hash1 & 0x1f)));
-         unsigned hash2=(hash_pu+hash_lu)&hash_bloom;
-         bool inh2 = (!doc_end) && (bloom_filter_local[ hash2 >> 5 ] & ( 1 << (hash2 & 0x1f)));
 
-         if (inh1 && inh2)
+         // The word is hashed once for all the profiles
+         for (unsigned int p=0; p < bloom_profiles; p++)
          {
-            ans += profile_weights[word_id] * (unsigned long)frequency;
+#pragma HLS unroll
+            if ((!doc_end) && filter_contains(bloom_filter_local[p],hash_pu,hash_lu))
+            {
+               ans[p] += profile_weight(profile_of(profile_weights,p),word_id,hash_pu,hash_lu) * (unsigned long)frequency;
+            }
          }
    }
-        fpga_profileScore[doc]=ans;
+   for (unsigned int p=0; p < bloom_profiles; p++)
+        score_stream << ans[p];
   }
     
  } 
 
-void wrapper(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter_local,unsigned long* profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs,unsigned int total_size) {
-hls::stream<unsigned int> read_stream("read");
+#endif
+#endif
+
+#if bloom_topk
+// Keeps the bloom_topk best scores of the chunk on chip and writes them as
+// bloom_topk (score, doc) pairs, so only those come back over PCIe instead of
+// one score per document. Documents arrive in increasing order, so a new
+// document only replaces the worst entry with a strictly higher score: on
+// equal scores the lower document ID stays, like topk_before on the host.
+// Entries are unsorted and unused ones have doc = docTag.
+void select_topk (hls::stream<unsigned long>& score_stream,unsigned long* fpga_profileScore,unsigned int total_num_docs) {
+
+   unsigned long best_score[bloom_topk];
+   unsigned int best_doc[bloom_topk];
+#pragma HLS array_partition variable=best_score complete
+#pragma HLS array_partition variable=best_doc complete
+   unsigned int filled = 0;
+   unsigned int worst = 0;
+
+   for(unsigned int doc=0;doc<total_num_docs;doc++) {
+      unsigned long score;
+      score_stream >> score;
+      if (filled < bloom_topk) {
+         best_score[filled] = score;
+         best_doc[filled] = doc;
+         filled++;
+      } else if (score > best_score[worst]) {
+         best_score[worst] = score;
+         best_doc[worst] = doc;
+      } else {
+         continue;
+      }
+
+      if (filled == bloom_topk) {
+         // Lowest score, latest document on ties
+         for (unsigned int i = 0; i < bloom_topk; i++) {
+#pragma HLS unroll
+            if (best_score[i] < best_score[worst] || (best_score[i] == best_score[worst] && best_doc[i] > best_doc[worst]))
+               worst = i;
+         }
+      }
+   }
+
+   for (unsigned int i = 0; i < bloom_topk; i++) {
+      fpga_profileScore[2*i] = i < filled ? best_score[i] : 0;
+      fpga_profileScore[2*i+1] = i < filled ? best_doc[i] : docTag;
+   }
+}
+#else
+// bloom_profiles scores per document
+void write_scores (hls::stream<unsigned long>& score_stream,unsigned long* fpga_profileScore,unsigned int total_num_docs) {
+
+   for(unsigned int i=0;i<total_num_docs*bloom_profiles;i++)
+      score_stream >> fpga_profileScore[i];
+}
+#endif
+
+#if bloom_wide
+void wrapper(unsigned int* doc_sizes,doc_beat* input_doc_words,unsigned int bloom_filter_local[bloom_lanes][bloom_filter_size],profile_store profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs,unsigned int total_size) {
+#else
+void wrapper(unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int bloom_filter_local[bloom_profiles][bloom_filter_size],profile_store profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs,unsigned int total_size) {
+#endif
+hls::stream<doc_input_t> read_stream("read");
+hls::stream<unsigned long> score_stream("score");
+#if bloom_wide
+hls::stream<beat_hits> hit_stream("hits");
+#pragma HLS stream variable=hit_stream depth=64
+#endif
 
 #pragma HLS dataflow
 
 read_dataflow(read_stream,input_doc_words,total_size) ;
-compute_score (doc_sizes,read_stream,bloom_filter_local,profile_weights,fpga_profileScore,total_num_docs);
+#if bloom_wide
+probe_beats (doc_sizes,read_stream,bloom_filter_local,hit_stream,total_num_docs);
+accumulate_hits (hit_stream,profile_of(profile_weights,0),score_stream,total_num_docs);
+#elif doc_unpadded
+compute_score (read_stream,bloom_filter_local,profile_weights,score_stream,total_size);
+#else
+compute_score (doc_sizes,read_stream,bloom_filter_local,profile_weights,score_stream,total_num_docs);
+#endif
+#if bloom_topk
+select_topk (score_stream,fpga_profileScore,total_num_docs);
+#else
+write_scores (score_stream,fpga_profileScore,total_num_docs);
+#endif
 }
 
-void runOnfpga (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned int* bloom_filter,unsigned long* profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs,unsigned int total_size,bool load_weights) {
+void runOnfpga (unsigned int* doc_sizes,doc_input_t* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs,unsigned int total_size,bool load_weights) {
 
 #pragma HLS INTERFACE ap_ctrl_chain port=return bundle=control
 #pragma HLS INTERFACE s_axilite port=return bundle=control
@@ -86,9 +347,45 @@ void runOnfpga (unsigned int* doc_sizes,unsigned int* input_doc_words,unsigned i
 #pragma HLS INTERFACE m_axi port=profile_weights offset=slave bundle=gmem4
 #pragma HLS INTERFACE m_axi port=fpga_profileScore offset=slave bundle=gmem4
 
-  static unsigned int bloom_filter_local[bloom_filter_size];
+#if bloom_wide
+  // One copy of the bloom filter per lane, each in its own memories
+  static unsigned int bloom_filter_local[bloom_lanes][bloom_filter_size];
+#pragma HLS array_partition variable=bloom_filter_local complete dim=1
+#if membership_filter
+  // The two words of a cuckoo bucket are read in the same cycle, a bucket on each port
+#pragma HLS array_partition variable=bloom_filter_local cyclic factor=2 dim=2
+#endif
+if(load_weights==true)
+  for(unsigned int i=0;i<bloom_filter_size;i++) {
+#pragma HLS pipeline II=1
+    unsigned int bits = bloom_filter[i];
+    for(unsigned int lane=0;lane<bloom_lanes;lane++)
+      bloom_filter_local[lane][i] = bits;
+  }
+#else
+  // One bloom filter per profile, each in its own memories
+  static unsigned int bloom_filter_local[bloom_profiles][bloom_filter_size];
+#pragma HLS array_partition variable=bloom_filter_local complete dim=1
+#if membership_filter
+  // The two words of a cuckoo bucket are read in the same cycle, a bucket on each port
+#pragma HLS array_partition variable=bloom_filter_local cyclic factor=2 dim=2
+#endif
+if(load_weights==true)
+  for(unsigned int p=0;p<bloom_profiles;p++)
+    memcpy(bloom_filter_local[p],bloom_filter+p*bloom_filter_size,bloom_filter_size*sizeof(unsigned int)); 
+#endif
+#if profile_compact
+  // The compact profile tables are small enough to live on chip next to the bloom filters
+  static profile_t profile_weights_local[bloom_profiles][profile_entries];
+#pragma HLS array_partition variable=profile_weights_local complete dim=1
+  // cyclic factor matches profile_bucket_slots so all the slots of a bucket are read in the same cycle
+#pragma HLS array_partition variable=profile_weights_local cyclic factor=8 dim=2
 if(load_weights==true)
-  memcpy(bloom_filter_local,bloom_filter,bloom_filter_size*sizeof(unsigned int)); 
+  for(unsigned int p=0;p<bloom_profiles;p++)
+    memcpy(profile_weights_local[p],profile_weights+p*profile_entries,profile_entries*sizeof(profile_t)); 
+wrapper(doc_sizes,input_doc_words,bloom_filter_local,profile_weights_local,fpga_profileScore,total_num_docs,total_size); 
+#else
 wrapper(doc_sizes,input_doc_words,bloom_filter_local,profile_weights,fpga_profileScore,total_num_docs,total_size); 
+#endif
 }
 }
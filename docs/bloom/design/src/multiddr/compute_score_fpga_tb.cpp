@@ -0,0 +1,148 @@
+#include<iostream>
+#include<vector>
+#include<cstdio>
+#include<cstdlib>
+#include"xcl2.hpp"
+#include"sizes.h"
+#include"MurmurHash2.h"
+#include"common.h"
+#if bloom_wide
+#include<ap_int.h>
+#endif
+
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// C simulation testbench of the runOnfpga kernel (make csim).
+//
+// Generated documents are scored by the kernel source, compiled for the host,
+// a few chunks at a time like run() sends them, and compared with runOnCPU.
+// The documents mix profile words, random words and docTag padding, and their
+// sizes are multiples of bloom_lanes words so the wide kernel can read them,
+// or end with a single docTag marker when built with UNPADDED=1. With
+// PROFILES=<n> each of the n profiles is checked against its own runOnCPU, and
+// FILTER=1 checks the cuckoo filter probes against the host ones.
+// Returns non-zero on a mismatch.
+
+#if bloom_wide
+typedef ap_uint<32*bloom_lanes> doc_input_t;
+#else
+typedef unsigned int doc_input_t;
+#endif
+
+extern "C" void runOnfpga (unsigned int* doc_sizes,doc_input_t* input_doc_words,unsigned int* bloom_filter,profile_t* profile_weights,unsigned long* fpga_profileScore,unsigned int total_num_docs,unsigned int total_size,bool load_weights);
+
+const unsigned int tb_num_docs = 300;
+const unsigned int tb_num_chunks = 3;
+const unsigned int tb_profile_words = 2000;
+
+int main()
+{
+   srand(1);
+
+   // bloom_profiles profiles back to back; profile_words collects the words of all of them
+   const unsigned long bloom_words = 1L << bloom_size;
+   vector<unsigned int> bloom_filter(bloom_words*bloom_profiles,0);
+   vector<profile_t> profile_weights((unsigned long)profile_entries*bloom_profiles,0);
+   vector<unsigned int> profile_words;
+   for (unsigned p=0; p<bloom_profiles; p++) {
+      unsigned int* bloom = bloom_filter.data() + p*bloom_words;
+      profile_t* weights = profile_weights.data() + p*(unsigned long)profile_entries;
+      vector<unsigned int> table_words;
+      vector<unsigned int> table_weights;
+      for (unsigned i=0; i<tb_profile_words; i++) {
+         unsigned entry = rand()%(1<<24);
+         unsigned weight = rand()%15+1;
+#if profile_compact
+         table_words.push_back(entry);
+         table_weights.push_back(weight);
+#else
+         weights[entry] = weight;
+#endif
+         profile_words.push_back(entry);
+         if (!filterInsert(bloom,entry)) {
+            cout << "Profile does not fit in the " << membership_filter_name << " filter" << endl;
+            return 1;
+         }
+      }
+#if profile_compact
+      if (!buildProfileTable(weights,table_words.data(),table_weights.data(),table_words.size())) {
+         cout << "Profile does not fit in the compact profile table" << endl;
+         return 1;
+      }
+#endif
+   }
+
+   // 512-bit aligned so the wide kernel can read the words as beats
+   vector<unsigned int,aligned_allocator<unsigned int>> doc_sizes(tb_num_docs);
+   vector<unsigned int,aligned_allocator<unsigned int>> starting_doc_id(tb_num_docs+1);
+   vector<unsigned int,aligned_allocator<unsigned int>> input_doc_words;
+   for (unsigned doc=0; doc<tb_num_docs; doc++) {
+#if doc_unpadded
+      unsigned int size = rand()%(32*bloom_lanes)+2;
+      unsigned int padding = 1;
+#else
+      unsigned int size = (rand()%32+1)*bloom_lanes;
+      unsigned int padding = rand()%bloom_lanes;
+#endif
+      starting_doc_id[doc] = input_doc_words.size();
+      doc_sizes[doc] = size;
+      for (unsigned i=0; i<size; i++) {
+         unsigned term = (rand()%4==0) ? profile_words[rand()%profile_words.size()] : rand()%((1L << 24)-1);
+         unsigned freq = rand()%254+1;
+         input_doc_words.push_back(i < size-padding ? (term << 8) | freq : docTag);
+      }
+   }
+   starting_doc_id[tb_num_docs] = input_doc_words.size();
+
+   // Score p of document d at d*bloom_profiles+p, like the kernel writes them
+   vector<unsigned long> cpu_profileScore((unsigned long)tb_num_docs*bloom_profiles);
+   for (unsigned p=0; p<bloom_profiles; p++) {
+      vector<unsigned long> scores(tb_num_docs);
+      runOnCPU(doc_sizes.data(),input_doc_words.data(),bloom_filter.data() + p*bloom_words,profile_weights.data() + p*(unsigned long)profile_entries,scores.data(),tb_num_docs);
+      for (unsigned doc=0; doc<tb_num_docs; doc++)
+         cpu_profileScore[(unsigned long)doc*bloom_profiles+p] = scores[doc];
+   }
+
+   // The bloom filter and profile are only loaded by the first chunk and kept on chip for the others
+   unsigned int docs_per_chunk = (tb_num_docs+tb_num_chunks-1)/tb_num_chunks;
+   unsigned int errors = 0;
+   for (unsigned first=0; first<tb_num_docs; first+=docs_per_chunk) {
+      unsigned int num_docs = min(docs_per_chunk,tb_num_docs-first);
+      unsigned int total_size = starting_doc_id[first+num_docs]-starting_doc_id[first];
+#if bloom_topk
+      vector<unsigned long> fpga_topk(2*bloom_topk);
+      runOnfpga(doc_sizes.data()+first,(doc_input_t*)(input_doc_words.data()+starting_doc_id[first]),bloom_filter.data(),profile_weights.data(),fpga_topk.data(),num_docs,total_size,first==0);
+
+      topk_heap fpga_best(bloom_topk), cpu_best(bloom_topk);
+      for (unsigned i=0; i<bloom_topk && fpga_topk[2*i+1]!=docTag; i++)
+         fpga_best.push(first+fpga_topk[2*i+1],fpga_topk[2*i]);
+      for (unsigned doc=first; doc<first+num_docs; doc++)
+         cpu_best.push(doc,cpu_profileScore[doc]);
+      vector<doc_score> fpga_sorted(bloom_topk), cpu_sorted(bloom_topk);
+      fpga_best.sorted(fpga_sorted.data());
+      cpu_best.sorted(cpu_sorted.data());
+      for (unsigned i=0; i<bloom_topk; i++)
+         if (fpga_sorted[i].doc != cpu_sorted[i].doc || fpga_sorted[i].score != cpu_sorted[i].score) {
+            cout << "Mismatch at rank " << i+1 << " of docs " << first << "-" << first+num_docs-1 << ": CPU = doc[" << cpu_sorted[i].doc << "] " << cpu_sorted[i].score << ", FPGA = doc[" << fpga_sorted[i].doc << "] " << fpga_sorted[i].score << endl;
+            errors++;
+         }
+#else
+      vector<unsigned long> fpga_profileScore((unsigned long)num_docs*bloom_profiles);
+      runOnfpga(doc_sizes.data()+first,(doc_input_t*)(input_doc_words.data()+starting_doc_id[first]),bloom_filter.data(),profile_weights.data(),fpga_profileScore.data(),num_docs,total_size,first==0);
+
+      for (unsigned i=0; i<num_docs*bloom_profiles; i++)
+         if (fpga_profileScore[i] != cpu_profileScore[(unsigned long)first*bloom_profiles+i]) {
+            cout << "Mismatch at doc[" << first+i/bloom_profiles << "] profile " << i%bloom_profiles << " score: CPU = " << cpu_profileScore[(unsigned long)first*bloom_profiles+i] << ", FPGA = " << fpga_profileScore[i] << endl;
+            errors++;
+         }
+#endif
+   }
+
+   if (errors) {
+      cout << "C simulation: FAILED with " << errors << " mismatches" << endl;
+      return 1;
+   }
+   cout << "C simulation: PASS (" << tb_num_docs << " documents, " << (bloom_wide ? bloom_lanes : 1) << " lanes, " << bloom_profiles << " profiles)" << endl;
+   return 0;
+}
@@ -0,0 +1,103 @@
+#include<thread>
+#include<atomic>
+#include<vector>
+#include<cmath>
+#include<cstdlib>
+#include"sizes.h"
+#include"doc_generator.h"
+
+using namespace std;
+
+// Documents handed to a generator thread at a time
+const unsigned int generate_docs_per_take = 64;
+
+// splitmix64 finalizer: a full-avalanche 64-bit mix, used as a counter-based RNG
+static inline unsigned long mix64(unsigned long x)
+{
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9UL;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111ebUL;
+   x ^= x >> 31;
+   return x;
+}
+
+// Counter 0 of a document draws its length, counters 1.. its words
+static inline unsigned long doc_key(unsigned long seed,unsigned long doc)
+{
+   return mix64(mix64(seed) ^ (doc * 0x9e3779b97f4a7c15UL));
+}
+
+static inline unsigned long doc_random(unsigned long key,unsigned long counter)
+{
+   return mix64(key + counter * 0x9e3779b97f4a7c15UL);
+}
+
+unsigned long docSeed()
+{
+   const char* seed = getenv("BLOOM_SEED");
+   return seed ? strtoul(seed,0,10) : doc_seed_default;
+}
+
+unsigned int generatedDocSize(unsigned long seed,unsigned long doc)
+{
+   // Box-Muller on the two 32-bit halves of one draw
+   unsigned long r = doc_random(doc_key(seed,doc),0);
+   double u1 = ((r >> 32) + 1.0) / 4294967296.0;
+   double u2 = (r & 0xffffffffUL) / 4294967296.0;
+   double len = 3500 + 500 * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+   unsigned int doc_len = len < 100 ? 100 : (len > 4000 ? 3500 : (unsigned int)len);
+#if doc_unpadded
+   // Real words plus the docTag end marker
+   return doc_len + 1;
+#else
+   unsigned int block_size = 1024;
+   return (doc_len + block_size - 1) & ~(block_size - 1);
+#endif
+}
+
+void generateDoc(unsigned long seed,unsigned long doc,unsigned int* words,unsigned int size)
+{
+   unsigned long key = doc_key(seed,doc);
+   for (unsigned int i = 0; i < doc_scored_words(size); i++) {
+      unsigned long r = doc_random(key,i + 1);
+      unsigned int term = (r & 0xffffffffUL) % ((1L << 24) - 1);
+      unsigned int freq = (r >> 32) % 254 + 1;
+      words[i] = (term << 8) | freq;
+   }
+#if doc_unpadded
+   words[size-1] = docTag;
+#endif
+}
+
+unsigned long generateDocSizes(unsigned long seed,unsigned int num_docs,unsigned int* doc_sizes,unsigned int* starting_doc_id)
+{
+   unsigned long total = 0;
+   for (unsigned int doc = 0; doc < num_docs; doc++) {
+      doc_sizes[doc] = generatedDocSize(seed,doc);
+      starting_doc_id[doc] = total;
+      total += doc_sizes[doc];
+   }
+   return total;
+}
+
+static void generate_worker(unsigned long seed,unsigned int num_docs,const unsigned int* doc_sizes,const unsigned int* starting_doc_id,unsigned int* input_doc_words,atomic<unsigned int>* next_doc)
+{
+   unsigned int first;
+   while ((first = next_doc->fetch_add(generate_docs_per_take)) < num_docs) {
+      unsigned int last = first + generate_docs_per_take < num_docs ? first + generate_docs_per_take : num_docs;
+      for (unsigned int doc = first; doc < last; doc++)
+         generateDoc(seed,doc,input_doc_words + starting_doc_id[doc],doc_sizes[doc]);
+   }
+}
+
+void generateDocWords(unsigned long seed,unsigned int num_docs,const unsigned int* doc_sizes,const unsigned int* starting_doc_id,unsigned int* input_doc_words,unsigned int num_threads)
+{
+   if (num_threads == 0) num_threads = 1;
+   atomic<unsigned int> next_doc(0);
+   vector<thread> workers;
+   for (unsigned int t = 0; t < num_threads; t++)
+      workers.push_back(thread(generate_worker,seed,num_docs,doc_sizes,starting_doc_id,input_doc_words,&next_doc));
+   for (unsigned int t = 0; t < workers.size(); t++)
+      workers[t].join();
+}
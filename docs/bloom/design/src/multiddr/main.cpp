@@ -7,145 +7,388 @@
 #include<iostream>
 #include<vector>
 #include<utility>
-#include<random>
+#include<string>
+#include<thread>
 #include"xcl2.hpp"
 #include"sizes.h"
+#include"MurmurHash2.h"
 #include"common.h"
+#include"corpus.h"
+#include"bench.h"
+#include"doc_generator.h"
 
 using namespace std;
 using namespace std::chrono;
 
 
-extern unsigned int MurmurHash2 ( const void * key, int len, unsigned int seed );
 
 
 vector<unsigned int,aligned_allocator<unsigned int>> input_doc_words;
-vector<unsigned long,aligned_allocator<unsigned long>> profile_weights;
+vector<profile_t,aligned_allocator<profile_t>> profile_weights;
 vector<unsigned int,aligned_allocator<unsigned int>> bloom_filter;
 vector<unsigned int,aligned_allocator<unsigned int>> starting_doc_id;
 vector<unsigned long,aligned_allocator<unsigned long>> fpga_profileScore;
 vector<unsigned int,aligned_allocator<unsigned int>> doc_sizes;
 vector<unsigned long,aligned_allocator<unsigned long>> cpu_profileScore;
 
-default_random_engine generator;
-normal_distribution<double> distribution(3500,500);
-
 unsigned int total_num_docs;
 unsigned size=0;
 
 
-unsigned doc_len()
-{
-   unsigned int len = distribution(generator);
-   if (len < 100) { len = 100; }
-   if(len > 4000) { len = 3500; }
-   return len;
-}
-
-
- void setupData()
+ void setupDocs()
 
 {
    starting_doc_id.reserve( total_num_docs );
-   fpga_profileScore.reserve( total_num_docs );
+   fpga_profileScore.reserve( (unsigned long)total_num_docs*bloom_profiles );
    cpu_profileScore.reserve(total_num_docs);
 
  //  h_docInfo.reserve( total_num_docs );
 
    doc_sizes.reserve( total_num_docs );
-   unsigned block_size = 1024;
-   for (unsigned i=0; i<total_num_docs; i++) {
-      unsigned unpadded_size = doc_len();
-      unsigned int padded_size = unpadded_size&(~(block_size-1));
-      if(unpadded_size & (block_size-1)) padded_size+=block_size;
-      starting_doc_id[i] = size;
-      size+=padded_size;
-      doc_sizes[i] = padded_size;
-   }
+   // Seeded documents (see doc_generator.h), sized first then generated in parallel
+   unsigned long seed = docSeed();
+   size = generateDocSizes(seed,total_num_docs,doc_sizes.data(),starting_doc_id.data());
     
-   bloom_filter.reserve( (1L << bloom_size) );
    input_doc_words.reserve( size );
 
-   std::cout << "Creating documents of total size = "<< size  << endl;
+   std::cout << "Creating documents of total size = "<< size  << " seed = " << seed << endl;
 
-   for (unsigned i=0; i<size; i++) {
-      input_doc_words[i] = docTag;
-   }
-   for (unsigned doci=0; doci < total_num_docs; doci++)
-   {
-      unsigned start_dimm1 = starting_doc_id[doci];
-      unsigned size_1 = doc_sizes[doci];
-      unsigned term;
-      unsigned freq;
+   generateDocWords(seed,total_num_docs,doc_sizes.data(),starting_doc_id.data(),input_doc_words.data(),thread::hardware_concurrency());
+}
 
-      for (unsigned i = 0; i < size_1; i++)
-      {
-         term = (rand()%((1L << 24)-1));
-         freq = (rand()%254)+1;
-         input_doc_words[start_dimm1 + i] = (term << 8) | freq;
-      }
-   }
 
-   profile_weights.reserve( (1L << 24) );
+// Fills one membership filter and weight table with a new random profile of num_words
+// words. Returns false if the profile does not fit in the filter or the compact table.
+ bool createProfile(unsigned int* bloom_filter,profile_t* profile_weights,unsigned int num_words)
+
+{
    for (unsigned i=0; i<(1L << bloom_size); i++) {
       bloom_filter[i] = 0x0;
    }
-   std::cout << "Creating Profile Weights" << endl;
-   for (unsigned i=0; i<(1L << 24); i++) {
+   for (unsigned i=0; i<profile_entries; i++) {
       profile_weights[i] = 0;
    }
+   vector<unsigned int> profile_words;
+   vector<unsigned int> profile_word_weights;
 
-   for (unsigned i=0; i<16384; i++) {
+   for (unsigned i=0; i<num_words; i++) {
       unsigned entry = (rand()%(1<<24));	
 
+#if profile_compact
+      profile_words.push_back(entry);
+      profile_word_weights.push_back(10);
+#else
       profile_weights[entry] = 10;
-      unsigned hash_pu = MurmurHash2(&entry,3,1);
-      unsigned hash_lu = MurmurHash2(&entry,3,5);
-
-      unsigned hash1 = hash_pu&hash_bloom; 
-      unsigned hash2 = (hash_pu+hash_lu)&hash_bloom;
-     
-      bloom_filter[ hash1 >> 5 ] |= 1 << (hash1 & 0x1f);
-      bloom_filter[ hash2 >> 5 ] |= 1 << (hash2 & 0x1f);
+#endif
+      if (!filterInsert(bloom_filter,entry)) {
+         std::cout << "Profile does not fit in the " << membership_filter_name << " filter, increase bloom_size" << endl;
+         return false;
+      }
+   }
+
+#if profile_compact
+   if (!buildProfileTable(profile_weights,profile_words.data(),profile_word_weights.data(),profile_words.size())) {
+      std::cout << "Profile does not fit in the compact profile table, increase profile_bucket_bits" << endl;
+      return false;
+   }
+#endif
+   return true;
+}
+
+
+// bloom_profiles profiles, back to back
+ void setupProfile()
+
+{
+   bloom_filter.reserve( (1L << bloom_size)*bloom_profiles );
+   profile_weights.reserve( (unsigned long)profile_entries*bloom_profiles );
+   std::cout << "Creating Profile Weights" << endl;
+   for (unsigned p=0; p<bloom_profiles; p++)
+      if (!createProfile(bloom_filter.data() + p*(1L << bloom_size),profile_weights.data() + p*(unsigned long)profile_entries,16384))
+         exit(EXIT_FAILURE);
+}
+
+
+// Document arguments are either a number of documents to generate or a corpus file name
+bool is_doc_count(const string& arg)
+{
+   return !arg.empty() && arg.find_first_not_of("0123456789") == string::npos;
+}
+
+// Scores the documents on the CPU and compares with what run() returned:
+// fpga_profileScore, or fpga_topk_data when the kernel selects the top-K.
+// With PROFILES=<n> each of the n profiles is checked in turn.
+bool verify(unsigned int* h_doc_sizes,unsigned int* h_input_doc_words,unsigned int* h_bloom_filter,profile_t* h_profile_weights,const doc_score* fpga_topk_data)
+{
+#if bloom_topk
+   runOnCPU(h_doc_sizes,h_input_doc_words,h_bloom_filter,h_profile_weights,cpu_profileScore.data(),total_num_docs) ;
+
+   // The FPGA only returned the best documents: rank the CPU scores the same way
+   topk_heap cpu_best(bloom_topk);
+   for (unsigned doci = 0; doci < total_num_docs; doci++)
+      cpu_best.push(doci,cpu_profileScore[doci]);
+   vector<doc_score> cpu_topk(bloom_topk);
+   cpu_best.sorted(cpu_topk.data());
+   for (unsigned i = 0; i < bloom_topk; i++)
+   {
+      if (cpu_topk[i].doc != fpga_topk_data[i].doc || cpu_topk[i].score != fpga_topk_data[i].score) {
+         std::cout << "FAILED "<< endl  << " : rank " << i+1 << " CPU = doc[" << cpu_topk[i].doc << "] " << cpu_topk[i].score << ", FPGA = doc["<< fpga_topk_data[i].doc << "] " << fpga_topk_data[i].score <<  endl;
+         return false;
+      }
    }
+#else
+   for (unsigned p = 0; p < bloom_profiles; p++)
+   {
+      runOnCPU(h_doc_sizes,h_input_doc_words,h_bloom_filter + p*(1L << bloom_size),h_profile_weights + p*(unsigned long)profile_entries,cpu_profileScore.data(),total_num_docs) ;
 
+      for (unsigned doci = 0; doci < total_num_docs; doci++)
+      {
+         unsigned long fpga_score = fpga_profileScore[(unsigned long)doci*bloom_profiles+p];
+         if (cpu_profileScore[doci] != fpga_score) {
+            std::cout << "FAILED "<< endl  << " : profile " << p << " doc[" << doci << "]" << " score: CPU = " << cpu_profileScore[doci]<< ", FPGA = "<< fpga_score <<  endl;
+            return false;
+         }
+      }
+   }
+#endif
+   return true;
 }
 
+// Scores the documents rounds times on one device session. The profile is
+// uploaded once; between rounds about 1% of its terms are removed, added or
+// reweighted and only those changes are sent to the device.
+int runProfileUpdates(unsigned int* h_starting_doc_id,unsigned int* h_doc_sizes,unsigned int* h_input_doc_words,unsigned int rounds,unsigned int cpu_threads)
+{
+   profile_state profile;
+   vector<unsigned int> terms;
+   for (unsigned i=0; i<16384; i++) {
+      unsigned entry = (rand()%(1<<24));
+      if (profile.contains(entry)) continue;
+      if (!profile.add(entry,10)) {
+         std::cout << "Profile does not fit in the compact profile table, increase profile_bucket_bits" << endl;
+         return 1;
+      }
+      terms.push_back(entry);
+   }
+   // The initial profile is sent whole by loadProfile
+   vector<profile_range> bloom_changed,weights_changed;
+   profile.takeChanges(bloom_changed,weights_changed);
+
+   fpga_session* session = openSession();
+   loadProfile(session,profile.bloom_filter(),profile.profile_weights());
+   unsigned long full_bytes = (1L << bloom_size)*sizeof(unsigned int) + profile_entries*sizeof(profile_t);
+
+   for (unsigned int round=0; round<rounds; round++) {
+      std::cout << "Round " << round+1 << " with " << profile.size() << " profile terms" << endl;
+#if bloom_topk
+      vector<doc_score> fpga_topk(bloom_topk);
+      run(session,h_starting_doc_id,h_doc_sizes,h_input_doc_words,fpga_profileScore.data(),total_num_docs,size,cpu_threads,fpga_topk.data());
+      const doc_score* fpga_topk_data = fpga_topk.data();
+#else
+      run(session,h_starting_doc_id,h_doc_sizes,h_input_doc_words,fpga_profileScore.data(),total_num_docs,size,cpu_threads);
+      const doc_score* fpga_topk_data = NULL;
+#endif
+      if(!verify(h_doc_sizes,h_input_doc_words,profile.bloom_filter(),profile.profile_weights(),fpga_topk_data)) {
+         closeSession(session);
+         return 0;
+      }
+      std::cout << "Verification: PASS" << endl;
+      if (round+1 == rounds) break;
+
+      unsigned int changes = max(1u,profile.size()/100);
+      for (unsigned int c=0; c<changes; c++) {
+         unsigned int pick = rand()%terms.size();
+         if (c%3 == 0) {
+            profile.remove(terms[pick]);
+            terms[pick] = terms.back();
+            terms.pop_back();
+         } else if (c%3 == 1) {
+            unsigned entry = (rand()%(1<<24));
+            if (!profile.contains(entry) && profile.add(entry,(rand()%254)+1))
+               terms.push_back(entry);
+         } else {
+            profile.add(terms[pick],(rand()%254)+1);
+         }
+      }
+      profile.takeChanges(bloom_changed,weights_changed);
+      chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+      unsigned long bytes = updateProfile(session,bloom_changed,weights_changed);
+      chrono::duration<double> time_span_update = chrono::high_resolution_clock::now()-t1;
+      printf("Profile update: %u term changes sent as %lu bytes per compute unit in %.3f ms, a full upload is %lu bytes\n",
+             changes,bytes,time_span_update.count()*1e3,full_bytes);
+   }
+   closeSession(session);
+   return 0;
+}
+
+
+// Benchmark sweep (make bench). For each number of compute units, profile size,
+// number of documents (the first total_num_docs/16, /4 and all of them) and
+// chunk size (0: picked by run()), the documents are scored by run() and by
+// the CPU engine on all threads, and a line per engine is appended to
+// csv_path (see bench.h). The false positive rate is measured on the CPU for
+// both. bloom_size is fixed at build time (make BLOOM_SIZE=<n>).
+int runBench(unsigned int* h_starting_doc_id,unsigned int* h_doc_sizes,unsigned int* h_input_doc_words,const char* csv_path)
+{
+   const unsigned int bench_doc_fractions[] = {16,4,1};
+   const unsigned int bench_profile_words[] = {1024,4096,16384};
+   const unsigned int bench_chunk_words[] = {0,256*1024,1024*1024,4*1024*1024};
+   const char* engine = xcl::is_emulation() ? (xcl::is_hw_emulation() ? "hw_emu" : "sw_emu") : "hw";
+   unsigned int cpu_threads = max(1u,thread::hardware_concurrency());
+
+   FILE* csv = openBenchCsv(csv_path);
+   if (!csv) {
+      std::cout << "Cannot open " << csv_path << endl;
+      return 1;
+   }
+   bloom_filter.resize((1L << bloom_size)*bloom_profiles);
+   profile_weights.resize((unsigned long)profile_entries*bloom_profiles);
+   fpga_profileScore.resize((unsigned long)total_num_docs*bloom_profiles);
+   vector<unsigned long,aligned_allocator<unsigned long>> bench_profileScore((unsigned long)total_num_docs*bloom_profiles);
+
+   fpga_session* session = openSession();
+   unsigned int max_compute_units = sessionComputeUnits(session);
+   closeSession(session);
+
+   for (unsigned int units = 1; units <= max_compute_units; units++) {
+      session = openSession(units);
+      for (unsigned int profile_words : bench_profile_words) {
+         chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+         // Profiles too large for the filter are left out of the sweep
+         bool created = true;
+         for (unsigned p=0; p<bloom_profiles && created; p++)
+            created = createProfile(bloom_filter.data() + p*(1L << bloom_size),profile_weights.data() + p*(unsigned long)profile_entries,profile_words);
+         if (!created)
+            continue;
+         chrono::duration<double> time_span_setup = chrono::high_resolution_clock::now()-t1;
+
+         for (unsigned int f : bench_doc_fractions) {
+            unsigned int docs = max(1u,total_num_docs/f);
+            unsigned long words = 0;
+            for (unsigned int doci = 0; doci < docs; doci++)
+               words += h_doc_sizes[doci];
+
+            score_counts counts;
+            t1 = chrono::high_resolution_clock::now();
+            runOnCPU_parallel_multi(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),bloom_profiles,bench_profileScore.data(),docs,cpu_threads,false,&counts);
+            chrono::duration<double> time_span_cpu = chrono::high_resolution_clock::now()-t1;
+            double false_positive_rate = counts.total ? (double)counts.false_access/counts.total : 0;
+            if (units == 1) {
+               bench_row row = {"cpu",docs,profile_words,0,cpu_threads,words,
+                                time_span_setup.count(),0,time_span_cpu.count(),0,time_span_cpu.count(),false_positive_rate};
+               writeBenchRow(csv,row);
+            }
+
+            for (unsigned int chunk_words : bench_chunk_words) {
+               fixChunkWords(session,chunk_words);
+               loadProfile(session,bloom_filter.data(),profile_weights.data());
+               run_stats stats;
+#if bloom_topk
+               vector<doc_score> fpga_topk(bloom_topk);
+               run(session,h_starting_doc_id,h_doc_sizes,h_input_doc_words,fpga_profileScore.data(),docs,words,0,fpga_topk.data(),&stats);
+#else
+               run(session,h_starting_doc_id,h_doc_sizes,h_input_doc_words,fpga_profileScore.data(),docs,words,0,NULL,&stats);
+               for (unsigned long i = 0; i < (unsigned long)docs*bloom_profiles; i++)
+                  if (fpga_profileScore[i] != bench_profileScore[i]) {
+                     std::cout << "FAILED "<< endl  << " : doc[" << i/bloom_profiles << "]" << " score: CPU = " << bench_profileScore[i]<< ", FPGA = "<< fpga_profileScore[i] <<  endl;
+                     closeSession(session);
+                     fclose(csv);
+                     return 1;
+                  }
+#endif
+               bench_row row = {engine,docs,profile_words,chunk_words,units,words,
+                                stats.setup,stats.transfer,stats.compute,stats.readback,stats.total,false_positive_rate};
+               writeBenchRow(csv,row);
+            }
+         }
+      }
+      closeSession(session);
+   }
+   fclose(csv);
+   std::cout << "Benchmark results appended to " << csv_path << endl;
+   return 0;
+}
 
 
 int main(int argc, char** argv)
    
 {
 
-   if(argc==3){
+   if(argc==4 && string(argv[1])=="write_corpus"){
     total_num_docs=atoi(argv[2]);
-   } else {
+    setupDocs();
+    if(!writeCorpus(argv[3],doc_sizes.data(),input_doc_words.data(),total_num_docs))
+     return 1;
+    std::cout << "Wrote " << total_num_docs << " documents to " << argv[3] << endl;
+    return 0;
+   }
+
+   // profile_updates <docs|corpus> <rounds> [cpu_threads]: see runProfileUpdates
+   bool updates = (argc>=4 && string(argv[1])=="profile_updates");
+   // bench <docs|corpus> <csv>: see runBench
+   bool bench = (argc==4 && string(argv[1])=="bench");
+   if(updates ? (argc!=4 && argc!=5) : (argc!=3 && argc!=4)){
    cout << "Incorrect number of arguments"<<endl;
    return 0;
    } 
+   // Optional number of CPU threads that score documents alongside the FPGA
+   unsigned int cpu_threads = (argc==(updates ? 5 : 4) && !bench) ? atoi(argv[argc-1]) : 0;
     
    std::cout << "Initializing data"<< endl;
-  
-   setupData();
-   
-
-run(starting_doc_id.data(),doc_sizes.data(),input_doc_words.data(),bloom_filter.data(),profile_weights.data(),fpga_profileScore.data(),total_num_docs,size) ;
 
-   chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+   // A corpus file is mapped rather than read. run() wraps the mapped words in
+   // one CL_MEM_USE_HOST_PTR buffer per compute unit, and every chunk that
+   // starts on a page (all of them for padded documents) reaches the device
+   // as a sub-buffer of it, without a host copy.
+   corpus_map corpus;
+   unsigned int* h_starting_doc_id;
+   unsigned int* h_doc_sizes;
+   unsigned int* h_input_doc_words;
+   if(is_doc_count(argv[2])) {
+      total_num_docs=atoi(argv[2]);
+      setupDocs();
+      h_starting_doc_id = starting_doc_id.data();
+      h_doc_sizes = doc_sizes.data();
+      h_input_doc_words = input_doc_words.data();
+   } else {
+      if(!corpus.open(argv[2]))
+         return 1;
+      total_num_docs = corpus.num_docs;
+      size = corpus.num_words;
+      std::cout << "Mapped corpus " << argv[2] << " with " << total_num_docs << " documents, total size = " << size << endl;
+      fpga_profileScore.resize((unsigned long)total_num_docs*bloom_profiles);
+      cpu_profileScore.resize(total_num_docs);
+      h_starting_doc_id = corpus.starting_doc_id;
+      h_doc_sizes = corpus.doc_sizes;
+      h_input_doc_words = corpus.input_doc_words;
+   }
 
-   runOnCPU(doc_sizes.data(),input_doc_words.data(),bloom_filter.data(),profile_weights.data(),cpu_profileScore.data(),total_num_docs) ;
+   // The benchmark sweep creates its own profiles
+   if(bench)
+      return runBench(h_starting_doc_id,h_doc_sizes,h_input_doc_words,argv[3]);
 
-   chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
-   chrono::duration<double> time_span_cpu  = chrono::duration_cast<duration<double>>(t2-t1);
+   setupProfile();
 
-     
-   for (unsigned doci = 0; doci < total_num_docs; doci++)
-   {
-      if (cpu_profileScore[doci] != fpga_profileScore[doci]) {
-         std::cout << "FAILED "<< endl  << " : doc[" << doci << "]" << " score: CPU = " << cpu_profileScore[doci]<< ", FPGA = "<< fpga_profileScore[doci] <<  endl;
-         return 0;
-      }
+#if bloom_profiles > 1
+   if(updates) {
+      std::cout << "profile_updates scores a single profile, build with PROFILES=1" << endl;
+      return 1;
    }
+#endif
+   if(updates)
+      return runProfileUpdates(h_starting_doc_id,h_doc_sizes,h_input_doc_words,atoi(argv[3]),cpu_threads);
+
+#if bloom_topk
+   vector<doc_score> fpga_topk(bloom_topk);
+run(h_starting_doc_id,h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),fpga_profileScore.data(),total_num_docs,size,cpu_threads,fpga_topk.data()) ;
+   const doc_score* fpga_topk_data = fpga_topk.data();
+#else
+run(h_starting_doc_id,h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),fpga_profileScore.data(),total_num_docs,size,cpu_threads) ;
+   const doc_score* fpga_topk_data = NULL;
+#endif
+
+   if(!verify(h_doc_sizes,h_input_doc_words,bloom_filter.data(),profile_weights.data(),fpga_topk_data))
+      return 0;
     std::cout << "Verification: PASS" << endl;
  
    return 0;
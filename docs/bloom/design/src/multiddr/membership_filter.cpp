@@ -0,0 +1,104 @@
+#include<vector>
+#include"sizes.h"
+#include"MurmurHash2.h"
+#include"membership_filter.h"
+
+using namespace std;
+
+// Entries moved around to make room for a new cuckoo filter entry before giving up
+const unsigned int cuckoo_max_kicks = 500;
+
+static inline unsigned int slot_get(const unsigned int* filter,unsigned long bucket,unsigned int slot)
+{
+   return (filter[2*bucket + slot/2] >> (16*(slot&1))) & 0xffff;
+}
+
+static inline void slot_set(unsigned int* filter,unsigned long bucket,unsigned int slot,unsigned int fingerprint,vector<unsigned long>* changed_words)
+{
+   unsigned int shift = 16*(slot&1);
+   unsigned int& word = filter[2*bucket + slot/2];
+   word = (word & ~(0xffffu << shift)) | (fingerprint << shift);
+   if (changed_words)
+      changed_words->push_back(2*bucket + slot/2);
+}
+
+static inline bool cuckoo_put(unsigned int* filter,unsigned long bucket,unsigned int fingerprint,vector<unsigned long>* changed_words)
+{
+   for (unsigned int slot = 0; slot < cuckoo_bucket_slots; slot++) {
+      if (slot_get(filter,bucket,slot) == 0) {
+         slot_set(filter,bucket,slot,fingerprint,changed_words);
+         return true;
+      }
+   }
+   return false;
+}
+
+// A slot overwritten while making room, to undo the moves when there is none
+struct cuckoo_kick {
+   unsigned long bucket;
+   unsigned int slot;
+   unsigned int fingerprint;
+};
+
+bool filterInsert(unsigned int* filter,unsigned int word_id,vector<unsigned long>* changed_words)
+{
+   murmur2_hashes hashes = murmur2_24(word_id);
+#if membership_filter
+   unsigned int fingerprint = cuckoo_fingerprint(hashes.hash_pu,hashes.hash_lu);
+   unsigned long bucket = cuckoo_bucket1(hashes.hash_pu,hashes.hash_lu);
+   if (cuckoo_put(filter,bucket,fingerprint,changed_words))
+      return true;
+   bucket = cuckoo_alt_bucket(bucket,fingerprint);
+   if (cuckoo_put(filter,bucket,fingerprint,changed_words))
+      return true;
+
+   // Both buckets are full: evict an entry to its other bucket, and so on
+   vector<cuckoo_kick> kicks;
+   for (unsigned int kick = 0; kick < cuckoo_max_kicks; kick++) {
+      unsigned int slot = (fingerprint + kick) % cuckoo_bucket_slots;
+      unsigned int evicted = slot_get(filter,bucket,slot);
+      cuckoo_kick undo = {bucket,slot,evicted};
+      kicks.push_back(undo);
+      slot_set(filter,bucket,slot,fingerprint,changed_words);
+      fingerprint = evicted;
+      bucket = cuckoo_alt_bucket(bucket,fingerprint);
+      if (cuckoo_put(filter,bucket,fingerprint,changed_words))
+         return true;
+   }
+   while (!kicks.empty()) {
+      slot_set(filter,kicks.back().bucket,kicks.back().slot,kicks.back().fingerprint,changed_words);
+      kicks.pop_back();
+   }
+   return false;
+#else
+   unsigned int hash1 = hashes.hash_pu&hash_bloom;
+   unsigned int hash2 = bloom_hash2(hashes.hash_pu,hashes.hash_lu);
+   filter[ hash1 >> 5 ] |= 1 << (hash1 & 0x1f);
+   filter[ hash2 >> 5 ] |= 1 << (hash2 & 0x1f);
+   if (changed_words) {
+      changed_words->push_back(hash1 >> 5);
+      changed_words->push_back(hash2 >> 5);
+   }
+   return true;
+#endif
+}
+
+bool filterRemove(unsigned int* filter,unsigned int word_id,vector<unsigned long>* changed_words)
+{
+#if membership_filter
+   murmur2_hashes hashes = murmur2_24(word_id);
+   unsigned int fingerprint = cuckoo_fingerprint(hashes.hash_pu,hashes.hash_lu);
+   unsigned long bucket[2];
+   bucket[0] = cuckoo_bucket1(hashes.hash_pu,hashes.hash_lu);
+   bucket[1] = cuckoo_alt_bucket(bucket[0],fingerprint);
+   for (unsigned int b = 0; b < 2; b++) {
+      for (unsigned int slot = 0; slot < cuckoo_bucket_slots; slot++) {
+         if (slot_get(filter,bucket[b],slot) == fingerprint) {
+            slot_set(filter,bucket[b],slot,0,changed_words);
+            return true;
+         }
+      }
+   }
+#endif
+   return false;
+}
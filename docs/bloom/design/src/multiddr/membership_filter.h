@@ -0,0 +1,71 @@
+#pragma once
+#include"sizes.h"
+
+//-----------------------------------------------------------------------------
+// Profile membership filter.
+//
+// Every document word is first checked against a small filter of the profile
+// words, and only the words that pass it read their weight from the profile
+// table. Words that pass without being in the profile are the false positives
+// counted as false_access. The filter takes the (1 << bloom_size) 32-bit words
+// of the bloom_filter buffers whichever type is selected (see sizes.h), and
+// filter_contains is used the same way by the host and the HLS kernel.
+//
+// The cuckoo filter is (1 << (bloom_size - 1)) buckets of two words, each
+// bucket 4 slots of 16-bit fingerprints, 0 marking an empty slot. A word's
+// fingerprint lives in one of two buckets, the second derived from the first
+// and the fingerprint alone, so entries can be moved between their two buckets
+// to make room without knowing their word ID. A lookup reads both buckets, and
+// a word not in the profile passes with a chance of 8 in 65535 or less, against
+// about 0.4% for the bloom filter with a 16K-word profile and bloom_size 14.
+
+#define cuckoo_buckets (1L << (bloom_size - 1))
+#define cuckoo_bucket_slots 4
+
+#if membership_filter
+#define membership_filter_name "cuckoo"
+#elif bloom_blocked
+#define membership_filter_name "blocked_bloom"
+#else
+#define membership_filter_name "bloom"
+#endif
+
+inline unsigned int cuckoo_fingerprint(unsigned int hash_pu,unsigned int hash_lu)
+{
+	unsigned int fingerprint = hash_lu >> 16;
+	return fingerprint + (fingerprint == 0);
+}
+
+inline unsigned int cuckoo_bucket1(unsigned int hash_pu,unsigned int hash_lu)
+{
+	return hash_pu & (cuckoo_buckets - 1);
+}
+
+// The other bucket of a fingerprint in bucket, either way round
+inline unsigned int cuckoo_alt_bucket(unsigned int bucket,unsigned int fingerprint)
+{
+	return (bucket ^ ((fingerprint * 0x5bd1e995) >> 8)) & (cuckoo_buckets - 1);
+}
+
+inline bool cuckoo_bucket_has(const unsigned int* filter,unsigned int bucket,unsigned int fingerprint)
+{
+	unsigned int slots01 = filter[2*bucket];
+	unsigned int slots23 = filter[2*bucket+1];
+	return (slots01 & 0xffff) == fingerprint || (slots01 >> 16) == fingerprint ||
+	       (slots23 & 0xffff) == fingerprint || (slots23 >> 16) == fingerprint;
+}
+
+// True if the word hashed to (hash_pu, hash_lu) may be in the profile
+inline bool filter_contains(const unsigned int* filter,unsigned int hash_pu,unsigned int hash_lu)
+{
+#if membership_filter
+	unsigned int fingerprint = cuckoo_fingerprint(hash_pu,hash_lu);
+	unsigned int bucket1 = cuckoo_bucket1(hash_pu,hash_lu);
+	return cuckoo_bucket_has(filter,bucket1,fingerprint) ||
+	       cuckoo_bucket_has(filter,cuckoo_alt_bucket(bucket1,fingerprint),fingerprint);
+#else
+	unsigned int hash1 = hash_pu&hash_bloom;
+	unsigned int hash2 = bloom_hash2(hash_pu,hash_lu);
+	return (filter[ hash1 >> 5 ] & ( 1 << (hash1 & 0x1f))) && (filter[ hash2 >> 5 ] & ( 1 << (hash2 & 0x1f)));
+#endif
+}
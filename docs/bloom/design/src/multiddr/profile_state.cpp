@@ -0,0 +1,107 @@
+#include<algorithm>
+#include"MurmurHash2.h"
+#include"common.h"
+#include"profile_state.h"
+
+using namespace std;
+
+// A dense entry is a single word, a compact one a whole bucket
+#if profile_compact
+#define profile_change_block profile_bucket_slots
+#else
+#define profile_change_block 1
+#endif
+
+profile_state::profile_state()
+   : bloom(1L << bloom_size,0), bit_terms(membership_filter ? 0 : 32L << bloom_size,0), weights(profile_entries,0)
+{
+}
+
+bool profile_state::update_filter(unsigned int word_id,int delta)
+{
+#if membership_filter
+   // Cuckoo filter entries are added and removed as they are
+   if (delta > 0)
+      return filterInsert(bloom.data(),word_id,&changed_bloom_words);
+   return filterRemove(bloom.data(),word_id,&changed_bloom_words);
+#else
+   murmur2_hashes hashes = murmur2_24(word_id);
+   unsigned hash[2] = { hashes.hash_pu&hash_bloom, bloom_hash2(hashes.hash_pu,hashes.hash_lu) };
+   for (unsigned int i = 0; i < 2; i++) {
+      unsigned short& count = bit_terms[hash[i]];
+      count += delta;
+      bool set = count > 0;
+      if (set != ((bloom[ hash[i] >> 5 ] >> (hash[i] & 0x1f)) & 1)) {
+         bloom[ hash[i] >> 5 ] ^= 1 << (hash[i] & 0x1f);
+         changed_bloom_words.push_back(hash[i] >> 5);
+      }
+   }
+   return true;
+#endif
+}
+
+bool profile_state::add(unsigned int word_id,unsigned int weight)
+{
+   word_id &= 0xffffff;
+   if (weight == 0)
+      return remove(word_id);
+#if profile_compact
+   int bucket = profileTableInsert(weights.data(),word_id,weight);
+   if (bucket < 0)
+      return false;
+   changed_blocks.push_back((unsigned long)bucket * profile_change_block);
+#else
+   weights[word_id] = weight;
+   changed_blocks.push_back(word_id);
+#endif
+   if (terms.count(word_id) == 0 && !update_filter(word_id,1)) {
+      // No room left in the cuckoo filter: take the term back out
+#if profile_compact
+      profileTableRemove(weights.data(),word_id);
+#else
+      weights[word_id] = 0;
+#endif
+      return false;
+   }
+   terms[word_id] = weight;
+   return true;
+}
+
+bool profile_state::remove(unsigned int word_id)
+{
+   word_id &= 0xffffff;
+   if (terms.erase(word_id) == 0)
+      return false;
+#if profile_compact
+   int bucket = profileTableRemove(weights.data(),word_id);
+   changed_blocks.push_back((unsigned long)bucket * profile_change_block);
+#else
+   weights[word_id] = 0;
+   changed_blocks.push_back(word_id);
+#endif
+   update_filter(word_id,-1);
+   return true;
+}
+
+// Sorts the first entries of changed blocks of block entries into ranges, and clears them
+static void take_ranges(vector<unsigned long>& blocks,unsigned long block,vector<profile_range>& ranges)
+{
+   ranges.clear();
+   sort(blocks.begin(),blocks.end());
+   blocks.erase(unique(blocks.begin(),blocks.end()),blocks.end());
+   for (unsigned int i = 0; i < blocks.size(); i++) {
+      if (!ranges.empty() && ranges.back().first + ranges.back().count == blocks[i])
+         ranges.back().count += block;
+      else {
+         profile_range range = { blocks[i], block };
+         ranges.push_back(range);
+      }
+   }
+   blocks.clear();
+}
+
+void profile_state::takeChanges(vector<profile_range>& bloom_changed,vector<profile_range>& weights_changed)
+{
+   take_ranges(changed_bloom_words,1,bloom_changed);
+   take_ranges(changed_blocks,profile_change_block,weights_changed);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include<vector>
+#include<unordered_map>
+#include"xcl2.hpp"
+#include"sizes.h"
+#include"profile_table.h"
+
+//-----------------------------------------------------------------------------
+// Host copy of a profile that changes over time.
+//
+// setupProfile only ever sets bloom filter bits, so a term cannot be taken out
+// again. profile_state counts, for every bloom filter bit, the profile terms
+// that set it, so removing a term clears exactly the bits no other term needs.
+// A cuckoo filter (make FILTER=1) removes terms by itself and needs no counts.
+// profile_state also records which filter words and profile_weights entries
+// changed, so updateProfile can send just those to the device instead of the
+// whole profile (up to 128 MiB).
+
+// A run of bloom filter words or profile_weights entries
+struct profile_range {
+   unsigned long first;
+   unsigned long count;
+};
+
+class profile_state {
+public:
+   profile_state();
+
+   // Adds word_id with the given weight, or changes the weight of a term
+   // already in the profile. Returns false if the compact table has no room
+   // for it, the weight does not fit, or the cuckoo filter is full.
+   bool add(unsigned int word_id,unsigned int weight);
+   // Returns false if word_id is not in the profile
+   bool remove(unsigned int word_id);
+   bool contains(unsigned int word_id) const { return terms.count(word_id) > 0; }
+   unsigned int size() const { return terms.size(); }
+
+   // Page aligned, so they can back CL_MEM_USE_HOST_PTR buffers
+   unsigned int* bloom_filter() { return bloom.data(); }
+   profile_t* profile_weights() { return weights.data(); }
+
+   // Changes since the last call, as sorted ranges of bloom filter words and
+   // of profile_weights entries
+   void takeChanges(std::vector<profile_range>& bloom_changed,std::vector<profile_range>& weights_changed);
+
+private:
+   // Adds (delta 1) or removes (delta -1) a term from the membership filter
+   bool update_filter(unsigned int word_id,int delta);
+
+   std::vector<unsigned int,aligned_allocator<unsigned int>> bloom;
+   std::vector<unsigned short> bit_terms;
+   std::vector<profile_t,aligned_allocator<profile_t>> weights;
+   std::unordered_map<unsigned int,unsigned int> terms;
+   std::vector<unsigned long> changed_bloom_words;
+   // First entry of every changed block of profile_change_block entries
+   std::vector<unsigned long> changed_blocks;
+};
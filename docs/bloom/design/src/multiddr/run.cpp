@@ -1,142 +1,756 @@
 #include"kernels.h"
 #include"sizes.h"
+#include"common.h"
 #include<vector>
 #include<cstdio>
+#include<cstdlib>
+#include<cmath>
+#include<algorithm>
+#include<deque>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<atomic>
 #include<ctime>
 #include "xcl2.hpp"
+#include<CL/cl_ext_xilinx.h>
 using namespace std;
 using namespace std::chrono;
 
 string kernel_name = "runOnfpga";
 const char* kernel_name_charptr = kernel_name.c_str();
-unsigned int bloom_filter_size = 1L<<bloom_size;
-unsigned int profile_size = 1L<<24;
-unsigned size_per_iter_const=512*1024;
-unsigned size_per_iter;
+// With PROFILES=<n> (bloom_profiles) the n bloom filters and weight tables are
+// sent back to back and each document gets n consecutive scores
+unsigned int bloom_filter_size = (1L<<bloom_size)*bloom_profiles;
+unsigned long profile_size = (unsigned long)profile_entries*bloom_profiles;
 
-void run (uint* starting_doc_id,uint* doc_sizes,uint* input_doc_words,uint* bloom_filter,ulong* profile_weights,ulong* fpga_profileScore,unsigned int total_num_docs, unsigned int total_doc_size_1) {
+// Documents are sent to the compute units in chunks. Each compute unit has two
+// chunk slots that are reused for the whole run (ping-pong): while a chunk is
+// scored out of one, the next chunk is sent into the other. Transfers are
+// chained so exactly one chunk is on PCIe at a time.
+//
+// When the words are page aligned (the aligned generated buffers or a mapped
+// corpus), each compute unit wraps all of them once in a CL_MEM_USE_HOST_PTR
+// buffer, and a chunk whose words start on a page boundary (every chunk of
+// padded documents) is a sub-buffer of it, migrated so the runtime DMAs it
+// straight from the host pages. Only the other chunks are copied, into input
+// buffers owned by the slots, which are allocated when such chunks can occur.
+//
+// Chunks are not assigned to compute units up front: the next chunk of the
+// shared document queue goes to whichever compute unit gets a buffer back
+// first, so a compute unit that drew short documents simply takes more chunks.
+//
+// The first chunks alternate between two probe sizes; once they complete, the
+// transfer and kernel times are fitted as overhead + words*per_word and the
+// chunk size is picked to balance the per-chunk overhead against the time to
+// fill and drain the pipeline (see pick_chunk_words).
+//
+// When built with TOPK=<k> (bloom_topk), each kernel returns only the k best
+// documents of its chunk, read back into the chunk as soon as it completes,
+// and the host keeps the k best of all the chunks.
+const unsigned int chunk_words_probe = 512*1024;
+const unsigned int chunk_words_min = 64*1024;
+const unsigned int chunk_words_max = 4*1024*1024;
+// Alignment the runtime needs to use host memory in place
+const unsigned long host_page_size = 4096;
 
+struct dispatch_queue;
+
+struct chunk_info {
+   unsigned int comp;
+   unsigned int buffer;
+   unsigned int first_doc;
+   unsigned int num_docs;
+   unsigned int words;
+   cl::Buffer doc_sizes_sub_buffer;
+   // The chunk's words, when they are migrated from host memory
+   cl::Buffer words_sub_buffer;
+   cl::Buffer score_sub_buffer;
+   cl::Event write_done;
+   cl::Event kernel_done;
+   // Last command of the chunk: the kernel, or the read back of its top-K
+   cl::Event done;
+   vector<ulong> topk;
+   cl_ulong write_start, write_end;
+   cl_ulong kernel_start, kernel_end;
+   bool timed;
+   dispatch_queue* queue;
+};
+
+// Chunks whose kernel has completed, handed from the OpenCL callback thread to the dispatcher
+struct dispatch_queue {
+   mutex lock;
+   condition_variable changed;
+   deque<chunk_info*> done;
+};
+
+static void CL_CALLBACK chunk_done(cl_event,cl_int,void* user_data)
+{
+   chunk_info* c = (chunk_info*)user_data;
+   lock_guard<mutex> guard(c->queue->lock);
+   c->queue->done.push_back(c);
+   c->queue->changed.notify_one();
+}
+
+// Documents not handed out yet. The FPGA dispatcher takes chunks from the front
+// and, in hybrid mode, the CPU side takes ranges from the back, so the split
+// between the two settles wherever they meet.
+class doc_pool {
+public:
+   doc_pool(const uint* doc_sizes,unsigned int num_docs,unsigned long num_words) : doc_sizes(doc_sizes), front(0), back(num_docs), words_left(num_words) {}
+
+   // Takes whole documents worth at most target words (at least one document)
+   bool take_front(unsigned long target,unsigned int& first_doc,unsigned int& num_docs,unsigned long& words) {
+      lock_guard<mutex> guard(lock);
+      words = 0;
+      first_doc = front;
+      while(front<back && (words==0 || words+doc_sizes[front]<=target))
+         words += doc_sizes[front++];
+      num_docs = front - first_doc;
+      words_left -= words;
+      return num_docs>0;
+   }
+   bool take_back(unsigned long target,unsigned int& first_doc,unsigned int& num_docs,unsigned long& words) {
+      lock_guard<mutex> guard(lock);
+      words = 0;
+      unsigned int end = back;
+      while(back>front && (words==0 || words+doc_sizes[back-1]<=target))
+         words += doc_sizes[--back];
+      first_doc = back;
+      num_docs = end - back;
+      words_left -= words;
+      return num_docs>0;
+   }
+   unsigned long remaining() {
+      lock_guard<mutex> guard(lock);
+      return words_left;
+   }
+private:
+   mutex lock;
+   const uint* doc_sizes;
+   unsigned int front, back;
+   unsigned long words_left;
+};
+
+// CPU half of hybrid scoring. Ranges are sized from the throughput seen so far on
+// both sides: each range is a quarter of the words the CPU is expected to score
+// before the two sides meet, so the ranges shrink toward the end and both sides
+// finish close together.
+const unsigned long cpu_range_words_probe = 256*1024;
+const unsigned long cpu_range_words_min = 64*1024;
+
+struct cpu_side_stats {
+   unsigned int docs;
+   unsigned int ranges;
+   unsigned long words;
+   double busy;
+};
+
+static void score_on_cpu(doc_pool* pool,unsigned int cpu_threads,const atomic<unsigned long>* fpga_words,chrono::high_resolution_clock::time_point start,
+                         uint* starting_doc_id,uint* doc_sizes,uint* input_doc_words,uint* bloom_filter,profile_t* profile_weights,ulong* cpu_scores,topk_heap* cpu_best,cpu_side_stats* stats)
+{
+   cpu_side_stats local = {0,0,0,0};
+   unsigned long target = cpu_range_words_probe*cpu_threads;
+   unsigned int first_doc,num_docs;
+   unsigned long words;
+   while(pool->take_back(target,first_doc,num_docs,words)) {
+      chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
+#if bloom_topk
+      vector<doc_score> best(bloom_topk);
+      runOnCPU_parallel_topk(doc_sizes+first_doc,input_doc_words+starting_doc_id[first_doc],bloom_filter,profile_weights,bloom_topk,best.data(),num_docs,cpu_threads,false);
+      for(unsigned int i=0;i<bloom_topk && best[i].doc!=topk_no_doc;i++)
+         cpu_best->push(first_doc+best[i].doc,best[i].score);
+#else
+      runOnCPU_parallel_multi(doc_sizes+first_doc,input_doc_words+starting_doc_id[first_doc],bloom_filter,profile_weights,bloom_profiles,cpu_scores+(unsigned long)first_doc*bloom_profiles,num_docs,cpu_threads,false);
+#endif
+      chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+      local.busy += chrono::duration<double>(t2-t1).count();
+      local.docs += num_docs;
+      local.words += words;
+      local.ranges++;
+
+      double cpu_rate = local.words/local.busy;
+      double fpga_rate = fpga_words->load()/chrono::duration<double>(t2-start).count();
+      if(fpga_rate>0) {
+         double share = cpu_rate/(cpu_rate+fpga_rate);
+         target = max(cpu_range_words_min,(unsigned long)(pool->remaining()*share/4));
+      }
+   }
+   *stats = local;
+}
+
+// Time of one pipeline stage (transfer or kernel) for a chunk of n words: overhead + n*per_word, in ns
+struct stage_model {
+   double overhead;
+   double per_word;
+};
+
+static void read_timing(chunk_info& c)
+{
+   c.write_start = c.write_done.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+   c.write_end = c.write_done.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+   c.kernel_start = c.kernel_done.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+   c.kernel_end = c.kernel_done.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+   c.timed = true;
+}
+
+// Least squares fit of the stage time over the chunks timed so far
+static stage_model fit_stage(const deque<chunk_info>& chunks,bool kernel)
+{
+   double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+   for (unsigned int i = 0; i < chunks.size(); i++) {
+      if (!chunks[i].timed) continue;
+      n++;
+      double x = chunks[i].words;
+      double y = kernel ? (double)(chunks[i].kernel_end - chunks[i].kernel_start) : (double)(chunks[i].write_end - chunks[i].write_start);
+      sx += x; sy += y; sxx += x*x; sxy += x*y;
+   }
+   stage_model m = {0, sx > 0 ? sy/sx : 0};
+   double denom = n*sxx - sx*sx;
+   if (denom > 0) {
+      double per_word = (n*sxy - sx*sy)/denom;
+      double overhead = (sy - per_word*sx)/n;
+      if (per_word > 0 && overhead >= 0) {
+         m.overhead = overhead;
+         m.per_word = per_word;
+      }
+   }
+   return m;
+}
+
+// With W words left, chunks of s words take about (W/s)*(L + s*a) in the slower
+// stage plus s*(a_write + a_kernel) to fill and drain the pipeline, which is
+// smallest for s = sqrt(W*L/(a_write + a_kernel)).
+static unsigned int pick_chunk_words(stage_model write,stage_model kernel,unsigned int num_compute_units,unsigned long remaining_words,unsigned int current_words)
+{
+   double write_time = write.overhead + current_words*write.per_word;
+   double kernel_time = (kernel.overhead + current_words*kernel.per_word)/num_compute_units;
+   double overhead = write_time >= kernel_time ? write.overhead : kernel.overhead/num_compute_units;
+   double fill = write.per_word + kernel.per_word;
+   double words = fill > 0 ? sqrt(remaining_words*overhead/fill) : chunk_words_max;
+   if (words < chunk_words_min) return chunk_words_min;
+   if (words > chunk_words_max) return chunk_words_max;
+   return (unsigned int)words;
+}
+
+// Time during which a transfer and at least one kernel were both running
+static double overlap_ms(const deque<chunk_info>& chunks)
+{
+   vector<pair<cl_ulong,cl_ulong>> kernels;
+   for (unsigned int i = 0; i < chunks.size(); i++)
+      kernels.push_back(make_pair(chunks[i].kernel_start,chunks[i].kernel_end));
+   sort(kernels.begin(),kernels.end());
+   vector<pair<cl_ulong,cl_ulong>> busy;
+   for (unsigned int i = 0; i < kernels.size(); i++) {
+      if (!busy.empty() && kernels[i].first <= busy.back().second)
+         busy.back().second = max(busy.back().second,kernels[i].second);
+      else
+         busy.push_back(kernels[i]);
+   }
+   double overlap = 0;
+   for (unsigned int i = 0; i < chunks.size(); i++)
+      for (unsigned int j = 0; j < busy.size(); j++) {
+         cl_ulong start = max(chunks[i].write_start,busy[j].first);
+         cl_ulong end = min(chunks[i].write_end,busy[j].second);
+         if (end > start) overlap += end - start;
+      }
+   return overlap*1e-6;
+}
+
+// Device state kept between run() calls. The profile buffers (one copy per
+// compute unit, in its own bank) are uploaded once by loadProfile and then
+// patched in place by updateProfile, so scoring more documents against the
+// same or a slightly changed profile does not send the profile again.
+struct fpga_session {
+   cl::Context context;
+   cl::CommandQueue q;
+   cl::Program program;
+   cl_uint num_compute_units;
+   vector<cl::Kernel> kernel;
+   vector<cl::Buffer> buffer_bloom_filter;
+   vector<cl::Buffer> buffer_profile_weights;
+   // Ping-pong input buffers, two per compute unit: buffer b belongs to compute unit b/2
+   vector<cl::Buffer> buffer_input_doc_words;
+   unsigned int buffer_words;
+   // Chunk size set by fixChunkWords, 0 to pick it with pick_chunk_words
+   unsigned int chunk_words;
+#if bloom_topk
+   // One top-K result buffer per input buffer, bound to the compute unit like the input
+   vector<cl::Buffer> buffer_topk;
+#endif
+   uint* bloom_filter;
+   profile_t* profile_weights;
+   // Bumped by every profile upload; a compute unit reloads its on-chip copies
+   // (load_weights) on its first chunk after its version falls behind
+   unsigned int profile_version;
+   vector<unsigned int> cu_profile_version;
+   // Profile uploads the next kernels have to wait for
+   vector<cl::Event> profile_done;
+};
+
+// Every write costs a fixed overhead worth tens of KiB of transfer, so changed
+// ranges closer than profile_write_gap bytes are sent as one write, and a
+// buffer needing more than profile_max_writes writes is sent whole.
+const unsigned long profile_write_gap = 64*1024;
+const unsigned int profile_max_writes = 256;
+
+// max_compute_units > 0 uses only that many of the compute units of the xclbin
+fpga_session* openSession(unsigned int max_compute_units)
+{
+fpga_session* session = new fpga_session();
 vector<cl::Device> devices = xcl::get_xil_devices();
 cl::Device device = devices[0];
-unsigned int num_compute_units=2;
 
-cl::Context context(device);
-cl::CommandQueue q(context,device,CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+session->context = cl::Context(device);
+session->q = cl::CommandQueue(session->context,device,CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
 
 string run_type = xcl::is_emulation()?(xcl::is_hw_emulation()?"hw_emu":"sw_emu"):"hw";
 string binary_file = kernel_name + "_" + run_type + ".xclbin";
 cl::Program::Binaries bins = xcl::import_binary_file(binary_file);
-cl::Program program(context, devices, bins);
-vector<cl::Kernel> kernel(num_compute_units);
+session->program = cl::Program(session->context, devices, bins);
+
+// The number of compute units is whatever the xclbin was linked with (nk= in connectivity.cfg)
+cl_uint num_compute_units=0;
+cl::Kernel kernel_all(session->program,kernel_name_charptr,NULL);
+kernel_all.getInfo(CL_KERNEL_COMPUTE_UNIT_COUNT,&num_compute_units);
+if(num_compute_units==0)
+ num_compute_units=1;
+if(max_compute_units>0 && num_compute_units>max_compute_units)
+ num_compute_units=max_compute_units;
+cout << "Using " << num_compute_units << " compute units" << endl;
+session->num_compute_units = num_compute_units;
+session->kernel.resize(num_compute_units);
 
 for(unsigned int i=0;i<num_compute_units;i++) {
 string s = kernel_name+":{"+kernel_name + "_"+ to_string(i+1)+"}";
 
-kernel[i] = cl::Kernel(program,s.c_str(),NULL);
+session->kernel[i] = cl::Kernel(session->program,s.c_str(),NULL);
 }
 
+session->buffer_words = 0;
+session->chunk_words = 0;
+session->bloom_filter = NULL;
+session->profile_weights = NULL;
+session->profile_version = 0;
+session->cu_profile_version.assign(num_compute_units,0);
+return session;
+}
 
-cl::Buffer buffer_input_doc_words[num_compute_units];
-cl::Buffer buffer_doc_sizes(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY,total_num_docs*sizeof(uint),doc_sizes);
-cl::Buffer buffer_bloom_filter[num_compute_units];
-cl::Buffer buffer_profile_weights[num_compute_units];
-cl::Buffer buffer_fpga_profileScore(context, CL_MEM_USE_HOST_PTR | CL_MEM_WRITE_ONLY, total_num_docs*sizeof(ulong),fpga_profileScore);
-cl::Buffer sub_buffer[num_compute_units];
-cl::Buffer doc_sizes_sub_buffer[num_compute_units];
+void closeSession(fpga_session* session)
+{
+session->q.finish();
+delete session;
+}
 
-for(unsigned int i=0;i<num_compute_units;i++) {
-buffer_bloom_filter[i] =  cl::Buffer(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, bloom_filter_size*sizeof(uint),bloom_filter);
-buffer_profile_weights[i] = cl::Buffer(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, profile_size*sizeof(ulong),profile_weights);
-kernel[i].setArg(2,buffer_bloom_filter[i]);
-kernel[i].setArg(3,buffer_profile_weights[i]);
+unsigned int sessionComputeUnits(fpga_session* session)
+{
+return session->num_compute_units;
+}
+
+// Sends the documents in chunks of about chunk_words words instead of sizing
+// the chunks from the measured transfer and kernel times; 0 goes back to that
+void fixChunkWords(fpga_session* session,unsigned int chunk_words)
+{
+session->chunk_words = chunk_words;
+}
+
+// Allocates the buffers of the ping-pong slots. The input buffers are only
+// allocated once buffer_words is not 0, and grown when a document does not fit.
+static void reserveInputBuffers(fpga_session* session,unsigned int buffer_words)
+{
+// Setting the slot buffers as arguments places them in the bank of this compute unit
+#if bloom_topk
+if(session->buffer_topk.empty()) {
+session->buffer_topk.resize(2*session->num_compute_units);
+for(unsigned int i=0;i<session->num_compute_units;i++) {
+for(unsigned int b=0;b<2;b++) {
+ session->buffer_topk[2*i+b] = cl::Buffer(session->context, CL_MEM_WRITE_ONLY, 2*bloom_topk*sizeof(ulong));
+ session->kernel[i].setArg(4,session->buffer_topk[2*i+b]);
+}
+}
+}
+#endif
+if(buffer_words<=session->buffer_words)
+ return;
+session->buffer_words = buffer_words;
+session->buffer_input_doc_words.resize(2*session->num_compute_units);
+for(unsigned int i=0;i<session->num_compute_units;i++) {
+for(unsigned int b=0;b<2;b++) {
+ session->buffer_input_doc_words[2*i+b] = cl::Buffer(session->context, CL_MEM_READ_ONLY, buffer_words*sizeof(uint));
+ session->kernel[i].setArg(1,session->buffer_input_doc_words[2*i+b]);
+}
+}
+}
+
+// bloom_filter and profile_weights back the device buffers from now on: they
+// must stay allocated, and be changed only through updateProfile. The upload is
+// asynchronous, the next run() or updateProfile() waits for it.
+void loadProfile(fpga_session* session,uint* bloom_filter,profile_t* profile_weights)
+{
+session->bloom_filter = bloom_filter;
+session->profile_weights = profile_weights;
+session->buffer_bloom_filter.resize(session->num_compute_units);
+session->buffer_profile_weights.resize(session->num_compute_units);
+for(unsigned int i=0;i<session->num_compute_units;i++) {
+session->buffer_bloom_filter[i] =  cl::Buffer(session->context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, bloom_filter_size*sizeof(uint),bloom_filter);
+session->buffer_profile_weights[i] = cl::Buffer(session->context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, profile_size*sizeof(profile_t),profile_weights);
+session->kernel[i].setArg(2,session->buffer_bloom_filter[i]);
+session->kernel[i].setArg(3,session->buffer_profile_weights[i]);
 }
 
+for(unsigned int i=0;i<session->num_compute_units;i++) {
+ cl::Event ep,eb;
+ session->q.enqueueMigrateMemObjects({session->buffer_profile_weights[i]},0,NULL,&ep);
+ session->q.enqueueMigrateMemObjects({session->buffer_bloom_filter[i]},0,NULL,&eb);
+ session->profile_done.push_back(ep);
+ session->profile_done.push_back(eb);
+}
+session->profile_version++;
+}
+
+static vector<profile_range> coalesce(const vector<profile_range>& changed,unsigned long gap_entries)
+{
+vector<profile_range> writes;
+for(unsigned int r=0;r<changed.size();r++) {
+ if(!writes.empty() && changed[r].first <= writes.back().first + writes.back().count + gap_entries)
+  writes.back().count = changed[r].first + changed[r].count - writes.back().first;
+ else
+  writes.push_back(changed[r]);
+}
+return writes;
+}
+
+// Patches one device buffer from its host copy; returns the bytes sent
+static unsigned long patch_buffer(fpga_session* session,cl::Buffer& buffer,const void* host,unsigned long entries,size_t entry_size,const vector<profile_range>& changed)
+{
+if(changed.empty())
+ return 0;
+vector<profile_range> writes = coalesce(changed,profile_write_gap/entry_size);
+if(writes.size()>profile_max_writes) {
+ writes.resize(1);
+ writes[0].first = 0;
+ writes[0].count = entries;
+}
+unsigned long bytes = 0;
+for(unsigned int r=0;r<writes.size();r++) {
+ cl::Event e;
+ session->q.enqueueWriteBuffer(buffer,CL_FALSE,writes[r].first*entry_size,writes[r].count*entry_size,(const char*)host+writes[r].first*entry_size,NULL,&e);
+ session->profile_done.push_back(e);
+ bytes += writes[r].count*entry_size;
+}
+return bytes;
+}
+
+// Sends the bloom filter words and profile_weights entries changed on the host
+// since the last upload, to every compute unit. Returns the bytes sent to each
+// compute unit, once they are on the device, so the host copy can be changed again.
+unsigned long updateProfile(fpga_session* session,const vector<profile_range>& bloom_changed,const vector<profile_range>& weights_changed)
+{
+unsigned long bytes = 0;
+for(unsigned int i=0;i<session->num_compute_units;i++) {
+ bytes = patch_buffer(session,session->buffer_bloom_filter[i],session->bloom_filter,bloom_filter_size,sizeof(uint),bloom_changed);
+ bytes += patch_buffer(session,session->buffer_profile_weights[i],session->profile_weights,profile_size,sizeof(profile_t),weights_changed);
+}
+if(!session->profile_done.empty())
+ cl::WaitForEvents(session->profile_done);
+if(bytes>0)
+ session->profile_version++;
+return bytes;
+}
+
+// Scores with a profile uploaded for this call only
+void run (uint* starting_doc_id,uint* doc_sizes,uint* input_doc_words,uint* bloom_filter,profile_t* profile_weights,ulong* fpga_profileScore,unsigned int total_num_docs, unsigned int total_doc_size_1,unsigned int cpu_threads,doc_score* topk) {
+fpga_session* session = openSession();
+loadProfile(session,bloom_filter,profile_weights);
+run(session,starting_doc_id,doc_sizes,input_doc_words,fpga_profileScore,total_num_docs,total_doc_size_1,cpu_threads,topk);
+closeSession(session);
+}
+
+void run (fpga_session* session,uint* starting_doc_id,uint* doc_sizes,uint* input_doc_words,ulong* fpga_profileScore,unsigned int total_num_docs, unsigned int total_doc_size_1,unsigned int cpu_threads,doc_score* topk,run_stats* stats) {
+
+chrono::high_resolution_clock::time_point t0 = chrono::high_resolution_clock::now();
+
+cl::Context& context = session->context;
+cl::CommandQueue& q = session->q;
+cl_uint num_compute_units = session->num_compute_units;
+vector<cl::Kernel>& kernel = session->kernel;
+uint* bloom_filter = session->bloom_filter;
+profile_t* profile_weights = session->profile_weights;
+
+// Chunks start on document boundaries, so they can all be migrated in place
+// when the words and every document start are page aligned
+const unsigned long page_words = host_page_size/sizeof(uint);
+bool words_in_place = total_doc_size_1>0 && ((unsigned long)input_doc_words & (host_page_size-1))==0;
+bool copy_chunks = !words_in_place;
+// A single document always fits in one chunk
+unsigned int buffer_words = max(chunk_words_max,session->chunk_words);
+for(unsigned int doc=0;doc<total_num_docs;doc++) {
+ buffer_words = max(buffer_words,doc_sizes[doc]);
+ copy_chunks = copy_chunks || starting_doc_id[doc]%page_words;
+#if bloom_wide
+ // The wide kernel reads whole 512-bit beats, each of a single document
+ if(doc_sizes[doc]%bloom_lanes) {
+  cout << "Document " << doc << " has " << doc_sizes[doc] << " words, the wide kernel needs a multiple of " << bloom_lanes << endl;
+  exit(EXIT_FAILURE);
+ }
+#endif
+}
+reserveInputBuffers(session,copy_chunks ? buffer_words : 0);
+vector<cl::Buffer>& buffer_input_doc_words = session->buffer_input_doc_words;
+#if bloom_topk
+vector<cl::Buffer>& buffer_topk = session->buffer_topk;
+#endif
+
+cl::Buffer buffer_doc_sizes(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY,total_num_docs*sizeof(uint),doc_sizes);
+// All the words, once per compute unit; setting them as an argument places them in its bank
+vector<cl::Buffer> buffer_all_words(words_in_place ? num_compute_units : 0);
+for(unsigned int i=0;i<buffer_all_words.size();i++) {
+ buffer_all_words[i] = cl::Buffer(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY,(unsigned long)total_doc_size_1*sizeof(uint),input_doc_words);
+ kernel[i].setArg(1,buffer_all_words[i]);
+}
+#if !bloom_topk
+cl::Buffer buffer_fpga_profileScore(context, CL_MEM_USE_HOST_PTR | CL_MEM_WRITE_ONLY, (unsigned long)total_num_docs*bloom_profiles*sizeof(ulong),fpga_profileScore);
+#endif
+
 chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
 
-for(unsigned int i=0;i<num_compute_units;i++) {
- q.enqueueMigrateMemObjects({buffer_profile_weights[i]},0);
- q.enqueueMigrateMemObjects({buffer_bloom_filter[i]},0);
-}
-
-
-unsigned int doc_offset[num_compute_units]={0};
- vector<cl::Event> eventlist;
- unsigned int num_docs[num_compute_units];
- unsigned int total_size[num_compute_units]; 
- unsigned int num_iter=0;
-unsigned int doc_offset_per_iter[num_compute_units]; 
-
-for(unsigned int comp=0;comp<num_compute_units;comp++) {
-  
-  doc_offset_per_iter[comp]=doc_offset[comp];
-  num_docs[comp] = (total_num_docs/num_compute_units) + (((total_num_docs%num_compute_units)>comp)?1:0);
-  
-  if(comp<num_compute_units-1) {
-   total_size[comp] = starting_doc_id[(num_docs[comp]+doc_offset[comp])]-starting_doc_id[doc_offset[comp]];
-  doc_offset[comp+1]=(doc_offset[comp])+num_docs[comp];
-  }
-  else
-   total_size[comp] =  (total_doc_size_1-starting_doc_id[doc_offset[comp]]);
-  
-  
-  size_per_iter=min(total_size[comp],size_per_iter_const);
-  
-  num_iter = max(num_iter,((total_size[comp]/size_per_iter) + (((total_size[comp]%size_per_iter)>0)?1:0)));
-  }
-
-
-for(unsigned int i=0;i<num_iter;i++) {
-
-for(unsigned int comp=0;comp<num_compute_units;comp++) {
-
-cl::Event eve,ef,eve_size;
-vector<cl::Event> waitlist;
- unsigned int docs_per_iter = (num_docs[comp]/num_iter) + (((num_docs[comp]%num_iter)>i)?1:0);
-unsigned int size;
-bool flag=false;
-
-if(i<num_iter-1)
-size= (starting_doc_id[docs_per_iter+doc_offset_per_iter[comp]]) - (starting_doc_id[doc_offset_per_iter[comp]]);
-else
-size= starting_doc_id[doc_offset[comp]] + total_size[comp] - (starting_doc_id[doc_offset_per_iter[comp]]);
-
-buffer_input_doc_words[comp]=cl::Buffer(context,CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY,size*sizeof(uint),input_doc_words+starting_doc_id[doc_offset_per_iter[comp]]);
-cl_buffer_region buffer_info={doc_offset_per_iter[comp]*sizeof(ulong), docs_per_iter*sizeof(ulong)};
-cl_buffer_region buffer_info_sizes={doc_offset_per_iter[comp]*sizeof(uint), docs_per_iter*sizeof(uint)};
-
-sub_buffer[comp] =  buffer_fpga_profileScore.createSubBuffer(CL_MEM_WRITE_ONLY,CL_BUFFER_CREATE_TYPE_REGION,&buffer_info);
-doc_sizes_sub_buffer[comp] =  buffer_doc_sizes.createSubBuffer(CL_MEM_READ_ONLY,CL_BUFFER_CREATE_TYPE_REGION,&buffer_info_sizes);
-
-//kernel[comp].setArg(0,doc_sizes_sub_buffer[comp]);
-if(i==0 && comp==0){ 
-kernel[comp].setArg(0,buffer_doc_sizes);
-kernel[comp].setArg(4,buffer_fpga_profileScore);
-q.enqueueMigrateMemObjects({buffer_doc_sizes},0);
-}
-else {
-kernel[comp].setArg(0,doc_sizes_sub_buffer[comp]);
-kernel[comp].setArg(4,sub_buffer[comp]);
-}
-kernel[comp].setArg(1,buffer_input_doc_words[comp]);
-kernel[comp].setArg(5,docs_per_iter);
-//kernel[comp].setArg(6,doc_offset_per_iter[comp]);
-kernel[comp].setArg(6,size);
-if(i==0) 
- flag=true;
-kernel[comp].setArg(7,flag);
-
-q.enqueueMigrateMemObjects({buffer_input_doc_words[comp]},0,NULL,&eve);
-waitlist.push_back(eve);
-q.enqueueTask(kernel[comp],&waitlist,&ef);
-eventlist.push_back(ef);
-doc_offset_per_iter[comp]+=docs_per_iter;
-}
-}
-q.enqueueMigrateMemObjects({buffer_fpga_profileScore},CL_MIGRATE_MEM_OBJECT_HOST,&eventlist,NULL);
+// The first chunk of each compute unit waits for the profile uploads still in flight
+vector<cl::Event> init_done(session->profile_done);
+cl::Event es;
+q.enqueueMigrateMemObjects({buffer_doc_sizes},0,NULL,&es);
+init_done.push_back(es);
+
+// Free input buffers, in the order they were handed back; buffer b belongs to compute unit b/2
+deque<unsigned int> free_buffers;
+for(unsigned int b=0;b<2;b++)
+ for(unsigned int i=0;i<num_compute_units;i++)
+  free_buffers.push_back(2*i+b);
+vector<chunk_info*> last_chunk_cu(num_compute_units,(chunk_info*)NULL);
+vector<chunk_info*> last_chunk_buffer(2*num_compute_units,(chunk_info*)NULL);
+
+dispatch_queue queue;
+deque<chunk_info> chunks;
+unsigned int num_timed = 0;
+unsigned int mapped_chunks = 0;
+doc_pool pool(doc_sizes,total_num_docs,total_doc_size_1);
+atomic<unsigned long> fpga_words(0);
+stage_model write_model = {0,0}, kernel_model = {0,0};
+topk_heap fpga_best(bloom_topk);
+
+// Collects the chunks completed so far, waiting for one if wait is set, and refits the stage models
+auto collect = [&](bool wait) {
+   deque<chunk_info*> done;
+   {
+      if(wait)
+         q.flush();
+      unique_lock<mutex> guard(queue.lock);
+      if(wait)
+         queue.changed.wait(guard,[&queue]{ return !queue.done.empty(); });
+      done.swap(queue.done);
+   }
+   for(unsigned int i=0;i<done.size();i++) {
+      read_timing(*done[i]);
+      free_buffers.push_back(done[i]->buffer);
+#if bloom_topk
+      for(unsigned int j=0;j<bloom_topk && done[i]->topk[2*j+1]!=docTag;j++)
+         fpga_best.push(done[i]->first_doc+done[i]->topk[2*j+1],done[i]->topk[2*j]);
+#endif
+   }
+   for(unsigned int i=0;i<done.size();i++)
+      fpga_words += done[i]->words;
+   num_timed += done.size();
+   if(num_timed>=2 && !done.empty()) {
+      write_model = fit_stage(chunks,false);
+      kernel_model = fit_stage(chunks,true);
+   }
+};
+
+// In hybrid mode the CPU scores into its own array (or top-K), merged once the FPGA is done
+vector<ulong> cpu_scores;
+topk_heap cpu_best(bloom_topk);
+cpu_side_stats cpu_stats = {0,0,0,0};
+thread cpu_side;
+if(cpu_threads>0) {
+#if !bloom_topk
+   cpu_scores.resize((unsigned long)total_num_docs*bloom_profiles);
+#endif
+   cpu_side = thread(score_on_cpu,&pool,cpu_threads,&fpga_words,t1,starting_doc_id,doc_sizes,input_doc_words,bloom_filter,profile_weights,cpu_scores.data(),&cpu_best,&cpu_stats);
+}
+
+while(true) {
+   collect(free_buffers.empty());
+
+   unsigned int k = chunks.size();
+   unsigned int target;
+   if(session->chunk_words>0)
+      target = session->chunk_words;
+   else if(num_timed<2)
+      target = (k%2) ? chunk_words_probe/2 : chunk_words_probe;
+   else
+      target = pick_chunk_words(write_model,kernel_model,num_compute_units,pool.remaining(),chunks.back().words);
+   unsigned int first_doc,num_docs;
+   unsigned long words;
+   if(!pool.take_front(target,first_doc,num_docs,words))
+      break;
+
+   unsigned int buffer = free_buffers.front();
+   unsigned int comp = buffer/2;
+   free_buffers.pop_front();
+
+   chunks.push_back(chunk_info());
+   chunk_info& c = chunks.back();
+   c.comp = comp;
+   c.buffer = buffer;
+   c.first_doc = first_doc;
+   c.num_docs = num_docs;
+   c.words = words;
+   c.timed = false;
+   c.queue = &queue;
+
+   cl_buffer_region buffer_info_sizes={c.first_doc*sizeof(uint), c.num_docs*sizeof(uint)};
+#if !bloom_topk
+   cl_buffer_region buffer_info={(unsigned long)c.first_doc*bloom_profiles*sizeof(ulong), (unsigned long)c.num_docs*bloom_profiles*sizeof(ulong)};
+   c.score_sub_buffer = buffer_fpga_profileScore.createSubBuffer(CL_MEM_WRITE_ONLY,CL_BUFFER_CREATE_TYPE_REGION,&buffer_info);
+#endif
+   c.doc_sizes_sub_buffer = buffer_doc_sizes.createSubBuffer(CL_MEM_READ_ONLY,CL_BUFFER_CREATE_TYPE_REGION,&buffer_info_sizes);
+
+   vector<cl::Event> write_wait;
+   if(k>0)
+      write_wait.push_back(chunks[k-1].write_done);
+   if(last_chunk_buffer[c.buffer])
+      write_wait.push_back(last_chunk_buffer[c.buffer]->done);
+   unsigned long words_start = starting_doc_id[c.first_doc];
+   kernel[comp].setArg(0,c.doc_sizes_sub_buffer);
+   if(words_in_place && words_start%page_words==0) {
+      cl_buffer_region buffer_info_words={words_start*sizeof(uint), (unsigned long)c.words*sizeof(uint)};
+      c.words_sub_buffer = buffer_all_words[comp].createSubBuffer(CL_MEM_READ_ONLY,CL_BUFFER_CREATE_TYPE_REGION,&buffer_info_words);
+      kernel[comp].setArg(1,c.words_sub_buffer);
+      q.enqueueMigrateMemObjects({c.words_sub_buffer},0,write_wait.empty()?NULL:&write_wait,&c.write_done);
+      mapped_chunks++;
+   } else {
+      q.enqueueWriteBuffer(buffer_input_doc_words[c.buffer],CL_FALSE,0,c.words*sizeof(uint),input_doc_words+words_start,write_wait.empty()?NULL:&write_wait,&c.write_done);
+      kernel[comp].setArg(1,buffer_input_doc_words[c.buffer]);
+   }
+#if bloom_topk
+   kernel[comp].setArg(4,buffer_topk[c.buffer]);
+#else
+   kernel[comp].setArg(4,c.score_sub_buffer);
+#endif
+   kernel[comp].setArg(5,c.num_docs);
+   kernel[comp].setArg(6,c.words);
+   // Reload the on-chip bloom filter (and compact profile) if the profile changed since this compute unit last loaded it
+   bool flag = (session->cu_profile_version[comp]!=session->profile_version);
+   session->cu_profile_version[comp] = session->profile_version;
+   kernel[comp].setArg(7,flag);
+
+   vector<cl::Event> kernel_wait;
+   kernel_wait.push_back(c.write_done);
+   if(last_chunk_cu[comp]==NULL)
+      kernel_wait.insert(kernel_wait.end(),init_done.begin(),init_done.end());
+   else
+      kernel_wait.push_back(last_chunk_cu[comp]->kernel_done);
+   q.enqueueTask(kernel[comp],&kernel_wait,&c.kernel_done);
+#if bloom_topk
+   c.topk.resize(2*bloom_topk);
+   vector<cl::Event> read_wait(1,c.kernel_done);
+   q.enqueueReadBuffer(buffer_topk[c.buffer],CL_FALSE,0,2*bloom_topk*sizeof(ulong),c.topk.data(),&read_wait,&c.done);
+#else
+   c.done = c.kernel_done;
+#endif
+   c.done.setCallback(CL_COMPLETE,chunk_done,&c);
+
+   last_chunk_cu[comp] = &c;
+   last_chunk_buffer[c.buffer] = &c;
+}
+
+#if !bloom_topk
+vector<cl::Event> eventlist;
+for(unsigned int i=0;i<chunks.size();i++)
+   eventlist.push_back(chunks[i].kernel_done);
+cl::Event readback_done;
+q.enqueueMigrateMemObjects({buffer_fpga_profileScore},CL_MIGRATE_MEM_OBJECT_HOST,&eventlist,&readback_done);
+#endif
 q.finish();
+session->profile_done.clear();
 
    chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
    chrono::duration<double> time_span_fpga  = chrono::duration_cast<duration<double>>(t2-t1);
-cout << "Execution time of FPGA is " << time_span_fpga.count() << endl;   
+cout << "Execution time of FPGA is " << time_span_fpga.count() << endl;
+
+// Completion callbacks may still be in flight after finish()
+while(num_timed<chunks.size())
+   collect(true);
+
+if(cpu_threads>0) {
+   cpu_side.join();
+#if bloom_topk
+   fpga_best.merge(cpu_best);
+#else
+   // The CPU took its documents from the back of the pool, so they form one contiguous tail
+   unsigned int cpu_first = total_num_docs - cpu_stats.docs;
+   copy(cpu_scores.begin()+(unsigned long)cpu_first*bloom_profiles,cpu_scores.end(),fpga_profileScore+(unsigned long)cpu_first*bloom_profiles);
+#endif
+   chrono::duration<double> time_span_hybrid = chrono::duration_cast<duration<double>>(chrono::high_resolution_clock::now()-t1);
+   cout << "Execution time of FPGA+CPU is " << time_span_hybrid.count() << endl;
+   double fpga_span = time_span_fpga.count();
+   printf("Hybrid split: CPU scored %u docs (%.1f%% of words) in %u ranges on %u threads at %.1f Mwords/s, FPGA at %.1f Mwords/s\n",
+          cpu_stats.docs,total_doc_size_1 ? 100.0*cpu_stats.words/total_doc_size_1 : 0,cpu_stats.ranges,cpu_threads,
+          cpu_stats.busy>0 ? cpu_stats.words/cpu_stats.busy*1e-6 : 0,fpga_span>0 ? fpga_words.load()/fpga_span*1e-6 : 0);
+}
+
+if(topk)
+   fpga_best.sorted(topk);
+
+if(stats) {
+   stats->setup = chrono::duration<double>(t1-t0).count();
+   for(unsigned int i=0;i<init_done.size();i++)
+      stats->setup += (init_done[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() - init_done[i].getProfilingInfo<CL_PROFILING_COMMAND_START>())*1e-9;
+   stats->transfer = 0;
+   stats->compute = 0;
+   stats->readback = 0;
+   for(unsigned int i=0;i<chunks.size();i++) {
+      stats->transfer += (chunks[i].write_end - chunks[i].write_start)*1e-9;
+      stats->compute += (chunks[i].kernel_end - chunks[i].kernel_start)*1e-9;
+#if bloom_topk
+      stats->readback += (chunks[i].done.getProfilingInfo<CL_PROFILING_COMMAND_END>() - chunks[i].done.getProfilingInfo<CL_PROFILING_COMMAND_START>())*1e-9;
+#endif
+   }
+#if !bloom_topk
+   stats->readback = (readback_done.getProfilingInfo<CL_PROFILING_COMMAND_END>() - readback_done.getProfilingInfo<CL_PROFILING_COMMAND_START>())*1e-9;
+#endif
+   stats->total = chrono::duration<double>(chrono::high_resolution_clock::now()-t1).count();
+   stats->chunks = chunks.size();
+}
+
+// Per-chunk timeline relative to the first transfer, printed when BLOOM_CHUNK_TIMING is set
+double write_ms = 0, kernel_ms = 0;
+unsigned int min_words = chunks.empty() ? 0 : chunks[0].words, max_words = 0;
+cl_ulong origin = chunks.empty() ? 0 : chunks[0].write_start;
+cl_ulong last_end = origin;
+vector<double> cu_busy_ms(num_compute_units,0);
+vector<unsigned int> cu_chunks(num_compute_units,0), cu_docs(num_compute_units,0);
+bool trace = getenv("BLOOM_CHUNK_TIMING") != NULL;
+for(unsigned int i=0;i<chunks.size();i++) {
+   chunk_info& c = chunks[i];
+   write_ms += (c.write_end - c.write_start)*1e-6;
+   kernel_ms += (c.kernel_end - c.kernel_start)*1e-6;
+   min_words = min(min_words,c.words);
+   max_words = max(max_words,c.words);
+   last_end = max(last_end,c.kernel_end);
+   cu_busy_ms[c.comp] += (c.kernel_end - c.kernel_start)*1e-6;
+   cu_chunks[c.comp]++;
+   cu_docs[c.comp] += c.num_docs;
+   if(trace)
+      printf("chunk %u CU %u docs %u-%u words %u write %.3f-%.3f ms kernel %.3f-%.3f ms\n",i,c.comp+1,c.first_doc,c.first_doc+c.num_docs-1,c.words,
+             (c.write_start-origin)*1e-6,(c.write_end-origin)*1e-6,(c.kernel_start-origin)*1e-6,(c.kernel_end-origin)*1e-6);
+}
+printf("Scored %u chunks of %u to %u words: transfer %.3f ms, kernels %.3f ms, transfer overlapped with kernels %.3f ms\n",
+       (unsigned int)chunks.size(),min_words,max_words,write_ms,kernel_ms,overlap_ms(chunks));
+printf("%u of %u chunks migrated from host memory without a copy\n",mapped_chunks,(unsigned int)chunks.size());
+
+// Utilization is the time each compute unit spent in a kernel over the whole device timeline
+double span_ms = (last_end-origin)*1e-6;
+for(unsigned int i=0;i<num_compute_units;i++)
+   printf("CU %u: %u chunks, %u docs, busy %.3f ms of %.3f ms (%.1f%%)\n",i+1,cu_chunks[i],cu_docs[i],cu_busy_ms[i],span_ms,span_ms>0 ? 100*cu_busy_ms[i]/span_ms : 0);
 
 }
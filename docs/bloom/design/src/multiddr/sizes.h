@@ -1,4 +1,90 @@
-#define hash_bloom 0x7ffff 
+// The bloom filter is (1 << bloom_size) 32-bit words, (32 << bloom_size) bits,
+// selected at build time (make BLOOM_SIZE=<n>)
+#ifndef bloom_size
 #define bloom_size 14
+#endif
+#define hash_bloom ((32 << bloom_size) - 1)
 #define docTag 0xffffffff
 
+// Bloom filter layout, selected at build time (make BLOOM_BLOCKED=1):
+//  0 - flat: the two probes of a word can land anywhere in the filter
+//  1 - blocked: hash1 picks a 64-byte block (16 words) and both probes fall in it,
+//      so each word costs a single cache line / local memory row
+#ifndef bloom_blocked
+#define bloom_blocked 0
+#endif
+#define bloom_block_mask 0x1ff
+
+// Profile membership filter in front of the weight lookup, selected at build time (make FILTER=1):
+//  0 - bloom: two probes into the (32 << bloom_size)-bit bloom filter
+//  1 - cuckoo: the same (1 << bloom_size) words hold a cuckoo filter of 16-bit
+//      fingerprints, 4 per bucket (see membership_filter.h). Fewer false
+//      positives for the same memory, but the filter can fill up. bloom_blocked
+//      does not apply.
+#ifndef membership_filter
+#define membership_filter 0
+#endif
+
+#if bloom_blocked
+#define bloom_hash2(hash_pu,hash_lu) ((((hash_pu)&hash_bloom)&~bloom_block_mask) | (((hash_pu)+(hash_lu))&bloom_block_mask))
+#else
+#define bloom_hash2(hash_pu,hash_lu) (((hash_pu)+(hash_lu))&hash_bloom)
+#endif
+
+// Profile weight store, selected at build time (make PROFILE_COMPACT=1):
+//  0 - dense: profile_weights is an unsigned long per 24-bit word ID (128 MiB)
+//  1 - compact: profile_weights is a bucketized hash table of 32-bit slots,
+//      (word_id << 8) | weight, sized to the profile (see profile_table.h)
+#ifndef profile_compact
+#define profile_compact 0
+#endif
+#define profile_bucket_bits 12
+#define profile_bucket_slots 8
+
+// Document layout, selected at build time (make UNPADDED=1):
+//  0 - padded: every document is padded to a multiple of 1024 words and the
+//      kernel reads doc_sizes to know where each document ends
+//  1 - unpadded: every document is its real words followed by a single docTag
+//      end marker, so only real words are transferred and the kernel finds the
+//      document ends inline. doc_sizes still counts the marker.
+#ifndef doc_unpadded
+#define doc_unpadded 0
+#endif
+// Words of a document of size words that are scored (all but the end marker)
+#define doc_scored_words(size) ((size) - doc_unpadded)
+
+// Kernel document interface, selected at build time (make WIDE=1):
+//  0 - the kernel reads one 32-bit document word per cycle
+//  1 - the kernel reads 512-bit beats of bloom_lanes words and hashes and probes
+//      them in bloom_lanes parallel lanes; document sizes must then be multiples
+//      of bloom_lanes words (padded with docTag)
+#ifndef bloom_wide
+#define bloom_wide 0
+#endif
+#define bloom_lanes 16
+#if bloom_wide && doc_unpadded
+#error "WIDE=1 needs every beat to hold a single document, use padded documents"
+#endif
+
+// On-kernel top-K selection, selected at build time (make TOPK=<k>):
+//  0 - the kernel writes the score of every document
+//  k - the kernel keeps the k best documents of each chunk and writes only
+//      those as k (score, doc) pairs; the host merges them across chunks
+#ifndef bloom_topk
+#define bloom_topk 0
+#endif
+
+// Profiles scored per pass, selected at build time (make PROFILES=<n>):
+//  1 - the kernel scores the documents against a single profile
+//  n - the kernel keeps n bloom filters on chip, each in its own memories,
+//      hashes every word once and probes all n filters in the same cycle,
+//      then writes n scores per document: score p of document d at d*n+p.
+//      bloom_filter and profile_weights hold the n profiles back to back.
+//      Meant for PROFILE_COMPACT=1, where the n weight tables are on chip too;
+//      dense tables stay in DDR and their lookups share one port.
+#ifndef bloom_profiles
+#define bloom_profiles 1
+#endif
+#if bloom_profiles > 1 && (bloom_wide || bloom_topk)
+#error "PROFILES>1 is only supported by the narrow kernel writing every score"
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+#include<vector>
+#include<algorithm>
+
+//-----------------------------------------------------------------------------
+// Top-K document selection.
+//
+// Documents are ranked by score, highest first, and by document ID on equal
+// scores, lowest first. The order is total, so every scorer (CPU workers, FPGA
+// compute units, or both) that keeps the K best of its documents and merges
+// them ends up with exactly the same list.
+
+#define topk_no_doc 0xffffffff
+
+struct doc_score {
+   unsigned long score;
+   unsigned int doc;
+};
+
+inline bool topk_before(const doc_score& a,const doc_score& b)
+{
+   return a.score > b.score || (a.score == b.score && a.doc < b.doc);
+}
+
+// Bounded heap of the k best documents pushed so far; the worst of them is on top
+class topk_heap {
+public:
+   explicit topk_heap(unsigned int k) : k(k) { heap.reserve(k); }
+
+   void push(unsigned int doc,unsigned long score) {
+      doc_score entry = {score,doc};
+      if (heap.size() < k) {
+         heap.push_back(entry);
+         std::push_heap(heap.begin(),heap.end(),topk_before);
+      } else if (k > 0 && topk_before(entry,heap.front())) {
+         std::pop_heap(heap.begin(),heap.end(),topk_before);
+         heap.back() = entry;
+         std::push_heap(heap.begin(),heap.end(),topk_before);
+      }
+   }
+
+   void merge(const topk_heap& other) {
+      for (unsigned int i = 0; i < other.heap.size(); i++)
+         push(other.heap[i].doc,other.heap[i].score);
+   }
+
+   // Best first, padded to k entries with doc = topk_no_doc
+   void sorted(doc_score* out) const {
+      std::vector<doc_score> entries(heap);
+      std::sort(entries.begin(),entries.end(),topk_before);
+      for (unsigned int i = 0; i < k; i++) {
+         doc_score none = {0,topk_no_doc};
+         out[i] = i < entries.size() ? entries[i] : none;
+      }
+   }
+
+private:
+   unsigned int k;
+   std::vector<doc_score> heap;
+};
@@ -8,6 +8,7 @@
 
 #include <argp.h>
 #include "common.h"
+#include "frame_io.h"
 #include "kernels.h"
 
 using std::make_tuple;
@@ -27,6 +28,8 @@ static char default_kernel_name[] = "";
 // The options we understand.
 static struct argp_option options[] = {
     {"gray", 'g', 0, 0, "Convert input to grayscale"},
+    {"planar", 'p', 0, 0, "Process planar frames (gbrp) instead of RGBA"},
+    {"pipeline", 'P', 0, 0, "Read, process and write frames in overlapping stages"},
     {"output", 'o', "FILE", 0, "Output file (default: output.mp4)"},
     {"scale", 's', "WIDTH HEIGHT", 0,
      "The input will be resized to this before being processed"},
@@ -34,6 +37,10 @@ static struct argp_option options[] = {
     {"nframes", 'n', "NUM", 0, "Number of frames to process"},
     {"kernel_name", 'k', "KERNEL_NAME", 0, "The kernel to launch"},
     {"ncomputeunits", 'c', "NUM", 0, "Number of compute units"},
+    {"threads", 't', "NUM", 0,
+     "Convolve on the CPU with NUM threads (default: 0, single threaded convolve_cpu)"},
+    {"separable", 'S', 0, 0,
+     "With --threads, convolve separable filters in two passes (faster, may differ by a level)"},
     {0}};
 
 char default_output[] = "output.mp4";
@@ -65,6 +72,14 @@ parse_opt (int key, char *arg, struct argp_state *state) {
       arguments->gray = true;
       break;
 
+    case 'p':
+      arguments->planar = true;
+      break;
+
+    case 'P':
+      arguments->pipeline = true;
+      break;
+
     case 'o':
       arguments->output_file = arg;
       break;
@@ -91,6 +106,14 @@ parse_opt (int key, char *arg, struct argp_state *state) {
       arguments->ncompute_units = atoi(arg);
       break;
 
+    case 't':
+      arguments->nthreads = atoi(arg);
+      break;
+
+    case 'S':
+      arguments->separable = true;
+      break;
+
     case ARGP_KEY_ARG:
       if(strstr(arg, "xclbin")) {
         arguments->binary_file = arg;
@@ -120,11 +143,18 @@ void print_progress(int cnt, int total) {
     fflush(stdout);
 }
 
+size_t get_frame_bytes(const arguments& args) {
+  size_t pixel_bytes = (args.planar) ? PLANES : sizeof(RGBPixel);
+  return args.width * args.height * pixel_bytes;
+}
+
 arguments parse_args(int argc, char* argv[]) {
     arguments arguments;
 
     arguments.output_file = default_output;
     arguments.gray = false;
+    arguments.planar = false;
+    arguments.pipeline = false;
     arguments.verbose = true;
     arguments.width  = -1;
     arguments.height = -1;
@@ -132,11 +162,17 @@ arguments parse_args(int argc, char* argv[]) {
     arguments.binary_file = nullptr;
     arguments.kernel_name = default_kernel_name;
     arguments.ncompute_units = 1;
+    arguments.nthreads = 0;
+    arguments.separable = false;
 
     argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
+    // Videos read in process (or by libav) need no ffprobe
     int input_width, input_height, input_frames;
-    tie(input_width, input_height, input_frames) = get_video_size(arguments.input_file);
+    tie(input_width, input_height, input_frames) = probe_video_size(arguments);
+    if(input_width == 0 && !in_process_video(arguments.input_file)) {
+      tie(input_width, input_height, input_frames) = get_video_size(arguments.input_file);
+    }
     arguments.in_width = input_width;
     arguments.in_height = input_height;
 
@@ -151,33 +187,11 @@ arguments parse_args(int argc, char* argv[]) {
         printf("scaled size: %dx%d\n", arguments.width, arguments.height);
       }
       printf("nframes: %d\n", arguments.nframes);
+      printf("frame layout: %s, %zu bytes per frame (RGBA: %zu)\n",
+             (arguments.planar) ? "planar gbrp" : "RGBA", get_frame_bytes(arguments),
+             arguments.width * arguments.height * sizeof(RGBPixel));
+      if(arguments.binary_file) printf("Binary Path: %s\n", arguments.binary_file);
     }
 
     return arguments;
 }
-
-tuple<FILE*, FILE*>
-get_streams(arguments &args) {
-  string inCommand;
-  inCommand.resize(2048);
-  snprintf(&inCommand.front(), 2048,
-           "ffmpeg -v error -hide_banner -i %s -f image2pipe -vcodec rawvideo -vf scale=w=%d:h=%d -vframes %d -pix_fmt rgba -",
-           args.input_file, args.width, args.height, args.nframes);
-
-  string outCommand;
-  outCommand.resize(2048);
-  snprintf(&outCommand.front(), 2048,
-           "ffmpeg -v error -hide_banner -y -f rawvideo -vcodec rawvideo -pix_fmt %s -s %dx%d -framerate 25 -i - -f mp4 -q:v 5 -an -codec mpeg4 %s",
-           (args.gray) ? "gray" : "rgba", args.width, args.height, args.output_file);
-
-  if(args.verbose) {
-    printf("IN COMMAND:  %s\n"
-           "OUT COMMAND: %s\n", inCommand.c_str(), outCommand.c_str());
-    if(args.binary_file) printf("Binary Path: %s\n", args.binary_file);
-  }
-
-  FILE* streamIn = popen(inCommand.c_str(), "r");
-  FILE* streamOut = popen(outCommand.c_str(), "w");
-
-  return make_tuple(streamIn, streamOut);
-}
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdio>
 #include <tuple>
 
 #include "constants.h"
@@ -32,12 +33,24 @@ struct arguments {
   // The number of compute units on the binary
   int ncompute_units;
 
+  // The number of threads of the line-buffered CPU engine (0: convolve_cpu)
+  int nthreads;
+
+  // If true the CPU engine convolves separable filters in two passes
+  bool separable;
+
   // The path to the xclbin or awsxcbin file
   char* binary_file;
 
   // If true the output will be converted to grayscale
   bool gray;
 
+  // If true frames are planar (gbrp) instead of interleaved RGBA
+  bool planar;
+
+  // If true frames are read, processed and written by overlapping stages
+  bool pipeline;
+
   // If true prints extra information about the program
   bool verbose;
 };
@@ -48,10 +61,13 @@ arguments parse_args(int argc, char* argv[]);
 // Prints the progress of an operation
 void print_progress(int cnt, int total);
 
-// Returns an input and output pipe stream.
-std::tuple<FILE*, FILE*> get_streams(arguments &args);
+// Returns the size in bytes of an input frame
+size_t get_frame_bytes(const arguments& args);
+
+class frame_source;
+class frame_sink;
 
 // Method for performing convolution
-void convolve(FILE* streamIn, FILE* streamOut,
+void convolve(frame_source& source, frame_sink& sink,
               float* filter, int filter_size,
               arguments args);
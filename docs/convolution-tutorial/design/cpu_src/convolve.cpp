@@ -1,6 +1,8 @@
 
 #include "common.h"
 #include "constants.h"
+#include "frame_io.h"
+#include "frame_pipeline.h"
 #include "kernels.h"
 
 #include <vector>
@@ -27,41 +29,140 @@ test(vector<RGBPixel>& in, vector<RGBPixel>& out,
     }
 }
 
-void convolve(FILE* streamIn, FILE* streamOut,
+namespace {
+
+// Frames in flight in pipelined mode: one read, one convolved, one written
+const int pipeline_depth = 3;
+
+// Convolves a frame with the CPU function picked by the arguments
+void convolve_frame(const unsigned char* in, unsigned char* out,
+                    const float* coefficients, int coefficient_size,
+                    const float* column, const float* row, bool separable,
+                    const arguments& args) {
+    const RGBPixel* inFrame = reinterpret_cast<const RGBPixel*>(in);
+    RGBPixel* outFrame = reinterpret_cast<RGBPixel*>(out);
+    if(args.planar && separable) {
+      convolve_cpu_planar_separable(in, out,
+                                    column, row, coefficient_size,
+                                    args.width, args.height, args.nthreads);
+    } else if(args.planar && args.nthreads > 0) {
+      convolve_cpu_planar_parallel(in, out,
+                                   coefficients, coefficient_size,
+                                   args.width, args.height, args.nthreads);
+    } else if(args.planar) {
+      convolve_cpu_planar(in, out,
+                          coefficients, coefficient_size,
+                          args.width, args.height);
+    } else if(separable) {
+      convolve_cpu_separable(inFrame, outFrame,
+                             column, row, coefficient_size,
+                             args.width, args.height, args.nthreads);
+    } else if(args.nthreads > 0) {
+      convolve_cpu_parallel(inFrame, outFrame,
+                            coefficients, coefficient_size,
+                            args.width, args.height, args.nthreads);
+    } else {
+      convolve_cpu(inFrame, outFrame,
+                   coefficients, coefficient_size,
+                   args.width, args.height);
+    }
+}
+
+// Converts a convolved frame to grayscale
+void grayscale_frame(const unsigned char* in, GrayPixel* out, const arguments& args) {
+    if(args.planar) {
+      grayscale_cpu_planar(in, out, args.width, args.height);
+    } else {
+      grayscale_cpu(reinterpret_cast<const RGBPixel*>(in), out, args.width, args.height);
+    }
+}
+
+// Convolves a frame and converts it to grayscale. The threaded engines do both
+// in one pass without storing the convolved frame; the reference engine
+// convolves into scratch and converts that.
+void convolve_gray_frame(const unsigned char* in, GrayPixel* out, unsigned char* scratch,
+                         const float* coefficients, int coefficient_size,
+                         const float* column, const float* row, bool separable,
+                         const arguments& args) {
+    if(separable) {
+      convolve_grayscale_cpu_separable(in, out, args.planar,
+                                       column, row, coefficient_size,
+                                       args.width, args.height, args.nthreads);
+    } else if(args.nthreads > 0) {
+      convolve_grayscale_cpu_parallel(in, out, args.planar,
+                                      coefficients, coefficient_size,
+                                      args.width, args.height, args.nthreads);
+    } else {
+      convolve_frame(in, scratch, coefficients, coefficient_size,
+                     column, row, separable, args);
+      grayscale_frame(scratch, out, args);
+    }
+}
+
+}  // anonymous namespace
+
+void convolve(frame_source& source, frame_sink& sink,
               float* coefficients, int coefficient_size,
               arguments args) {
-    size_t frame_bytes = args.width * args.height * sizeof(RGBPixel);
+    size_t frame_bytes = get_frame_bytes(args);
     size_t gray_frame_bytes = args.width * args.height * sizeof(GrayPixel);
     vector<RGBPixel> inFrame(args.width * args.height);
     vector<RGBPixel> outFrame(args.width * args.height);
     vector<GrayPixel> grayFrame(args.width * args.height);
 
+    // Planar frames use the first PLANES bytes per pixel of the same buffers
+    unsigned char* inPlanes = &inFrame[0].r;
+    unsigned char* outPlanes = &outFrame[0].r;
+
+    vector<float> column(coefficient_size), row(coefficient_size);
+    // The two passes round differently from convolve_cpu, so they are opt-in
+    bool separable = args.separable && args.nthreads > 0 &&
+                     separable_filter(coefficients, coefficient_size, column.data(), row.data());
+    if(args.verbose && separable) {
+      printf("Separable filter: convolving in a horizontal and a vertical pass\n");
+    }
+
+    if(args.pipeline) {
+      // Grayscale frames go straight into the ring, outFrame is only scratch
+      size_t out_bytes = (args.gray) ? gray_frame_bytes : frame_bytes;
+      pipeline_stats stats = run_pipeline(source, sink, frame_bytes, out_bytes,
+                                          args.nframes, pipeline_depth,
+                                          [&](const unsigned char* in, unsigned char* out, int) {
+        if(args.gray) {
+          convolve_gray_frame(in, out, outPlanes, coefficients, coefficient_size,
+                              column.data(), row.data(), separable, args);
+        } else {
+          convolve_frame(in, out, coefficients, coefficient_size,
+                         column.data(), row.data(), separable, args);
+        }
+      });
+      if(args.verbose) print_pipeline_stats(stats);
+      return;
+    }
+
     size_t bytes_read = 0;
     size_t bytes_written = 0;
     for(int frame_count = 0; frame_count < args.nframes; frame_count++) {
         // Read frame
-        bytes_read = fread(inFrame.data(), 1, frame_bytes, streamIn);
+        bytes_read = source.read(inPlanes, frame_bytes);
         if(bytes_read != frame_bytes) {
         	printf("\nError: partial frame.\nExpected %zu\nActual %zu\n", frame_bytes, bytes_read);
         	break;
         }
 
-        convolve_cpu(inFrame.data(), outFrame.data(),
-                     coefficients, coefficient_size,
-                     args.width, args.height);
-
         if(args.gray) {
-          grayscale_cpu(outFrame.data(), grayFrame.data(), args.width, args.height);
-          bytes_written = fwrite(outFrame.data(), 1, gray_frame_bytes, streamOut);
-          fflush(streamOut);
+          convolve_gray_frame(inPlanes, grayFrame.data(), outPlanes, coefficients, coefficient_size,
+                              column.data(), row.data(), separable, args);
+          bytes_written = sink.write(grayFrame.data(), gray_frame_bytes);
           if (bytes_written != gray_frame_bytes) {
             printf("\nError: partial frame.\nExpected %zu\nActual %zu\n",
                    gray_frame_bytes, bytes_written);
             break;
           }
         } else {
-          bytes_written = fwrite(outFrame.data(), 1, frame_bytes, streamOut);
-          fflush(streamOut);
+          convolve_frame(inPlanes, outPlanes, coefficients, coefficient_size,
+                         column.data(), row.data(), separable, args);
+          bytes_written = sink.write(outPlanes, frame_bytes);
           if (bytes_written != frame_bytes) {
             printf("\nError: partial frame.\nExpected %zu\nActual %zu\n",
                    frame_bytes, bytes_written);
@@ -0,0 +1,325 @@
+#include "constants.h"
+#include "kernels.h"
+#include "types.h"
+
+#include <cmath>
+#include <thread>
+#include <vector>
+
+using std::thread;
+using std::vector;
+
+namespace {
+
+// Where the channels of a frame are: channel c of pixel i (counting from the
+// top left pixel) is at frame[c * channel_step + i * pixel_step]
+struct frame_layout {
+    long channel_step;
+    int pixel_step;
+};
+
+// Interleaved RGBPixel frames, the channels are r, g and b
+frame_layout rgba_layout() {
+    frame_layout layout = {1, sizeof(RGBPixel)};
+    return layout;
+}
+
+// Planar frames, the channels are the planes
+frame_layout planar_layout(int img_width, int img_height) {
+    frame_layout layout = {(long)img_width * img_height, 1};
+    return layout;
+}
+
+// Writes the convolved lines into a frame of the given layout
+struct frame_output {
+    unsigned char* frame;
+    frame_layout layout;
+
+    // sums holds the width sums of channel 0, then those of channels 1 and 2
+    void write_line(int line, const float* sums, int img_width) const {
+        for(int c = 0; c < 3; ++c) {
+            const float* sum = sums + c * img_width;
+            unsigned char* out = frame + c * layout.channel_step + (long)line * img_width * layout.pixel_step;
+            for(int i = 0; i < img_width; ++i)
+                out[i * layout.pixel_step] = (int)fabsf(sum[i]);
+        }
+    }
+};
+
+// Converts the convolved lines to grayscale as they are computed, so the
+// convolved frame is never stored. Rounds each channel to a pixel first and
+// weighs it like grayscale_cpu, which makes it bit-identical to convolving and
+// then calling grayscale_cpu. red, green and blue are the channel numbers.
+struct gray_output {
+    GrayPixel* frame;
+    int red;
+    int green;
+    int blue;
+
+    void write_line(int line, const float* sums, int img_width) const {
+        const float* r = sums + red * img_width;
+        const float* g = sums + green * img_width;
+        const float* b = sums + blue * img_width;
+        GrayPixel* out = frame + (long)line * img_width;
+        for(int i = 0; i < img_width; ++i) {
+            unsigned char pr = (int)fabsf(r[i]);
+            unsigned char pg = (int)fabsf(g[i]);
+            unsigned char pb = (int)fabsf(b[i]);
+            out[i] = (pr * 0.30) + (pg * 0.59) + (pb * 0.11);
+        }
+    }
+};
+
+// Rolling window of coefficient_size input lines, converted to planar floats.
+// Each line has center zero pixels on both sides, so the horizontal taps need
+// no bounds checks. Given a row filter, the window keeps the lines after the
+// horizontal pass of a separable filter instead.
+class line_buffer {
+public:
+    line_buffer(int coefficient_size, int img_width, const float* row = 0)
+        : size(coefficient_size),
+          center(coefficient_size / 2),
+          width(img_width),
+          stride_padded(img_width + coefficient_size - 1),
+          stride(row ? img_width : stride_padded),
+          row(row),
+          lines(3 * coefficient_size * stride, 0.0f),
+          padded(row ? 3 * stride_padded : 0, 0.0f),
+          line_of(coefficient_size, -1) {}
+
+    // Planar line of channel c of input line ii, which must be loaded
+    const float* channel(int ii, int c) const {
+        return &lines[(3 * (ii % size) + c) * stride];
+    }
+
+    // Converts input line ii into the window, replacing line ii - coefficient_size
+    void load(const unsigned char* inFrame, frame_layout layout, int ii) {
+        int slot = ii % size;
+        if(line_of[slot] == ii) return;
+        const unsigned char* in = inFrame + (long)ii * width * layout.pixel_step;
+        int step = layout.pixel_step;
+        float* line[3];
+        for(int c = 0; c < 3; ++c)
+            line[c] = (row ? &padded[c * stride_padded] : &lines[(3 * slot + c) * stride]) + center;
+        if(step == 1) {
+            for(int c = 0; c < 3; ++c)
+                for(int jj = 0; jj < width; ++jj)
+                    line[c][jj] = in[c * layout.channel_step + jj];
+        } else {
+            const unsigned char* r = in;
+            const unsigned char* g = in + layout.channel_step;
+            const unsigned char* b = in + 2 * layout.channel_step;
+            for(int jj = 0; jj < width; ++jj) {
+                line[0][jj] = r[jj * step];
+                line[1][jj] = g[jj * step];
+                line[2][jj] = b[jj * step];
+            }
+        }
+        if(row) {
+            for(int c = 0; c < 3; ++c) {
+                float* filtered = &lines[(3 * slot + c) * stride];
+                for(int jj = 0; jj < width; ++jj)
+                    filtered[jj] = 0;
+                for(int n = 0; n < size; ++n) {
+                    float k = row[n];
+                    const float* tap = &padded[c * stride_padded + n];
+                    for(int jj = 0; jj < width; ++jj)
+                        filtered[jj] += tap[jj] * k;
+                }
+            }
+        }
+        line_of[slot] = ii;
+    }
+
+private:
+    int size;
+    int center;
+    int width;
+    int stride_padded;
+    int stride;
+    const float* row;
+    vector<float> lines;
+    vector<float> padded;
+    vector<int> line_of;
+};
+
+// Same sums as convolve_cpu: every pixel adds its taps in the same (m, n) order
+// with the same float operations, and the taps that convolve_cpu skips at the
+// image borders only ever add zeros, so the output is bit-identical.
+template<typename Output>
+void convolve_band(const unsigned char* inFrame, frame_layout layout, Output output,
+                   const float* coefficient, int coefficient_size,
+                   int img_width, int img_height, int first_line, int last_line)
+{
+    int center = coefficient_size / 2;
+    line_buffer window(coefficient_size, img_width);
+    vector<float> sums(3 * img_width);
+
+    for(int line = first_line; line < last_line; ++line)
+    {
+        // Lines above and below the image are left out, as their taps add nothing
+        int m_begin = (line - center < 0) ? center - line : 0;
+        int m_end = (line - center + coefficient_size > img_height) ? img_height - line + center : coefficient_size;
+        for(int m = m_begin; m < m_end; ++m)
+            window.load(inFrame, layout, line + m - center);
+
+        for(int c = 0; c < 3; ++c)
+        {
+            float* sum = &sums[c * img_width];
+            for(int i = 0; i < img_width; ++i)
+                sum[i] = 0;
+            for(int m = m_begin; m < m_end; ++m)
+            {
+                const float* in = window.channel(line + m - center, c);
+                const float* coef = coefficient + m * coefficient_size;
+                for(int n = 0; n < coefficient_size; ++n)
+                {
+                    float k = coef[n];
+                    const float* tap = in + n;
+                    for(int i = 0; i < img_width; ++i)
+                        sum[i] += tap[i] * k;
+                }
+            }
+        }
+        output.write_line(line, &sums[0], img_width);
+    }
+}
+
+// Two pass version of convolve_band for a filter equal to column * row: the
+// line buffer applies the row filter once per input line, and each output line
+// only sums coefficient_size horizontally filtered lines.
+template<typename Output>
+void convolve_band_separable(const unsigned char* inFrame, frame_layout layout, Output output,
+                             const float* column, const float* row, int coefficient_size,
+                             int img_width, int img_height, int first_line, int last_line)
+{
+    int center = coefficient_size / 2;
+    line_buffer window(coefficient_size, img_width, row);
+    vector<float> sums(3 * img_width);
+
+    for(int line = first_line; line < last_line; ++line)
+    {
+        int m_begin = (line - center < 0) ? center - line : 0;
+        int m_end = (line - center + coefficient_size > img_height) ? img_height - line + center : coefficient_size;
+        for(int m = m_begin; m < m_end; ++m)
+            window.load(inFrame, layout, line + m - center);
+
+        for(int c = 0; c < 3; ++c)
+        {
+            float* sum = &sums[c * img_width];
+            for(int i = 0; i < img_width; ++i)
+                sum[i] = 0;
+            for(int m = m_begin; m < m_end; ++m)
+            {
+                float k = column[m];
+                const float* in = window.channel(line + m - center, c);
+                for(int i = 0; i < img_width; ++i)
+                    sum[i] += in[i] * k;
+            }
+        }
+        output.write_line(line, &sums[0], img_width);
+    }
+}
+
+// Runs band on num_threads threads, each on its own band of lines. A band
+// reads the coefficient_size / 2 halo lines around it from the shared input
+// frame and writes only its own lines, so the bands need no stitching.
+template<typename Band, typename... Args>
+void run_bands(int img_height, int num_threads, Band band, Args... args)
+{
+    if(num_threads < 1) num_threads = 1;
+    if(num_threads > img_height) num_threads = img_height;
+
+    vector<thread> workers;
+    for(int t = 0; t < num_threads; ++t)
+    {
+        int first_line = (long)img_height * t / num_threads;
+        int last_line = (long)img_height * (t + 1) / num_threads;
+        workers.push_back(thread(band, args..., first_line, last_line));
+    }
+    for(size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
+}
+
+}  // anonymous namespace
+
+extern "C"
+{
+
+// Multithreaded convolve_cpu: the frame is split in bands of lines, one per
+// thread. Each thread keeps the input lines its output lines need in a line
+// buffer of planar floats, and adds each tap to a whole output line at a time
+// so the compiler vectorizes the taps over pixels.
+void convolve_cpu_parallel(const RGBPixel* inFrame, RGBPixel* outFrame,
+                           const float* coefficient, int coefficient_size,
+                           int img_width, int img_height, int num_threads)
+{
+    frame_output output = {&outFrame->r, rgba_layout()};
+    run_bands(img_height, num_threads, convolve_band<frame_output>,
+              &inFrame->r, output.layout, output, coefficient, coefficient_size,
+              img_width, img_height);
+}
+
+// convolve_cpu_parallel for a separable filter, given as the column and row
+// vectors from separable_filter: 2 * coefficient_size multiply-adds per pixel
+// and channel instead of coefficient_size * coefficient_size.
+void convolve_cpu_separable(const RGBPixel* inFrame, RGBPixel* outFrame,
+                            const float* column, const float* row, int coefficient_size,
+                            int img_width, int img_height, int num_threads)
+{
+    frame_output output = {&outFrame->r, rgba_layout()};
+    run_bands(img_height, num_threads, convolve_band_separable<frame_output>,
+              &inFrame->r, output.layout, output, column, row, coefficient_size,
+              img_width, img_height);
+}
+
+// convolve_cpu_parallel for planar frames
+void convolve_cpu_planar_parallel(const unsigned char* inFrame, unsigned char* outFrame,
+                                  const float* coefficient, int coefficient_size,
+                                  int img_width, int img_height, int num_threads)
+{
+    frame_output output = {outFrame, planar_layout(img_width, img_height)};
+    run_bands(img_height, num_threads, convolve_band<frame_output>,
+              inFrame, output.layout, output, coefficient, coefficient_size,
+              img_width, img_height);
+}
+
+// convolve_cpu_separable for planar frames
+void convolve_cpu_planar_separable(const unsigned char* inFrame, unsigned char* outFrame,
+                                   const float* column, const float* row, int coefficient_size,
+                                   int img_width, int img_height, int num_threads)
+{
+    frame_output output = {outFrame, planar_layout(img_width, img_height)};
+    run_bands(img_height, num_threads, convolve_band_separable<frame_output>,
+              inFrame, output.layout, output, column, row, coefficient_size,
+              img_width, img_height);
+}
+
+// Fused convolve_cpu_parallel and grayscale_cpu: each band converts its
+// convolved lines to grayscale straight from the sums, so only the 1 byte per
+// pixel gray frame is written. inFrame is an RGBPixel frame, or a planar one
+// when planar is set.
+void convolve_grayscale_cpu_parallel(const unsigned char* inFrame, GrayPixel* outFrame, bool planar,
+                                     const float* coefficient, int coefficient_size,
+                                     int img_width, int img_height, int num_threads)
+{
+    frame_layout layout = planar ? planar_layout(img_width, img_height) : rgba_layout();
+    gray_output output = {outFrame, planar ? PLANE_R : 0, planar ? PLANE_G : 1, planar ? PLANE_B : 2};
+    run_bands(img_height, num_threads, convolve_band<gray_output>,
+              inFrame, layout, output, coefficient, coefficient_size,
+              img_width, img_height);
+}
+
+// convolve_grayscale_cpu_parallel for a separable filter
+void convolve_grayscale_cpu_separable(const unsigned char* inFrame, GrayPixel* outFrame, bool planar,
+                                      const float* column, const float* row, int coefficient_size,
+                                      int img_width, int img_height, int num_threads)
+{
+    frame_layout layout = planar ? planar_layout(img_width, img_height) : rgba_layout();
+    gray_output output = {outFrame, planar ? PLANE_R : 0, planar ? PLANE_G : 1, planar ? PLANE_B : 2};
+    run_bands(img_height, num_threads, convolve_band_separable<gray_output>,
+              inFrame, layout, output, column, row, coefficient_size,
+              img_width, img_height);
+}
+
+}
@@ -0,0 +1,448 @@
+#include "frame_io.h"
+#include "types.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef USE_LIBAV
+#include <cerrno>
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+#endif
+
+using std::make_tuple;
+using std::string;
+using std::tuple;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+bool has_extension(const char* path, const char* extension) {
+  size_t length = strlen(path), extension_length = strlen(extension);
+  return length > extension_length && strcmp(path + length - extension_length, extension) == 0;
+}
+
+bool raw_video(const char* path) {
+  return has_extension(path, ".rgba") || has_extension(path, ".gbrp") || has_extension(path, ".gray");
+}
+
+// Extension of raw files holding the frames read or written with args
+const char* raw_extension(const arguments& args, bool output) {
+  if(output && args.gray) return ".gray";
+  return (args.planar) ? ".gbrp" : ".rgba";
+}
+
+long file_size(FILE* file) {
+  long position = ftell(file);
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, position, SEEK_SET);
+  return size;
+}
+
+unsigned char clamp(int value) {
+  return std::min(std::max(value, 0), 255);
+}
+
+// YUV4MPEG2 stream header. The chroma planes are subsampled by 1 << chroma_shift_x
+// horizontally and 1 << chroma_shift_y vertically, and mono streams have none.
+struct y4m_header {
+  int width;
+  int height;
+  int chroma_shift_x;
+  int chroma_shift_y;
+  bool mono;
+  long header_bytes;
+
+  int chroma_width() const { return (width + (1 << chroma_shift_x) - 1) >> chroma_shift_x; }
+  int chroma_height() const { return (height + (1 << chroma_shift_y) - 1) >> chroma_shift_y; }
+  size_t frame_bytes() const {
+    size_t luma = (size_t)width * height;
+    return (mono) ? luma : luma + 2 * (size_t)chroma_width() * chroma_height();
+  }
+};
+
+// Reads a header line of at most line_size - 1 characters, without the newline
+bool read_line(FILE* stream, char* line, int line_size) {
+  if(!fgets(line, line_size, stream)) return false;
+  size_t length = strlen(line);
+  if(length == 0 || line[length - 1] != '\n') return false;
+  line[length - 1] = 0;
+  return true;
+}
+
+// Parses the header of a Y4M stream. On failure the header describes an empty
+// video, so callers can report its size either way.
+bool read_y4m_header(FILE* stream, y4m_header& header) {
+  header.width = header.height = 0;
+  header.chroma_shift_x = header.chroma_shift_y = 1;
+  header.mono = false;
+  header.header_bytes = 0;
+  char line[256];
+  if(!read_line(stream, line, sizeof(line)) || strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+    return false;
+  }
+  for(char* token = strtok(line + 10, " "); token; token = strtok(nullptr, " ")) {
+    if(token[0] == 'W') header.width = atoi(token + 1);
+    if(token[0] == 'H') header.height = atoi(token + 1);
+    if(token[0] == 'C') {
+      // Only the 8 bit tags: 420p10, 444alpha and the like have other frame sizes
+      string colorspace(token + 1);
+      if(colorspace == "420" || colorspace == "420jpeg" || colorspace == "420paldv" ||
+         colorspace == "420mpeg2") {
+        header.chroma_shift_x = header.chroma_shift_y = 1;
+      } else if(colorspace == "422") {
+        header.chroma_shift_x = 1;
+        header.chroma_shift_y = 0;
+      } else if(colorspace == "444") {
+        header.chroma_shift_x = header.chroma_shift_y = 0;
+      } else if(colorspace == "mono") {
+        header.mono = true;
+      } else {
+        printf("\nError: unsupported Y4M colorspace C%s\n", token + 1);
+        header.width = header.height = 0;
+        return false;
+      }
+    }
+  }
+  if(header.width <= 0 || header.height <= 0) {
+    header.width = header.height = 0;
+    return false;
+  }
+  header.header_bytes = ftell(stream);
+  return true;
+}
+
+// Frames of a Y4M file, converted from BT.601 YUV to the frame layout
+class y4m_source : public frame_source {
+public:
+  y4m_source(FILE* file, const y4m_header& header, bool planar)
+      : file(file), header(header), planar(planar),
+        yuv(header.frame_bytes()), chroma(2 * header.width), rgb(3 * header.width) {}
+  ~y4m_source() { fclose(file); }
+
+  size_t read(unsigned char* frame, size_t bytes) {
+    char line[256];
+    if(!read_line(file, line, sizeof(line)) || strncmp(line, "FRAME", 5) != 0) return 0;
+    if(fread(yuv.data(), 1, yuv.size(), file) != yuv.size()) return 0;
+
+    int width = header.width;
+    size_t plane_size = (size_t)width * header.height;
+    size_t chroma_size = (size_t)header.chroma_width() * header.chroma_height();
+    for(int y = 0; y < header.height; y++) {
+      const unsigned char* luma = &yuv[(size_t)y * width];
+      const unsigned char* u = &yuv[plane_size + (size_t)(y >> header.chroma_shift_y) * header.chroma_width()];
+      const unsigned char* v = u + chroma_size;
+      // Chroma of each pixel of the line first, so the conversion vectorizes
+      unsigned char* u_line = &chroma[0];
+      unsigned char* v_line = &chroma[width];
+      if(header.mono) {
+        memset(u_line, 128, 2 * width);
+      } else {
+        int shift = header.chroma_shift_x;
+        for(int x = 0; x < width; x++) {
+          u_line[x] = u[x >> shift];
+          v_line[x] = v[x >> shift];
+        }
+      }
+
+      unsigned char* r = &rgb[0];
+      unsigned char* g = &rgb[width];
+      unsigned char* b = &rgb[2 * width];
+      for(int x = 0; x < width; x++) {
+        r[x] = clamp((298 * (luma[x] - 16) + 409 * (v_line[x] - 128) + 128) >> 8);
+      }
+      for(int x = 0; x < width; x++) {
+        g[x] = clamp((298 * (luma[x] - 16) - 100 * (u_line[x] - 128) - 208 * (v_line[x] - 128) + 128) >> 8);
+      }
+      for(int x = 0; x < width; x++) {
+        b[x] = clamp((298 * (luma[x] - 16) + 516 * (u_line[x] - 128) + 128) >> 8);
+      }
+
+      size_t first_pixel = (size_t)y * width;
+      if(planar) {
+        memcpy(frame + PLANE_R * plane_size + first_pixel, r, width);
+        memcpy(frame + PLANE_G * plane_size + first_pixel, g, width);
+        memcpy(frame + PLANE_B * plane_size + first_pixel, b, width);
+      } else {
+        unsigned char* out = frame + first_pixel * sizeof(RGBPixel);
+        for(int x = 0; x < width; x++) {
+          out[4 * x] = r[x];
+          out[4 * x + 1] = g[x];
+          out[4 * x + 2] = b[x];
+          out[4 * x + 3] = 255;
+        }
+      }
+    }
+    return bytes;
+  }
+
+private:
+  FILE* file;
+  y4m_header header;
+  bool planar;
+  vector<unsigned char> yuv;
+  vector<unsigned char> chroma;  // U and V of each pixel of a line
+  vector<unsigned char> rgb;     // Red, green and blue of each pixel of a line
+};
+
+// Frames written to a Y4M file. Gray frames are written as they are, in a mono
+// stream, and color frames are converted to BT.601 YUV 4:4:4.
+class y4m_sink : public frame_sink {
+public:
+  y4m_sink(FILE* file, int width, int height, bool gray, bool planar)
+      : file(file), width(width), height(height), gray(gray), planar(planar),
+        yuv((gray) ? 0 : 3 * (size_t)width * height) {
+    fprintf(file, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C%s\n", width, height, (gray) ? "mono" : "444");
+  }
+  ~y4m_sink() { fclose(file); }
+
+  size_t write(const unsigned char* frame, size_t bytes) {
+    fputs("FRAME\n", file);
+    if(gray) return fwrite(frame, 1, bytes, file);
+
+    size_t plane_size = (size_t)width * height;
+    for(size_t pixel = 0; pixel < plane_size; pixel++) {
+      int r, g, b;
+      if(planar) {
+        r = frame[PLANE_R * plane_size + pixel];
+        g = frame[PLANE_G * plane_size + pixel];
+        b = frame[PLANE_B * plane_size + pixel];
+      } else {
+        const RGBPixel& in = reinterpret_cast<const RGBPixel*>(frame)[pixel];
+        r = in.r;
+        g = in.g;
+        b = in.b;
+      }
+      yuv[pixel] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+      yuv[plane_size + pixel] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+      yuv[2 * plane_size + pixel] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+    return (fwrite(yuv.data(), 1, yuv.size(), file) == yuv.size()) ? bytes : 0;
+  }
+
+private:
+  FILE* file;
+  int width;
+  int height;
+  bool gray;
+  bool planar;
+  vector<unsigned char> yuv;
+};
+
+#ifdef USE_LIBAV
+// Frames decoded by libav in this process, scaled and converted by swscale
+// straight into the frame
+class libav_source : public frame_source {
+public:
+  libav_source() : format(nullptr), decoder(nullptr), scaler(nullptr),
+                   packet(av_packet_alloc()), decoded(av_frame_alloc()),
+                   stream(-1), draining(false) {}
+
+  ~libav_source() {
+    sws_freeContext(scaler);
+    av_frame_free(&decoded);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder);
+    avformat_close_input(&format);
+  }
+
+  bool open(const arguments& args) {
+    width = args.width;
+    height = args.height;
+    planar = args.planar;
+    if(avformat_open_input(&format, args.input_file, nullptr, nullptr) != 0) return false;
+    if(avformat_find_stream_info(format, nullptr) < 0) return false;
+    stream = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if(stream < 0) return false;
+    AVCodecParameters* parameters = format->streams[stream]->codecpar;
+    const AVCodec* codec = avcodec_find_decoder(parameters->codec_id);
+    if(!codec) return false;
+    decoder = avcodec_alloc_context3(codec);
+    if(avcodec_parameters_to_context(decoder, parameters) < 0) return false;
+    return avcodec_open2(decoder, codec, nullptr) == 0;
+  }
+
+  // Width, height and number of frames of the opened video
+  tuple<int, int, int> size() const {
+    AVStream* video = format->streams[stream];
+    return make_tuple(video->codecpar->width, video->codecpar->height, (int)video->nb_frames);
+  }
+
+  size_t read(unsigned char* frame, size_t bytes) {
+    while(true) {
+      int result = avcodec_receive_frame(decoder, decoded);
+      if(result == 0) break;
+      if(result != AVERROR(EAGAIN) || draining) return 0;
+      if(av_read_frame(format, packet) < 0) {
+        draining = true;
+        avcodec_send_packet(decoder, nullptr);
+        continue;
+      }
+      if(packet->stream_index == stream) avcodec_send_packet(decoder, packet);
+      av_packet_unref(packet);
+    }
+
+    AVPixelFormat frame_format = (planar) ? AV_PIX_FMT_GBRP : AV_PIX_FMT_RGBA;
+    scaler = sws_getCachedContext(scaler, decoded->width, decoded->height, (AVPixelFormat)decoded->format,
+                                  width, height, frame_format, SWS_BICUBIC, nullptr, nullptr, nullptr);
+    size_t plane_size = (size_t)width * height;
+    uint8_t* planes[4] = {frame, nullptr, nullptr, nullptr};
+    int strides[4] = {width * (int)sizeof(RGBPixel), 0, 0, 0};
+    if(planar) {
+      planes[0] = frame + PLANE_G * plane_size;
+      planes[1] = frame + PLANE_B * plane_size;
+      planes[2] = frame + PLANE_R * plane_size;
+      strides[0] = strides[1] = strides[2] = width;
+    }
+    sws_scale(scaler, decoded->data, decoded->linesize, 0, decoded->height, planes, strides);
+    av_frame_unref(decoded);
+    return bytes;
+  }
+
+private:
+  AVFormatContext* format;
+  AVCodecContext* decoder;
+  SwsContext* scaler;
+  AVPacket* packet;
+  AVFrame* decoded;
+  int stream;
+  bool draining;
+  int width;
+  int height;
+  bool planar;
+};
+#endif
+
+}  // anonymous namespace
+
+bool in_process_video(const char* path) {
+  return has_extension(path, ".y4m") || raw_video(path);
+}
+
+tuple<int, int, int> probe_video_size(const arguments& args) {
+  if(raw_video(args.input_file)) {
+    if(args.width <= 0 || args.height <= 0) {
+      printf("\nError: raw video %s needs its size, given with --scale WIDTH HEIGHT\n", args.input_file);
+      return make_tuple(0, 0, 0);
+    }
+    FILE* file = fopen(args.input_file, "rb");
+    if(!file) return make_tuple(0, 0, 0);
+    int frames = file_size(file) / get_frame_bytes(args);
+    fclose(file);
+    return make_tuple(args.width, args.height, frames);
+  }
+
+  if(has_extension(args.input_file, ".y4m")) {
+    FILE* file = fopen(args.input_file, "rb");
+    if(!file) return make_tuple(0, 0, 0);
+    y4m_header header;
+    int frames = 0;
+    if(read_y4m_header(file, header)) {
+      // Counts frames with no parameters after FRAME
+      frames = (file_size(file) - header.header_bytes) / (strlen("FRAME\n") + header.frame_bytes());
+    }
+    fclose(file);
+    return make_tuple(header.width, header.height, frames);
+  }
+
+#ifdef USE_LIBAV
+  libav_source source;
+  if(source.open(args)) return source.size();
+#endif
+  return make_tuple(0, 0, 0);
+}
+
+unique_ptr<frame_source> open_ffmpeg_source(const arguments& args) {
+  // Raw frames have no header to tell ffmpeg their format
+  char raw_format[256] = "";
+  if(raw_video(args.input_file)) {
+    snprintf(raw_format, sizeof(raw_format), "-f rawvideo -pix_fmt %s -s %dx%d ",
+             (args.planar) ? "gbrp" : "rgba", args.in_width, args.in_height);
+  }
+
+  char command[2048];
+  snprintf(command, sizeof(command),
+           "ffmpeg -v error -hide_banner %s-i %s -f image2pipe -vcodec rawvideo -vf scale=w=%d:h=%d -vframes %d -pix_fmt %s -",
+           raw_format, args.input_file, args.width, args.height, args.nframes, (args.planar) ? "gbrp" : "rgba");
+  if(args.verbose) printf("IN COMMAND:  %s\n", command);
+
+  FILE* stream = popen(command, "r");
+  if(!stream) return nullptr;
+  return unique_ptr<frame_source>(new stream_source(stream, pclose));
+}
+
+unique_ptr<frame_source> open_frame_source(const arguments& args) {
+  if(in_process_video(args.input_file)) {
+    if(args.width != args.in_width || args.height != args.in_height) {
+      printf("\nError: %s is read in process and cannot be scaled\n", args.input_file);
+      return nullptr;
+    }
+    FILE* file = fopen(args.input_file, "rb");
+    if(!file) return nullptr;
+
+    if(raw_video(args.input_file)) {
+      if(!has_extension(args.input_file, raw_extension(args, false))) {
+        fclose(file);
+        printf("\nError: %s frames are read from %s files\n",
+               (args.planar) ? "planar" : "RGBA", raw_extension(args, false));
+        return nullptr;
+      }
+      if(args.verbose) printf("IN FILE:  %s, raw frames\n", args.input_file);
+      return unique_ptr<frame_source>(new stream_source(file, fclose));
+    }
+
+    y4m_header header;
+    if(!read_y4m_header(file, header)) {
+      fclose(file);
+      return nullptr;
+    }
+    if(args.verbose) printf("IN FILE:  %s, Y4M frames\n", args.input_file);
+    return unique_ptr<frame_source>(new y4m_source(file, header, args.planar));
+  }
+
+#ifdef USE_LIBAV
+  libav_source* source = new libav_source();
+  unique_ptr<frame_source> owner(source);
+  if(source->open(args)) {
+    if(args.verbose) printf("IN FILE:  %s, decoded by libav\n", args.input_file);
+    return owner;
+  }
+#endif
+  return open_ffmpeg_source(args);
+}
+
+unique_ptr<frame_sink> open_frame_sink(const arguments& args) {
+  if(in_process_video(args.output_file)) {
+    if(raw_video(args.output_file) && !has_extension(args.output_file, raw_extension(args, true))) {
+      printf("\nError: %s frames are written to %s files\n",
+             (args.gray) ? "gray" : (args.planar) ? "planar" : "RGBA", raw_extension(args, true));
+      return nullptr;
+    }
+    FILE* file = fopen(args.output_file, "wb");
+    if(!file) return nullptr;
+
+    if(raw_video(args.output_file)) {
+      if(args.verbose) printf("OUT FILE: %s, raw frames\n", args.output_file);
+      return unique_ptr<frame_sink>(new stream_sink(file, fclose));
+    }
+    if(args.verbose) printf("OUT FILE: %s, Y4M frames\n", args.output_file);
+    return unique_ptr<frame_sink>(new y4m_sink(file, args.width, args.height, args.gray, args.planar));
+  }
+
+  char command[2048];
+  snprintf(command, sizeof(command),
+           "ffmpeg -v error -hide_banner -y -f rawvideo -vcodec rawvideo -pix_fmt %s -s %dx%d -framerate 25 -i - -f mp4 -q:v 5 -an -codec mpeg4 %s",
+           (args.gray) ? "gray" : (args.planar) ? "gbrp" : "rgba", args.width, args.height, args.output_file);
+  if(args.verbose) printf("OUT COMMAND: %s\n", command);
+
+  FILE* stream = popen(command, "w");
+  if(!stream) return nullptr;
+  return unique_ptr<frame_sink>(new stream_sink(stream, pclose));
+}
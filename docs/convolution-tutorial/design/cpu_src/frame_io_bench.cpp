@@ -0,0 +1,54 @@
+#include "common.h"
+#include "frame_io.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::unique_ptr;
+using std::vector;
+
+// Measures how fast frames of a video reach convolve, with the frame source of
+// the application (in process for .y4m and raw files, libav when built with
+// LIBAV=1) and with the ffmpeg pipe. Takes the same arguments as convolve:
+//
+//   ./frame_io_bench [--planar] [--scale WIDTH HEIGHT] [--nframes NUM] INPUT
+
+namespace {
+
+void measure(const char* name, frame_source* source, size_t frame_bytes, int nframes) {
+    if(!source) {
+        printf("%-14s cannot open the input\n", name);
+        return;
+    }
+    vector<unsigned char> frame(frame_bytes);
+    int frames = 0;
+    auto start = steady_clock::now();
+    while(frames < nframes && source->read(frame.data(), frame_bytes) == frame_bytes) {
+        frames++;
+    }
+    double seconds = duration<double>(steady_clock::now() - start).count();
+    if(seconds <= 0) seconds = 1e-9;
+    printf("%-14s %d frames in %.3f s: %.1f fps, %.1f MB/s\n", name, frames, seconds,
+           frames / seconds, frames * frame_bytes / seconds / (1024.0 * 1024.0));
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    arguments opt = parse_args(argc, argv);
+    size_t frame_bytes = get_frame_bytes(opt);
+
+    unique_ptr<frame_source> source = open_frame_source(opt);
+    measure("frame source:", source.get(), frame_bytes, opt.nframes);
+    source.reset();
+
+    source = open_ffmpeg_source(opt);
+    measure("ffmpeg pipe:", source.get(), frame_bytes, opt.nframes);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+#include "frame_pipeline.h"
+#include "common.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::deque;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace {
+
+const size_t buffer_alignment = 4096;
+
+// Blocking queue of ring slots passed from one stage to the next
+class slot_queue {
+public:
+    slot_queue() : closed(false) {}
+
+    void push(int slot) {
+        unique_lock<mutex> lock(m);
+        slots.push_back(slot);
+        cv.notify_one();
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(int& slot) {
+        unique_lock<mutex> lock(m);
+        while(slots.empty() && !closed) cv.wait(lock);
+        if(slots.empty()) return false;
+        slot = slots.front();
+        slots.pop_front();
+        return true;
+    }
+
+    // No more slots will be pushed
+    void close() {
+        unique_lock<mutex> lock(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+    deque<int> slots;
+    bool closed;
+};
+
+unsigned char* aligned_frame(size_t bytes) {
+    void* ptr = nullptr;
+    if(posix_memalign(&ptr, buffer_alignment, bytes ? bytes : 1)) {
+        printf("\nError: cannot allocate a %zu byte frame buffer\n", bytes);
+        exit(EXIT_FAILURE);
+    }
+    return static_cast<unsigned char*>(ptr);
+}
+
+double seconds_since(steady_clock::time_point start) {
+    return duration<double>(steady_clock::now() - start).count();
+}
+
+}  // anonymous namespace
+
+pipeline_stats run_pipeline(frame_source& source, frame_sink& sink,
+                            size_t in_bytes, size_t out_bytes,
+                            int nframes, int depth, const frame_function& process) {
+    if(depth < 1) depth = 1;
+    vector<unsigned char*> in(depth), out(depth);
+    for(int slot = 0; slot < depth; slot++) {
+        in[slot] = aligned_frame(in_bytes);
+        out[slot] = aligned_frame(out_bytes);
+    }
+
+    pipeline_stats stats = run_pipeline(source, sink, in_bytes, out_bytes, nframes,
+                                        in, out, process);
+
+    for(int slot = 0; slot < depth; slot++) {
+        free(in[slot]);
+        free(out[slot]);
+    }
+    return stats;
+}
+
+pipeline_stats run_pipeline(frame_source& source, frame_sink& sink,
+                            size_t in_bytes, size_t out_bytes, int nframes,
+                            const vector<unsigned char*>& in,
+                            const vector<unsigned char*>& out,
+                            const frame_function& process) {
+    int depth = in.size();
+    vector<int> frame_of(depth);
+    slot_queue free_slots, read_slots, processed_slots;
+    for(int slot = 0; slot < depth; slot++) {
+        free_slots.push(slot);
+    }
+
+    pipeline_stats stats = {0, 0, 0, 0, 0};
+    atomic<bool> failed(false);
+    auto begin = steady_clock::now();
+
+    thread input([&]() {
+        int slot;
+        for(int frame = 0; frame < nframes && !failed && free_slots.pop(slot); frame++) {
+            auto start = steady_clock::now();
+            size_t bytes_read = source.read(in[slot], in_bytes);
+            stats.read_seconds += seconds_since(start);
+            if(bytes_read != in_bytes) {
+                printf("\nError: partial frame.\nExpected %zu\nActual %zu\n", in_bytes, bytes_read);
+                break;
+            }
+            frame_of[slot] = frame;
+            read_slots.push(slot);
+        }
+        read_slots.close();
+    });
+
+    thread output([&]() {
+        int slot;
+        while(processed_slots.pop(slot)) {
+            if(!failed) {
+                auto start = steady_clock::now();
+                size_t bytes_written = sink.write(out[slot], out_bytes);
+                stats.write_seconds += seconds_since(start);
+                if(bytes_written != out_bytes) {
+                    printf("\nError: partial frame.\nExpected %zu\nActual %zu\n", out_bytes, bytes_written);
+                    failed = true;
+                    free_slots.close();
+                } else {
+                    stats.frames++;
+                    print_progress(frame_of[slot], nframes);
+                }
+            }
+            free_slots.push(slot);
+        }
+    });
+
+    int slot;
+    while(read_slots.pop(slot)) {
+        auto start = steady_clock::now();
+        process(in[slot], out[slot], frame_of[slot]);
+        stats.process_seconds += seconds_since(start);
+        processed_slots.push(slot);
+    }
+    processed_slots.close();
+
+    input.join();
+    output.join();
+    stats.seconds = seconds_since(begin);
+    return stats;
+}
+
+void print_pipeline_stats(const pipeline_stats& stats) {
+    double seconds = (stats.seconds > 0) ? stats.seconds : 1;
+    printf("\nPipeline: %d frames in %.3f s (%.2f fps), stage occupancy: read %.0f%%, process %.0f%%, write %.0f%%\n",
+           stats.frames, stats.seconds, stats.frames / seconds,
+           100 * stats.read_seconds / seconds,
+           100 * stats.process_seconds / seconds,
+           100 * stats.write_seconds / seconds);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <functional>
+#include <vector>
+
+#include "frame_io.h"
+
+// Time each stage of run_pipeline spent working, out of the whole run
+struct pipeline_stats {
+  int frames;
+  double seconds;
+  double read_seconds;
+  double process_seconds;
+  double write_seconds;
+};
+
+// Processes a frame: reads in_bytes from in and writes out_bytes to out
+typedef std::function<void(const unsigned char* in, unsigned char* out, int frame)> frame_function;
+
+// Runs the frame loop as three stages: an input thread reading frames from
+// source, process on the calling thread, and an output thread writing the
+// processed frames to sink. The stages work on different frames of a
+// ring of depth page aligned buffers, so with depth 3 frame N + 2 is read
+// while frame N + 1 is processed and frame N is written.
+pipeline_stats run_pipeline(frame_source& source, frame_sink& sink,
+                            size_t in_bytes, size_t out_bytes,
+                            int nframes, int depth, const frame_function& process);
+
+// run_pipeline on a ring of given buffers instead of buffers it allocates:
+// in[slot] and out[slot] hold in_bytes and out_bytes, and frames are read and
+// written in place, so process can use buffers mapped from the device
+pipeline_stats run_pipeline(frame_source& source, frame_sink& sink,
+                            size_t in_bytes, size_t out_bytes, int nframes,
+                            const std::vector<unsigned char*>& in,
+                            const std::vector<unsigned char*>& out,
+                            const frame_function& process);
+
+// Prints the frame rate and how busy each stage was
+void print_pipeline_stats(const pipeline_stats& stats);
@@ -17,4 +17,16 @@ void grayscale_cpu(const RGBPixel* inFrame, GrayPixel* outFrame, int img_height,
     }
 }
 
+void grayscale_cpu_planar(const unsigned char* inFrame, GrayPixel* outFrame, int img_height, int img_width)
+{
+    int plane_size = img_height * img_width;
+    for (int pixel = 0; pixel < plane_size; ++pixel)
+    {
+        GrayPixel gray = (inFrame[PLANE_R * plane_size + pixel] * 0.30) + //red
+                         (inFrame[PLANE_G * plane_size + pixel] * 0.59) + // green
+                         (inFrame[PLANE_B * plane_size + pixel] * 0.11);  // blue
+        outFrame[pixel] = gray;
+    }
+}
+
 }
@@ -4,8 +4,24 @@
 extern "C" {
   // Convolve RGB video frame with input filter
   void convolve_cpu(const RGBPixel* inFrame, RGBPixel* outFrame, const float* filter, int filter_size, int img_width, int img_height);
+  // Same result as convolve_cpu, line buffered and split in bands of lines across num_threads threads
+  void convolve_cpu_parallel(const RGBPixel* inFrame, RGBPixel* outFrame, const float* filter, int filter_size, int img_width, int img_height, int num_threads);
+  // convolve_cpu_parallel for a separable filter, as a horizontal pass with row and a vertical pass with column
+  void convolve_cpu_separable(const RGBPixel* inFrame, RGBPixel* outFrame, const float* column, const float* row, int filter_size, int img_width, int img_height, int num_threads);
+  // convolve_cpu_parallel and convolve_cpu_separable for planar video frames
+  void convolve_cpu_planar_parallel(const unsigned char* inFrame, unsigned char* outFrame, const float* filter, int filter_size, int img_width, int img_height, int num_threads);
+  void convolve_cpu_planar_separable(const unsigned char* inFrame, unsigned char* outFrame, const float* column, const float* row, int filter_size, int img_width, int img_height, int num_threads);
+  // convolve_cpu_parallel and convolve_cpu_separable followed by grayscale_cpu in one pass, the convolved frame is never stored
+  void convolve_grayscale_cpu_parallel(const unsigned char* inFrame, GrayPixel* outFrame, bool planar, const float* filter, int filter_size, int img_width, int img_height, int num_threads);
+  void convolve_grayscale_cpu_separable(const unsigned char* inFrame, GrayPixel* outFrame, bool planar, const float* column, const float* row, int filter_size, int img_width, int img_height, int num_threads);
+  // Returns true if filter is separable, with the column and row vectors it is the product of
+  bool separable_filter(const float* filter, int filter_size, float* column, float* row);
   // Convert RGB video frame to grayscale
   void grayscale_cpu(const RGBPixel* inFrame, GrayPixel* outFrame, int img_width, int img_height);
+  // Convolve planar video frame with input filter
+  void convolve_cpu_planar(const unsigned char* inFrame, unsigned char* outFrame, const float* filter, int filter_size, int img_width, int img_height);
+  // Convert planar video frame to grayscale
+  void grayscale_cpu_planar(const unsigned char* inFrame, GrayPixel* outFrame, int img_width, int img_height);
 
   // Convolve RGB video frame with input filter
   void convolve_fpga(const RGBPixel* inFrame, RGBPixel* outFrame, const float* filter, int filter_size, int img_width, int img_height);
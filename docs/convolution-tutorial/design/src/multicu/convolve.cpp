@@ -1,15 +1,51 @@
 
 #include "common.h"
 #include "constants.h"
+#include "frame_io.h"
+#include "frame_pipeline.h"
 #include "kernels.h"
 
+#include <algorithm>
 #include <vector>
 #include <cstdio>
+#include <string>
 
 #include "xcl2.hpp"
 
+using std::string;
 using std::vector;
 
+// Frames in flight in pipelined mode: one read, one on the device, one written
+const int pipeline_depth = 3;
+
+// Lines of a frame convolved by one compute unit. The compute unit convolves
+// the band with halo lines above and below it as a frame of its own, and the
+// host keeps the output lines of the band. The halo lines are the neighbours
+// the filter needs, so the bands stitch into the same frame as a single task.
+struct frame_band {
+    int first_line;   // First output line of the band
+    int num_lines;    // Output lines of the band
+    int halo_top;     // Input lines above the band
+    int input_lines;  // Lines sent to the compute unit, halos included
+};
+
+// Splits img_height lines in num_bands bands, with half halo lines at the
+// sides that are not a border of the frame
+vector<frame_band> split_bands(int img_height, int num_bands, int half) {
+    vector<frame_band> bands(num_bands);
+    for(int b = 0; b < num_bands; b++) {
+        int first_line = (long)img_height * b / num_bands;
+        int last_line = (long)img_height * (b + 1) / num_bands;
+        int first_input = std::max(0, first_line - half);
+        int last_input = std::min(img_height, last_line + half);
+        bands[b].first_line = first_line;
+        bands[b].num_lines = last_line - first_line;
+        bands[b].halo_top = first_line - first_input;
+        bands[b].input_lines = last_input - first_input;
+    }
+    return bands;
+}
+
 bool operator==(const RGBPixel& lhs, const RGBPixel& rhs) {
     return lhs.r == rhs.r &&
            lhs.g == rhs.g &&
@@ -29,95 +65,289 @@ test(vector<RGBPixel>& in, vector<RGBPixel>& out,
     }
 }
 
-void convolve(FILE* streamIn, FILE* streamOut,
+void convolve(frame_source& source, frame_sink& sink,
               float* coefficients, int coefficient_size,
               arguments args) {
-    size_t frame_bytes = args.width * args.height * sizeof(RGBPixel);
+    size_t frame_bytes = get_frame_bytes(args);
     size_t gray_frame_bytes = args.width * args.height * sizeof(GrayPixel);
     vector<RGBPixel> inFrame(args.width * args.height);
     vector<RGBPixel> outFrame(args.width * args.height);
     vector<GrayPixel> grayFrame(args.width * args.height);
 
+    // Frame bytes as read and written, planar frames use the first PLANES
+    // bytes per pixel of the buffers
+    unsigned char* inData = &inFrame[0].r;
+    unsigned char* outData = &outFrame[0].r;
+
     size_t bytes_read = 0;
     size_t bytes_written = 0;
 
 
     size_t total_coefficient_size = coefficient_size * coefficient_size;
     vector<float, aligned_allocator<float>> filter_coeff(coefficients, coefficients + total_coefficient_size);
-    size_t coefficient_size_bytes = sizeof(float) * total_coefficient_size;
+
+    // The separable kernel takes the column and row vectors of the filter, and
+    // filters that are not separable fall back to the 2D convolve_fpga kernel.
+    // Grayscale RGBA frames run convolve_grayscale_fpga, which converts the
+    // convolved pixels on the device and returns 1 byte per pixel. Planar and
+    // grayscale frames only have a 2D kernel, so they override -k.
+    string kernel_name = args.kernel_name;
+    if(args.planar || args.gray) {
+        string frame_kernel = (args.planar) ? "convolve_planar_fpga" : "convolve_grayscale_fpga";
+        if(!kernel_name.empty() && kernel_name != "convolve_fpga" && kernel_name != frame_kernel) {
+            printf("Note: %s runs %s instead of %s\n", (args.planar) ? "--planar" : "--gray",
+                   frame_kernel.c_str(), kernel_name.c_str());
+        }
+        kernel_name = frame_kernel;
+    } else if(kernel_name == "convolve_separable_fpga") {
+        vector<float> column(coefficient_size), row(coefficient_size);
+        if(separable_filter(coefficients, coefficient_size, column.data(), row.data())) {
+            filter_coeff.assign(column.begin(), column.end());
+            filter_coeff.insert(filter_coeff.end(), row.begin(), row.end());
+        } else {
+            printf("Filter is not separable, running convolve_fpga\n");
+            kernel_name = "convolve_fpga";
+        }
+    }
+    size_t coefficient_size_bytes = sizeof(float) * filter_coeff.size();
+
+    // Frames the device returns, and how the host makes them gray otherwise
+    bool device_gray = (kernel_name == "convolve_grayscale_fpga");
+    size_t out_frame_bytes = (device_gray) ? gray_frame_bytes : frame_bytes;
+    auto to_gray = [&](const unsigned char* frame, GrayPixel* gray) {
+        if(args.planar) {
+            grayscale_cpu_planar(frame, gray, args.width, args.height);
+        } else {
+            grayscale_cpu(reinterpret_cast<const RGBPixel*>(frame), gray, args.width, args.height);
+        }
+    };
 
 
     vector<cl::Device> devices = xcl::get_xil_devices();
     cl::Device device = devices[0];
 
 
+    // With several compute units, each frame is split in bands of lines, one
+    // per compute unit, and the bands run out of order on the same queue
+    int compute_units = std::max(1, std::min(args.ncompute_units, args.height));
+    vector<frame_band> bands = split_bands(args.height, compute_units, coefficient_size / 2);
+    int planes = (args.planar) ? PLANES : 1;
+    size_t plane_bytes = frame_bytes / planes;
+    size_t line_bytes = plane_bytes / args.height;
+    int out_planes = (device_gray) ? 1 : planes;
+    size_t out_line_bytes = out_frame_bytes / out_planes / args.height;
+    cl_command_queue_properties queue_properties = CL_QUEUE_PROFILING_ENABLE;
+    if(compute_units > 1) {
+        queue_properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    }
+
     cl::Context context(device);
-    cl::CommandQueue q(context, device, CL_QUEUE_PROFILING_ENABLE);
+    cl::CommandQueue q(context, device, queue_properties);
 
 
     cl::Program::Binaries bins = xcl::import_binary_file(args.binary_file);
     devices.resize(1);
     cl::Program program(context, devices, bins);
-    cl::Kernel convolve_kernel(program, args.kernel_name);
+    cl::Buffer buffer_coefficient(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, coefficient_size_bytes, filter_coeff.data());
 
+    // One compute unit convolves whole frames
+    cl::Kernel convolve_kernel;
+    cl::Buffer buffer_input, buffer_output;
+    if(compute_units == 1) {
+        convolve_kernel = cl::Kernel(program, kernel_name.c_str());
+        buffer_input = cl::Buffer(context, CL_MEM_READ_ONLY, frame_bytes, NULL);
+        buffer_output = cl::Buffer(context, CL_MEM_WRITE_ONLY, out_frame_bytes, NULL);
 
-    cl::Buffer buffer_input(context, CL_MEM_READ_ONLY, frame_bytes, NULL);
-    cl::Buffer buffer_output(context, CL_MEM_WRITE_ONLY, frame_bytes, NULL);
-    cl::Buffer buffer_coefficient(context, CL_MEM_USE_HOST_PTR | CL_MEM_READ_ONLY, coefficient_size_bytes, filter_coeff.data());
+        convolve_kernel.setArg(0, buffer_input);
+        convolve_kernel.setArg(1, buffer_output);
+        convolve_kernel.setArg(2, buffer_coefficient);
+        convolve_kernel.setArg(3, coefficient_size);
+        convolve_kernel.setArg(4, args.width);
+        convolve_kernel.setArg(5, args.height);
+    }
 
+    // Each band has its own buffers and kernel object, so the tasks of a frame
+    // can run at the same time on different compute units
+    vector<cl::Buffer> band_inputs, band_outputs;
+    vector<cl::Kernel> band_kernels;
+    if(compute_units > 1) {
+        for(size_t cu = 0; cu < bands.size(); cu++) {
+            size_t band_bytes = planes * bands[cu].input_lines * line_bytes;
+            size_t band_out_bytes = out_planes * bands[cu].input_lines * out_line_bytes;
+            band_inputs.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, band_bytes, NULL));
+            band_outputs.push_back(cl::Buffer(context, CL_MEM_WRITE_ONLY, band_out_bytes, NULL));
+            band_kernels.push_back(cl::Kernel(program, kernel_name.c_str()));
+            band_kernels[cu].setArg(0, band_inputs[cu]);
+            band_kernels[cu].setArg(1, band_outputs[cu]);
+            band_kernels[cu].setArg(2, buffer_coefficient);
+            band_kernels[cu].setArg(3, coefficient_size);
+            band_kernels[cu].setArg(4, args.width);
+            band_kernels[cu].setArg(5, bands[cu].input_lines);
+        }
+        if(args.verbose) {
+            printf("Compute units: %d, bands of %d lines with %d halo lines on each inner side\n",
+                   compute_units, bands[0].num_lines, coefficient_size / 2);
+        }
+    }
 
-    convolve_kernel.setArg(0, buffer_input);
-    convolve_kernel.setArg(1, buffer_output);
-    convolve_kernel.setArg(2, buffer_coefficient);
-    convolve_kernel.setArg(3, coefficient_size);
-    convolve_kernel.setArg(4, args.width);
-    convolve_kernel.setArg(5, args.height);
+    // The queue is out of order with several compute units, so the first
+    // tasks wait for the coefficients explicitly
+    cl::Event coefficient_event;
+    q.enqueueMigrateMemObjects({buffer_coefficient}, 0, nullptr, &coefficient_event);
 
-    q.enqueueMigrateMemObjects({buffer_coefficient}, 0);
+    // Convolves a frame on the device. The bands of a frame wait for their own
+    // input only, and the output lines of each band are read back in place.
+    auto run_frame = [&](const unsigned char* in, unsigned char* out) {
+        if(compute_units == 1) {
+            q.enqueueWriteBuffer(buffer_input, CL_FALSE, 0, frame_bytes, in);
+            q.enqueueTask(convolve_kernel);
+            q.enqueueReadBuffer(buffer_output, CL_TRUE, 0, out_frame_bytes, out);
+            return;
+        }
+        vector<cl::Event> read_events;
+        for(size_t cu = 0; cu < bands.size(); cu++) {
+            const frame_band& band = bands[cu];
+            size_t band_plane_bytes = band.input_lines * line_bytes;
+            size_t band_out_plane_bytes = band.input_lines * out_line_bytes;
+            size_t first_input = band.first_line - band.halo_top;
 
+            vector<cl::Event> write_events(planes);
+            for(int p = 0; p < planes; p++) {
+                q.enqueueWriteBuffer(band_inputs[cu], CL_FALSE, p * band_plane_bytes, band_plane_bytes,
+                                     in + p * plane_bytes + first_input * line_bytes,
+                                     nullptr, &write_events[p]);
+            }
+            write_events.push_back(coefficient_event);
 
-    auto fpga_begin = std::chrono::high_resolution_clock::now();
+            vector<cl::Event> task_events(1);
+            q.enqueueTask(band_kernels[cu], &write_events, &task_events[0]);
 
-    for(int frame_count = 0; frame_count < args.nframes; frame_count++) {
-        // Read frame
-        bytes_read = fread(inFrame.data(), 1, frame_bytes, streamIn);
-        if(bytes_read != frame_bytes) {
-        	printf("\nError: partial frame.\nExpected %zu\nActual %zu\n", frame_bytes, bytes_read);
-        	break;
+            for(int p = 0; p < out_planes; p++) {
+                cl::Event read_event;
+                q.enqueueReadBuffer(band_outputs[cu], CL_FALSE,
+                                    p * band_out_plane_bytes + band.halo_top * out_line_bytes,
+                                    band.num_lines * out_line_bytes,
+                                    out + p * (out_frame_bytes / out_planes) + band.first_line * out_line_bytes,
+                                    &task_events, &read_event);
+                read_events.push_back(read_event);
+            }
         }
+        cl::WaitForEvents(read_events);
+    };
+
+
+    auto fpga_begin = std::chrono::high_resolution_clock::now();
+
+    if(args.zerocopy && compute_units > 1) {
+      printf("Zero-copy frames run on one compute unit, copying the bands instead\n");
+    }
+
+    if(args.zerocopy && compute_units == 1) {
+      // Pool of frame buffers allocated by the runtime and mapped once. Frames
+      // are read into the mapped input and written from the mapped output, and
+      // only migrate to and from the device, with no copies on the host.
+      // Without --pipeline the pool is one buffer pair used frame after frame.
+      int pool_size = (args.pipeline) ? pipeline_depth : 1;
+      vector<cl::Buffer> pool_input, pool_output;
+      vector<unsigned char*> mapped_input, mapped_output;
+      for(int slot = 0; slot < pool_size; slot++) {
+        pool_input.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, frame_bytes, NULL));
+        pool_output.push_back(cl::Buffer(context, CL_MEM_WRITE_ONLY, out_frame_bytes, NULL));
+        mapped_input.push_back(static_cast<unsigned char*>(
+            q.enqueueMapBuffer(pool_input[slot], CL_TRUE, CL_MAP_WRITE, 0, frame_bytes)));
+        mapped_output.push_back(static_cast<unsigned char*>(
+            q.enqueueMapBuffer(pool_output[slot], CL_TRUE, CL_MAP_READ, 0, out_frame_bytes)));
+      }
 
-        /*
-        convolve_cpu(inFrame.data(), outFrame.data(),
-                     coefficients, coefficient_size,
-                     args.width, args.height);
-        */
+      // Frames the host makes gray are converted from the mapped output into a
+      // ring of their own
+      bool host_gray = args.gray && !device_gray;
+      vector<GrayPixel> gray_frames(host_gray ? pool_size * gray_frame_bytes : 0);
+      vector<unsigned char*> gray_output;
+      for(int slot = 0; host_gray && slot < pool_size; slot++) {
+        gray_output.push_back(&gray_frames[slot * gray_frame_bytes]);
+      }
 
-        q.enqueueWriteBuffer(buffer_input, CL_FALSE, 0, frame_bytes, inFrame.data());
+      size_t out_bytes = (args.gray) ? gray_frame_bytes : frame_bytes;
+      pipeline_stats stats = run_pipeline(source, sink, frame_bytes, out_bytes, args.nframes,
+                                          mapped_input, (host_gray) ? gray_output : mapped_output,
+                                          [&](const unsigned char* in, unsigned char* out, int) {
+        int slot = std::find(mapped_input.begin(), mapped_input.end(), in) - mapped_input.begin();
+        convolve_kernel.setArg(0, pool_input[slot]);
+        convolve_kernel.setArg(1, pool_output[slot]);
+        q.enqueueMigrateMemObjects({pool_input[slot]}, 0);
         q.enqueueTask(convolve_kernel);
-        q.enqueueReadBuffer(buffer_output, CL_TRUE, 0, frame_bytes, outFrame.data());
+        q.enqueueMigrateMemObjects({pool_output[slot]}, CL_MIGRATE_MEM_OBJECT_HOST);
+        q.finish();
+        if(host_gray) {
+          to_gray(mapped_output[slot], out);
+        }
+      });
+      if(args.verbose && args.pipeline) print_pipeline_stats(stats);
+
+      for(int slot = 0; slot < pool_size; slot++) {
+        q.enqueueUnmapMemObject(pool_input[slot], mapped_input[slot]);
+        q.enqueueUnmapMemObject(pool_output[slot], mapped_output[slot]);
+      }
+    } else if(args.pipeline) {
+      // The device works on one frame while the input thread reads the next one
+      // and the output thread writes the previous one
+      size_t out_bytes = (args.gray) ? gray_frame_bytes : frame_bytes;
+      pipeline_stats stats = run_pipeline(source, sink, frame_bytes, out_bytes,
+                                          args.nframes, pipeline_depth,
+                                          [&](const unsigned char* in, unsigned char* out, int) {
+        if(args.gray && !device_gray) {
+          run_frame(in, outData);
+          to_gray(outData, out);
+        } else {
+          run_frame(in, out);
+        }
+      });
+      if(args.verbose) print_pipeline_stats(stats);
+    } else {
+      for(int frame_count = 0; frame_count < args.nframes; frame_count++) {
+          // Read frame
+          bytes_read = source.read(inData, frame_bytes);
+          if(bytes_read != frame_bytes) {
+          	printf("\nError: partial frame.\nExpected %zu\nActual %zu\n", frame_bytes, bytes_read);
+          	break;
+          }
 
+          /*
+          convolve_cpu(inFrame.data(), outFrame.data(),
+                       coefficients, coefficient_size,
+                       args.width, args.height);
+          */
 
-        if(args.gray) {
-          grayscale_cpu(outFrame.data(), grayFrame.data(), args.width, args.height);
-          bytes_written = fwrite(outFrame.data(), 1, gray_frame_bytes, streamOut);
-          fflush(streamOut);
-          if (bytes_written != gray_frame_bytes) {
-            printf("\nError: partial frame.\nExpected %zu\nActual %zu\n",
-                   gray_frame_bytes, bytes_written);
-            break;
+          if(device_gray) {
+            run_frame(inData, grayFrame.data());
+          } else {
+            run_frame(inData, outData);
           }
-        } else {
-          bytes_written = fwrite(outFrame.data(), 1, frame_bytes, streamOut);
-          fflush(streamOut);
-          if (bytes_written != frame_bytes) {
-            printf("\nError: partial frame.\nExpected %zu\nActual %zu\n",
-                   frame_bytes, bytes_written);
-            break;
+
+
+          if(args.gray) {
+            if(!device_gray) {
+              to_gray(outData, grayFrame.data());
+            }
+            bytes_written = sink.write(grayFrame.data(), gray_frame_bytes);
+            if (bytes_written != gray_frame_bytes) {
+              printf("\nError: partial frame.\nExpected %zu\nActual %zu\n",
+                     gray_frame_bytes, bytes_written);
+              break;
+            }
+          } else {
+            bytes_written = sink.write(outData, frame_bytes);
+            if (bytes_written != frame_bytes) {
+              printf("\nError: partial frame.\nExpected %zu\nActual %zu\n",
+                     frame_bytes, bytes_written);
+              break;
+            }
+            // test(inFrame, outFrame, coefficients, coefficient_size, width, height);
           }
-          // test(inFrame, outFrame, coefficients, coefficient_size, width, height);
-        }
 
-        print_progress(frame_count, args.nframes);
+          print_progress(frame_count, args.nframes);
+      }
     }
     q.finish();
 
@@ -131,5 +361,7 @@ void convolve(FILE* streamIn, FILE* streamOut,
         std::cout << "FPGA Throughput: "
                   << (1920*1080*4*132) / fpga_duration.count() / (1024.0*1024.0)
                   << " MB/s" << std::endl;
+        std::cout << "Bytes per frame: " << frame_bytes << " to and " << out_frame_bytes
+                  << " from the device (RGBA: " << args.width * args.height * sizeof(RGBPixel) << ")" << std::endl;
      }
 }
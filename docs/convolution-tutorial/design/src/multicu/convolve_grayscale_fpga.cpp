@@ -0,0 +1,68 @@
+#include "constants.h"
+#include "kernels.h"
+#include "types.h"
+#include "convolve_window.h"
+
+// The grayscale weights 0.30, 0.59 and 0.11 with 15 fraction bits. Truncated
+// they sum to 32767/32768 and darken most gray levels (r = g = b) by one, so
+// 0.11, which loses the most, is rounded up and the weights sum to exactly 1.
+typedef ap_fixed<24,9> gray_fixed;
+
+// convolve_fpga followed by the grayscale conversion of grayscale_cpu in one
+// dataflow. The convolved pixels stream straight into the grayscale stage, so
+// the RGBA output frame never goes to global memory and the kernel writes 1
+// byte per pixel instead of 4.
+extern "C"
+{
+
+  static void gray_convert_dataflow(hls::stream<GrayPixel>& write_stream, hls::stream<RGBPixel>& convolved_stream,
+                                    int elements) {
+      RGBPixel pix_rgb;
+      GrayPixel pix_gray;
+
+      gray_fixed cr(9830.0 / 32768);
+      gray_fixed cg(19333.0 / 32768);
+      gray_fixed cb(3605.0 / 32768);
+
+      while(elements--) {
+          convolved_stream >> pix_rgb;
+
+          gray_fixed sum = (pix_rgb.r * cr) + //red
+                      (pix_rgb.g * cg) + // green
+                      (pix_rgb.b * cb);  // blue
+          pix_gray = sum.to_int();
+
+          write_stream << pix_gray;
+      }
+  }
+
+  void convolve_grayscale_fpga(const RGBPixel* inFrame, GrayPixel* outFrame,
+                               const float* coefficient, int coefficient_size,
+                               int img_width, int img_height)
+  {
+#pragma HLS INTERFACE s_axilite port=return bundle=control
+#pragma HLS INTERFACE s_axilite port=inFrame bundle=control
+#pragma HLS INTERFACE s_axilite port=outFrame bundle=control
+#pragma HLS INTERFACE s_axilite port=img_height bundle=control
+#pragma HLS INTERFACE s_axilite port=img_width bundle=control
+#pragma HLS INTERFACE s_axilite port=coefficient bundle=control
+#pragma HLS INTERFACE s_axilite port=coefficient_size bundle=control
+#pragma HLS INTERFACE m_axi port=inFrame bundle=gmem1
+#pragma HLS INTERFACE m_axi port=outFrame bundle=gmem2
+#pragma HLS INTERFACE m_axi port=coefficient bundle=gmem3
+#pragma HLS data_pack variable=inFrame
+
+    int half = COEFFICIENT_SIZE / 2;
+
+    hls::stream<RGBPixel> read_stream("read");
+    hls::stream<RGBPixel> convolved_stream("convolved");
+    hls::stream<GrayPixel> write_stream("write");
+    int elements = img_width * img_height;
+
+#pragma HLS dataflow
+    read_dataflow(read_stream, inFrame, img_width, elements, half);
+    compute_dataflow(convolved_stream, read_stream, coefficient, img_width, elements, half);
+    gray_convert_dataflow(write_stream, convolved_stream, elements);
+    write_dataflow(outFrame, write_stream, elements);
+  }
+}
@@ -40,4 +40,73 @@ void convolve_cpu(const RGBPixel* inFrame, RGBPixel* outFrame,
     }
 }
 
+void convolve_cpu_planar(const unsigned char* inFrame, unsigned char* outFrame,
+                         const float* coefficient, int coefficient_size,
+                         int img_width, int img_height)
+{
+    int center = coefficient_size / 2;
+    int plane_size = img_width * img_height;
+    for(int plane = 0; plane < PLANES; ++plane)
+    {
+        const unsigned char* in = inFrame + plane * plane_size;
+        unsigned char* out = outFrame + plane * plane_size;
+        for(int line = 0; line < img_height; ++line)
+        {
+            for(int pixel = 0; pixel < img_width; ++pixel)
+            {
+                float sum = 0;
+                for(int m = 0; m < coefficient_size; ++m)
+                {
+                    for(int n = 0; n < coefficient_size; ++n)
+                    {
+                        int ii = line + m - center;
+                        int jj = pixel + n - center;
+
+                        if(ii >= 0 && ii < img_height && jj >= 0 && jj < img_width)
+                        {
+                            sum += in[(ii * img_width) + jj] * coefficient[(m * coefficient_size) + n];
+                        }
+                    }
+                }
+                out[line * img_width + pixel] = fabsf(sum);
+            }
+        }
+    }
+}
+
+// Checks whether filter is the outer product of a column and a row vector,
+// close enough that no sum of the output moves by half an intensity level,
+// and if so returns them. The two passes still round differently from the 2D
+// sums, so a pixel truncated to an integer can come out one level apart.
+// Both vectors are scaled by the same power of two to similar magnitudes,
+// which keeps the factors of filters with power of two coefficients, like
+// gaussian, exact.
+bool separable_filter(const float* filter, int filter_size, float* column, float* row)
+{
+    int p = 0, q = 0;
+    for(int m = 0; m < filter_size; ++m)
+        for(int n = 0; n < filter_size; ++n)
+            if(fabsf(filter[m * filter_size + n]) > fabsf(filter[p * filter_size + q])) {
+                p = m;
+                q = n;
+            }
+    float pivot = filter[p * filter_size + q];
+    if(pivot == 0) return false;
+
+    for(int m = 0; m < filter_size; ++m) column[m] = filter[m * filter_size + q];
+    for(int n = 0; n < filter_size; ++n) row[n] = filter[p * filter_size + n] / pivot;
+
+    double error = 0;
+    for(int m = 0; m < filter_size; ++m)
+        for(int n = 0; n < filter_size; ++n)
+            error += fabs(filter[m * filter_size + n] - (double)column[m] * row[n]);
+    if(error * 255 >= 0.5) return false;
+
+    // The largest entry of row is 1, the one of column is |pivot|
+    int exponent = (int)floor(log2(fabsf(pivot)) / 2 + 0.5);
+    for(int m = 0; m < filter_size; ++m) column[m] = ldexpf(column[m], -exponent);
+    for(int n = 0; n < filter_size; ++n) row[n] = ldexpf(row[n], exponent);
+    return true;
+}
+
 }
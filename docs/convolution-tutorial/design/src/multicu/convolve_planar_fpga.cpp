@@ -0,0 +1,51 @@
+#include "constants.h"
+#include "kernels.h"
+#include "types.h"
+#include "convolve_window.h"
+
+// Planar version of convolve_fpga. Each plane of the frame is a one channel
+// image, convolved by the same read, compute and write dataflow as the RGBA
+// kernel, so the kernel moves 3 bytes per pixel each way instead of 4. The
+// planes go through the pipeline one after another, with a third of the
+// multipliers of convolve_fpga. The ports are a byte wide, so a frame takes
+// about 3 times the cycles of convolve_fpga, which reads a whole RGBPixel
+// per access: the layout saves PCIe bandwidth, not kernel time.
+extern "C"
+{
+
+  static void convolve_plane(const unsigned char* in, unsigned char* out,
+                             const float* coefficient, int img_width, int img_height) {
+      int half = COEFFICIENT_SIZE / 2;
+
+      hls::stream<unsigned char> read_stream("read");
+      hls::stream<unsigned char> write_stream("write");
+      int elements = img_width * img_height;
+
+#pragma HLS dataflow
+      read_dataflow(read_stream, in, img_width, elements, half);
+      compute_dataflow(write_stream, read_stream, coefficient, img_width, elements, half);
+      write_dataflow(out, write_stream, elements);
+  }
+
+  void convolve_planar_fpga(const unsigned char* inFrame, unsigned char* outFrame,
+                            const float* coefficient, int coefficient_size,
+                            int img_width, int img_height)
+  {
+#pragma HLS INTERFACE s_axilite port=return bundle=control
+#pragma HLS INTERFACE s_axilite port=inFrame bundle=control
+#pragma HLS INTERFACE s_axilite port=outFrame bundle=control
+#pragma HLS INTERFACE s_axilite port=img_height bundle=control
+#pragma HLS INTERFACE s_axilite port=img_width bundle=control
+#pragma HLS INTERFACE s_axilite port=coefficient bundle=control
+#pragma HLS INTERFACE s_axilite port=coefficient_size bundle=control
+#pragma HLS INTERFACE m_axi port=inFrame bundle=gmem1
+#pragma HLS INTERFACE m_axi port=outFrame bundle=gmem2
+#pragma HLS INTERFACE m_axi port=coefficient bundle=gmem3
+
+    int plane_size = img_width * img_height;
+    for(int plane = 0; plane < PLANES; plane++) {
+        convolve_plane(inFrame + plane * plane_size, outFrame + plane * plane_size,
+                       coefficient, img_width, img_height);
+    }
+  }
+}
@@ -0,0 +1,175 @@
+#include "constants.h"
+#include "kernels.h"
+#include "types.h"
+
+#include "ap_fixed.h"
+#include <hls_stream.h>
+
+// Coefficients of the column and row vectors, and the results of each pass
+typedef ap_fixed<24,4> coef_fixed;
+typedef ap_fixed<24,12> fixed;
+// Largest filter the kernel takes, smaller filters are centered in it
+#define COEFFICIENT_SIZE MAX_FILTER
+
+struct FixedPixel
+{
+    fixed r;
+    fixed g;
+    fixed b;
+};
+
+// Separable version of convolve_fpga. The coefficient buffer holds the column
+// vector followed by the row vector returned by separable_filter, and each
+// output pixel takes 2 * COEFFICIENT_SIZE multiply-adds per channel instead of
+// COEFFICIENT_SIZE * COEFFICIENT_SIZE.
+extern "C"
+{
+
+  static const RGBPixel zero = {0, 0, 0, 0};
+  static const FixedPixel fixed_zero = {0, 0, 0};
+
+  static void load_coefficients(coef_fixed coef[COEFFICIENT_SIZE], const float* coefficient,
+                                int coefficient_size) {
+      int offset = (COEFFICIENT_SIZE - coefficient_size) / 2;
+      for(int n = 0; n < COEFFICIENT_SIZE; n++) {
+          int k = n - offset;
+          coef[n] = (k >= 0 && k < coefficient_size) ? coefficient[k] : 0.0f;
+      }
+  }
+
+  static void read_separable(hls::stream<RGBPixel>& read_stream, const RGBPixel *in,
+                             int elements) {
+      int pixel = 0;
+      while(elements--) {
+          read_stream << in[pixel++];
+      }
+  }
+
+  // Row filter: shifts each line through a register window of COEFFICIENT_SIZE
+  // pixels, with zeros past both ends of the line
+  static void horizontal_separable(hls::stream<FixedPixel>& horizontal_stream, hls::stream<RGBPixel>& read_stream,
+                                   const float* coefficient, int coefficient_size,
+                                   int img_width, int img_height) {
+      const int center = COEFFICIENT_SIZE / 2;
+      coef_fixed row[COEFFICIENT_SIZE];
+#pragma HLS array_partition variable=row complete
+      RGBPixel window[COEFFICIENT_SIZE];
+#pragma HLS array_partition variable=window complete
+
+      load_coefficients(row, coefficient + coefficient_size, coefficient_size);
+
+      for(int line = 0; line < img_height; line++) {
+          for(int n = 0; n < COEFFICIENT_SIZE; n++) {
+              window[n] = zero;
+          }
+          for(int j = 0; j < img_width + center; j++) {
+#pragma HLS pipeline II=1
+              for(int n = 0; n < COEFFICIENT_SIZE - 1; n++) {
+                  window[n] = window[n + 1];
+              }
+              if(j < img_width) {
+                  read_stream >> window[COEFFICIENT_SIZE - 1];
+              } else {
+                  window[COEFFICIENT_SIZE - 1] = zero;
+              }
+              if(j >= center) {
+                  FixedPixel sum = fixed_zero;
+                  for(int n = 0; n < COEFFICIENT_SIZE; n++) {
+                      sum.r += window[n].r * row[n];
+                      sum.g += window[n].g * row[n];
+                      sum.b += window[n].b * row[n];
+                  }
+                  horizontal_stream << sum;
+              }
+          }
+      }
+  }
+
+  // Column filter: keeps the last COEFFICIENT_SIZE - 1 horizontally filtered
+  // lines, with zero lines above and below the image
+  static void vertical_separable(hls::stream<RGBPixel>& write_stream, hls::stream<FixedPixel>& horizontal_stream,
+                                 const float* coefficient, int coefficient_size,
+                                 int img_width, int img_height) {
+      const int center = COEFFICIENT_SIZE / 2;
+      static FixedPixel line_mem[COEFFICIENT_SIZE - 1][MAX_WIDTH];
+#pragma HLS array_partition variable=line_mem complete dim=1
+      coef_fixed column[COEFFICIENT_SIZE];
+#pragma HLS array_partition variable=column complete
+
+      load_coefficients(column, coefficient, coefficient_size);
+
+      for(int j = 0; j < img_width; j++) {
+          for(int m = 0; m < COEFFICIENT_SIZE - 1; m++) {
+              line_mem[m][j] = fixed_zero;
+          }
+      }
+
+      for(int line = 0; line < img_height + center; line++) {
+          for(int j = 0; j < img_width; j++) {
+#pragma HLS pipeline II=1
+              FixedPixel pixels[COEFFICIENT_SIZE];
+#pragma HLS array_partition variable=pixels complete
+              for(int m = 0; m < COEFFICIENT_SIZE - 1; m++) {
+                  pixels[m] = line_mem[m][j];
+              }
+              if(line < img_height) {
+                  horizontal_stream >> pixels[COEFFICIENT_SIZE - 1];
+              } else {
+                  pixels[COEFFICIENT_SIZE - 1] = fixed_zero;
+              }
+              for(int m = 0; m < COEFFICIENT_SIZE - 1; m++) {
+                  line_mem[m][j] = pixels[m + 1];
+              }
+              if(line >= center) {
+                  fixed sum_r = 0, sum_g = 0, sum_b = 0;
+                  for(int m = 0; m < COEFFICIENT_SIZE; m++) {
+                      sum_r += pixels[m].r * column[m];
+                      sum_g += pixels[m].g * column[m];
+                      sum_b += pixels[m].b * column[m];
+                  }
+                  RGBPixel out = {(unsigned char)sum_r.to_int(), (unsigned char)sum_g.to_int(),
+                                  (unsigned char)sum_b.to_int(), 0};
+                  write_stream << out;
+              }
+          }
+      }
+  }
+
+  static void write_separable(RGBPixel* outFrame, hls::stream<RGBPixel>& write_stream,
+                              int elements) {
+      int pixel = 0;
+      while(elements--) {
+          write_stream >> outFrame[pixel++];
+      }
+  }
+
+  void convolve_separable_fpga(const RGBPixel* inFrame, RGBPixel* outFrame,
+                               const float* coefficient, int coefficient_size,
+                               int img_width, int img_height)
+  {
+#pragma HLS INTERFACE s_axilite port=return bundle=control
+#pragma HLS INTERFACE s_axilite port=inFrame bundle=control
+#pragma HLS INTERFACE s_axilite port=outFrame bundle=control
+#pragma HLS INTERFACE s_axilite port=img_height bundle=control
+#pragma HLS INTERFACE s_axilite port=img_width bundle=control
+#pragma HLS INTERFACE s_axilite port=coefficient bundle=control
+#pragma HLS INTERFACE s_axilite port=coefficient_size bundle=control
+#pragma HLS INTERFACE m_axi port=inFrame bundle=gmem1
+#pragma HLS INTERFACE m_axi port=outFrame bundle=gmem2
+#pragma HLS INTERFACE m_axi port=coefficient bundle=gmem3
+#pragma HLS data_pack variable=inFrame
+#pragma HLS data_pack variable=outFrame
+
+    hls::stream<RGBPixel> read_stream("read");
+    hls::stream<FixedPixel> horizontal_stream("horizontal");
+    hls::stream<RGBPixel> write_stream("write");
+    int elements = img_width * img_height;
+
+#pragma HLS dataflow
+    read_separable(read_stream, inFrame, elements);
+    horizontal_separable(horizontal_stream, read_stream, coefficient, coefficient_size, img_width, img_height);
+    vertical_separable(write_stream, horizontal_stream, coefficient, coefficient_size, img_width, img_height);
+    write_separable(outFrame, write_stream, elements);
+
+  }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "constants.h"
+#include "types.h"
+
+#include "ap_fixed.h"
+#include <hls_stream.h>
+
+typedef ap_fixed<16,9> fixed;
+#define COEFFICIENT_SIZE 3
+
+// The read, compute and write stages of the 2D convolve kernels. The compute
+// stage keeps COEFFICIENT_SIZE lines of the frame in a line buffer window and
+// convolves the pixel at its center, for RGBA pixels in convolve_fpga and
+// convolve_grayscale_fpga, and for the bytes of a plane in
+// convolve_planar_fpga. window_pixel holds what differs between the two.
+template<typename Pixel> struct window_pixel;
+
+template<> struct window_pixel<RGBPixel> {
+    struct sum_type { fixed r, g, b; };
+
+    static RGBPixel zero() {
+        RGBPixel pixel = {0, 0, 0, 0};
+        return pixel;
+    }
+    static void clear(sum_type& sum) {
+        sum.r = 0;
+        sum.g = 0;
+        sum.b = 0;
+    }
+    static void add(sum_type& sum, const RGBPixel& pixel, fixed coef) {
+        sum.r += pixel.r * coef;
+        sum.g += pixel.g * coef;
+        sum.b += pixel.b * coef;
+    }
+    static RGBPixel result(const sum_type& sum) {
+        RGBPixel pixel = {(unsigned char)sum.r.to_int(), (unsigned char)sum.g.to_int(),
+                          (unsigned char)sum.b.to_int(), 0};
+        return pixel;
+    }
+};
+
+template<> struct window_pixel<unsigned char> {
+    typedef fixed sum_type;
+
+    static unsigned char zero() { return 0; }
+    static void clear(sum_type& sum) { sum = 0; }
+    static void add(sum_type& sum, unsigned char pixel, fixed coef) { sum += pixel * coef; }
+    static unsigned char result(const sum_type& sum) { return (unsigned char)sum.to_int(); }
+};
+
+template<typename Pixel>
+void read_dataflow(hls::stream<Pixel>& read_stream, const Pixel *in,
+                   int img_width, int elements, int half) {
+    int pixel = 0;
+    while(elements--) {
+        read_stream << in[pixel++];
+    }
+    int padding = img_width * half + COEFFICIENT_SIZE;
+    while(padding--) {
+        read_stream << window_pixel<Pixel>::zero();
+    }
+}
+
+template<typename Pixel>
+void compute_dataflow(hls::stream<Pixel>& write_stream, hls::stream<Pixel>& read_stream,
+                      const float* coefficient, int img_width, int elements, int center) {
+    typedef window_pixel<Pixel> traits;
+    const Pixel zero = traits::zero();
+
+    static Pixel window_mem[COEFFICIENT_SIZE][MAX_WIDTH];
+#pragma HLS data_pack variable=window_mem
+#pragma HLS array_partition variable=window_mem complete dim=1
+    static fixed coef[COEFFICIENT_SIZE * COEFFICIENT_SIZE];
+#pragma HLS array_partition variable=coef complete
+
+    for(int i  = 0; i < COEFFICIENT_SIZE*COEFFICIENT_SIZE; i++) {
+        coef[i] = coefficient[i];
+    }
+
+    int line_idx = 0;
+    while(line_idx < center) {
+        for(int i = 0; i < img_width; i++) {
+            window_mem[line_idx][i] = zero;
+        }
+        line_idx++;
+    }
+
+    while(line_idx < COEFFICIENT_SIZE - 1) {
+        for(int ii = 0; ii < img_width; ii++) {
+            read_stream >> window_mem[line_idx][ii];
+        }
+        line_idx++;
+    }
+
+    for(int ii = 0; ii < COEFFICIENT_SIZE; ii++) {
+        read_stream >> window_mem[line_idx][ii];
+    }
+
+    int top_idx = 0;
+    int insert_idx = line_idx;
+    int window_line_idx = top_idx;
+    int j = 0;
+    int insert_column_idx = COEFFICIENT_SIZE;
+    while(elements--) {
+        typename traits::sum_type sum;
+        traits::clear(sum);
+        for(int m = 0; m < COEFFICIENT_SIZE; ++m) {
+            for(int n = 0; n < COEFFICIENT_SIZE; ++n) {
+                int jj = j + n - center;
+                Pixel tmp = (jj >= 0 && jj < img_width) ? window_mem[window_line_idx][jj] : zero;
+                fixed coef_tmp = coef[m * COEFFICIENT_SIZE + n] * (jj >= 0 && jj < img_width);
+                traits::add(sum, tmp, coef_tmp);
+            }
+            window_line_idx = ((window_line_idx + 1) == COEFFICIENT_SIZE) ? 0 : window_line_idx + 1;
+        }
+        window_line_idx = top_idx;
+        write_stream << traits::result(sum);
+        j++;
+        if(j >= img_width) {
+            j = 0;
+            top_idx = ((top_idx + 1) == COEFFICIENT_SIZE) ? 0 : top_idx + 1;
+            window_line_idx = top_idx;
+        }
+        read_stream >> window_mem[insert_idx][insert_column_idx++];
+        if (insert_column_idx >= img_width) {
+            insert_column_idx = 0;
+            insert_idx = ((insert_idx + 1) == COEFFICIENT_SIZE) ? 0 : insert_idx + 1;
+        }
+    }
+}
+
+template<typename Pixel>
+void write_dataflow(Pixel* outFrame, hls::stream<Pixel>& write_stream,
+                    int elements) {
+    int pixel = 0;
+    while(elements--) {
+        write_stream >> outFrame[pixel++];
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdio>
+#include <memory>
+#include <tuple>
+
+#include "common.h"
+
+// Frames for convolve, in the layout of the arguments: get_frame_bytes bytes
+// of RGBA or planar gbrp pixels each
+class frame_source {
+public:
+  virtual ~frame_source() {}
+
+  // Reads the next frame into frame, returns the bytes read
+  virtual size_t read(unsigned char* frame, size_t bytes) = 0;
+};
+
+// Frames from convolve: RGBA, planar gbrp or gray pixels
+class frame_sink {
+public:
+  virtual ~frame_sink() {}
+
+  // Writes a frame, returns the bytes written
+  virtual size_t write(const unsigned char* frame, size_t bytes) = 0;
+};
+
+// Frames read from a stdio stream as they are, such as an ffmpeg pipe or a
+// file of raw frames. Closes the stream with close, if given.
+class stream_source : public frame_source {
+public:
+  stream_source(FILE* stream, int (*close)(FILE*) = nullptr) : stream(stream), close(close) {}
+  ~stream_source() { if(close) close(stream); }
+
+  size_t read(unsigned char* frame, size_t bytes) { return fread(frame, 1, bytes, stream); }
+
+private:
+  FILE* stream;
+  int (*close)(FILE*);
+};
+
+// Frames written to a stdio stream as they are, flushed one by one
+class stream_sink : public frame_sink {
+public:
+  stream_sink(FILE* stream, int (*close)(FILE*) = nullptr) : stream(stream), close(close) {}
+  ~stream_sink() { if(close) close(stream); }
+
+  size_t write(const unsigned char* frame, size_t bytes) {
+    size_t bytes_written = fwrite(frame, 1, bytes, stream);
+    fflush(stream);
+    return bytes_written;
+  }
+
+private:
+  FILE* stream;
+  int (*close)(FILE*);
+};
+
+// True if the video at path is read or written in process, without ffmpeg:
+// .y4m files, and raw frames in .rgba, .gbrp and .gray files
+bool in_process_video(const char* path);
+
+// Width, height and number of frames of the input video, found in process
+// for .y4m and raw files and with libav when built with USE_LIBAV. Raw frames
+// have no header, so their size comes from --scale. Returns zeros if the size
+// cannot be found this way.
+std::tuple<int, int, int> probe_video_size(const arguments& args);
+
+// Opens the input video: in process for .y4m and raw files, with libav when
+// built with USE_LIBAV, and through an ffmpeg pipe otherwise. Returns nullptr
+// if the video cannot be opened.
+std::unique_ptr<frame_source> open_frame_source(const arguments& args);
+
+// Opens the input video through an ffmpeg pipe, whatever its format
+std::unique_ptr<frame_source> open_ffmpeg_source(const arguments& args);
+
+// Opens the output video: in process for .y4m and raw files, and through an
+// ffmpeg pipe otherwise. Returns nullptr if the video cannot be opened.
+std::unique_ptr<frame_sink> open_frame_sink(const arguments& args);
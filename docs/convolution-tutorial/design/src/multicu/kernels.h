@@ -6,10 +6,22 @@ extern "C" {
   void convolve_cpu(const RGBPixel* inFrame, RGBPixel* outFrame, const float* filter, int filter_size, int img_width, int img_height);
   // Convert RGB video frame to grayscale
   void grayscale_cpu(const RGBPixel* inFrame, GrayPixel* outFrame, int img_width, int img_height);
+  // Convolve planar video frame with input filter
+  void convolve_cpu_planar(const unsigned char* inFrame, unsigned char* outFrame, const float* filter, int filter_size, int img_width, int img_height);
+  // Convert planar video frame to grayscale
+  void grayscale_cpu_planar(const unsigned char* inFrame, GrayPixel* outFrame, int img_width, int img_height);
+  // Returns true if filter is separable, with the column and row vectors it is the product of
+  bool separable_filter(const float* filter, int filter_size, float* column, float* row);
 
   // Convolve RGB video frame with input filter
   //void convolve_fpga(const RGBPixel* inFrame, RGBPixel* outFrame, const float* filter, int filter_size, int img_width, int img_height);
   void convolve_fpga(const RGBPixel* inFrame, RGBPixel* outFrame, const float* coefficient, int coefficient_size, int img_width, int img_height);
+  // Convolve RGB video frame with a separable filter, coefficient holds its column then its row vector
+  void convolve_separable_fpga(const RGBPixel* inFrame, RGBPixel* outFrame, const float* coefficient, int coefficient_size, int img_width, int img_height);
+  // Convolve planar video frame with input filter
+  void convolve_planar_fpga(const unsigned char* inFrame, unsigned char* outFrame, const float* coefficient, int coefficient_size, int img_width, int img_height);
+  // Convolve RGB video frame and convert it to grayscale on the device
+  void convolve_grayscale_fpga(const RGBPixel* inFrame, GrayPixel* outFrame, const float* coefficient, int coefficient_size, int img_width, int img_height);
   // Convert RGB video frame to grayscale
   void grayscale_fpga(const RGBPixel* inFrame, GrayPixel* outFrame, int img_width, int img_height);
 }
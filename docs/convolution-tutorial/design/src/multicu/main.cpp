@@ -2,23 +2,27 @@
 #include "common.h"
 #include "constants.h"
 #include "filters.h"
+#include "frame_io.h"
 
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
-#include <tuple>
+#include <memory>
 
 using std::chrono::duration;
 using std::chrono::system_clock;
-using std::tie;
 
 int main(int argc, char* argv[]) {
     // Parse command line
     arguments opt = parse_args(argc, argv);
-    int input_size = opt.width * opt.height * sizeof(RGBPixel);
+    int input_size = get_frame_bytes(opt);
 
-    FILE *streamIn, *streamOut;
-    tie(streamIn, streamOut) = get_streams(opt);
+    std::unique_ptr<frame_source> source = open_frame_source(opt);
+    std::unique_ptr<frame_sink> sink = open_frame_sink(opt);
+    if(!source || !sink) {
+        printf("\nError: cannot open %s\n", (source) ? opt.output_file : opt.input_file);
+        return EXIT_FAILURE;
+    }
 
     float* coefficients = gaussian;
     int coefficient_size = 3;
@@ -26,11 +30,11 @@ int main(int argc, char* argv[]) {
     printf("Processing %d frames of %s ...\n", opt.nframes, opt.input_file);
 
     auto start = system_clock::now();
-    convolve(streamIn, streamOut, coefficients, coefficient_size, opt);
+    convolve(*source, *sink, coefficients, coefficient_size, opt);
     float elapsed = duration<float>(system_clock::now() - start).count();
 
-    fflush(streamIn);
-    fflush(streamOut);
+    // Waits for the output to be encoded
+    sink.reset();
 
     double mbps = opt.nframes * input_size / 1024. / 1024. / elapsed;
     printf("\n\nProcessed %2.2f MB in %3.3fs (%3.2f MBps)\n\n",
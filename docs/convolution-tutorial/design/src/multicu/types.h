@@ -9,3 +9,7 @@ struct RGBPixel
 };
 
 typedef unsigned char GrayPixel;
+
+// Planar frames hold each channel of the whole frame in its own plane of
+// img_width * img_height bytes, in the plane order of ffmpeg's gbrp format
+enum { PLANE_G, PLANE_B, PLANE_R, PLANES };